@@ -0,0 +1,721 @@
+/**
+ * @file ws_bench.c
+ * @brief Load generator: contains `main()`
+ * @details Connects receivers (some of them deliberately slow) to the
+ * destination port of a running server, then senders to its source port. The
+ * senders send for a fixed duration, each at a fixed rate or as fast as they
+ * can, with message sizes drawn from a distribution and a share of the
+ * messages marked sensitive. Every payload starts with a `struct bench_stamp`
+ * recording when and by whom it was sent, so receivers can measure end-to-end
+ * latency and count what never arrived. Messages sent during an initial
+ * warm-up (while the server maps memory for the first messages of each size)
+ * are left out of the results, which are written to stdout as a JSON object.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <endian.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "args.h"
+#include "log.h"
+#include "socket.h"
+#include "ctmp.h"
+#include "checksum.h"
+#include "pool.h"
+#include "stats.h"
+#include "latency.h"
+
+#define MIN_SENDERS 1
+#define MAX_SENDERS 256
+#define DEFAULT_SENDERS 4  ///< default number of sender connections
+
+#define MIN_RECEIVERS 0
+#define MAX_RECEIVERS 256
+#define DEFAULT_RECEIVERS 4  ///< default number of (fast) receiver connections
+#define DEFAULT_SLOW_RECEIVERS 0  ///< no slow receivers by default
+#define DEFAULT_SLOW_RATE (1024 * 1024)  ///< default bytes per second a slow receiver reads
+
+#define DEFAULT_RATE 0  ///< send as fast as possible by default
+#define DEFAULT_SIZES "64-1024"  ///< default message size distribution
+#define DEFAULT_SENSITIVE 0  ///< no sensitive messages by default
+#define DEFAULT_DURATION_MS 5000  ///< default time to send for (after warming up)
+#define DEFAULT_WARMUP_MS 1000  ///< default time to send for before measuring
+#define DEFAULT_DRAIN_MS 1000  ///< default time to wait for receivers once senders stop
+#define DEFAULT_HOST "127.0.0.1"  ///< default server address
+
+#define MAX_SIZE_RANGES 16  ///< maximum number of size ranges in a distribution
+#define SEND_BATCH_MSGS 64  ///< maximum number of messages per send
+#define SEND_BUF_SIZE (SEND_BATCH_MSGS * MAX_FRAME_LENGTH)  ///< sender buffer size
+#define CONNECT_RETRIES 50  ///< connection attempts before giving up (server may still be starting)
+#define CONNECT_RETRY_MS 100  ///< time between connection attempts
+#define SETTLE_MS 200  ///< time for the server to set receivers up before sending
+
+/**
+ * @brief Start of every payload
+ * @details Fields are big-endian
+ */
+struct bench_stamp {
+	uint64_t send_ns;  ///< `CLOCK_MONOTONIC` time the message was sent at
+	uint32_t sender;  ///< index of the sender
+	uint32_t seq;  ///< number of messages the sender sent before this one
+} __attribute__((packed));
+
+#define MIN_MSG_LEN sizeof(struct bench_stamp)  ///< shortest payload (just the stamp)
+
+/**
+ * @brief Range of message sizes (payload bytes, inclusive)
+ */
+struct size_range {
+	uint16_t min;
+	uint16_t max;
+};
+
+/**
+ * @brief Benchmark settings
+ */
+struct bench_args {
+	bool extended;  ///< send extended CTMP?
+	int num_senders;  ///< number of sender connections
+	long rate;  ///< messages per second per sender (0 = as fast as possible)
+	char *sizes;  ///< message size distribution (as given)
+	struct size_range ranges[MAX_SIZE_RANGES];  ///< ranges sizes are drawn from (each equally likely)
+	int num_ranges;  ///< number of entries in `ranges`
+	int sensitive;  ///< percentage of messages marked sensitive
+	int num_receivers;  ///< number of (fast) receiver connections
+	int num_slow;  ///< number of slow receiver connections
+	long long slow_rate;  ///< bytes per second a slow receiver reads
+	int duration_ms;  ///< time to send for (after warming up)
+	int warmup_ms;  ///< time to send for before measuring
+	int drain_ms;  ///< time to wait for receivers once senders stop
+	char *host;  ///< server address
+};
+
+/**
+ * @brief Sender connection
+ */
+struct bench_sender {
+	int index;  ///< sender index (stamped on its messages)
+	int fd;  ///< socket file descriptor
+	unsigned int seed;  ///< random state for message sizes and options
+	uint64_t sent;  ///< messages sent, warm-up included
+	uint64_t msgs;  ///< messages sent after warming up
+	uint64_t bytes;  ///< frame bytes sent after warming up (headers included)
+	uint64_t sensitive;  ///< sensitive messages sent after warming up
+	pthread_t thread;
+};
+
+/**
+ * @brief Receiver connection
+ */
+struct bench_receiver {
+	int fd;  ///< socket file descriptor
+	bool slow;  ///< read at most `slow_rate` bytes per second?
+	bool closed;  ///< closed by the server before the end of the run
+	uint64_t msgs;  ///< messages received (sent after warming up)
+	uint64_t bytes;  ///< frame bytes received (headers included)
+	uint64_t last_ns;  ///< time the last message was received at
+	struct ingest_counters counters;  ///< frames dropped on receipt
+	struct latency_hist *latency;  ///< send to receive latency (ns)
+	pthread_t thread;
+};
+
+static struct bench_args bench_args;  ///< benchmark settings
+static uint64_t warmup_ns;  ///< time senders start sending at
+static uint64_t start_ns;  ///< time measuring starts at (warm-up over)
+static uint64_t stop_ns;  ///< time senders stop sending at
+static atomic_bool stopping = false;  ///< run over: receivers are being shut down
+
+static char *short_opts = "ehn:m:z:x:N:w:W:d:u:D:a:";  ///< short option characters
+static struct option long_opts[] = {
+	{"extended", no_argument, NULL, 'e'},
+	{"help", no_argument, NULL, 'h'},
+	{"senders", required_argument, NULL, 'n'},
+	{"rate", required_argument, NULL, 'm'},
+	{"sizes", required_argument, NULL, 'z'},
+	{"sensitive", required_argument, NULL, 'x'},
+	{"receivers", required_argument, NULL, 'N'},
+	{"slow-receivers", required_argument, NULL, 'w'},
+	{"slow-rate", required_argument, NULL, 'W'},
+	{"duration", required_argument, NULL, 'd'},
+	{"warmup", required_argument, NULL, 'u'},
+	{"drain", required_argument, NULL, 'D'},
+	{"address", required_argument, NULL, 'a'},
+	/* terminate option list with zeroed-struct */
+	{NULL, 0, NULL, 0}
+};
+
+/**
+ * @brief Print program usage
+ * @param prog_name name of executable (`argv[0]`)
+ */
+void bench_usage(char *prog_name)
+{
+	printf("usage: %s [OPTIONS]\n"
+	       "-e, --extended: send extended CTMP (the server must run with -e)\n"
+	       "-n, --senders <NUM>: number of sender connections\n"
+	       "-m, --rate <MSGS>: messages per second per sender (0 = as fast as possible)\n"
+	       "-z, --sizes <SIZE>[,<SIZE>...]: payload sizes, each N or MIN-MAX (picked with equal probability)\n"
+	       "-x, --sensitive <PERCENT>: percentage of messages marked sensitive (needs -e)\n"
+	       "-N, --receivers <NUM>: number of receiver connections\n"
+	       "-w, --slow-receivers <NUM>: number of additional receivers that read slowly\n"
+	       "-W, --slow-rate <BYTES>[K|M|G]: bytes per second a slow receiver reads\n"
+	       "-d, --duration <DURATION>: time to measure for in seconds (or milliseconds with an ms suffix)\n"
+	       "-u, --warmup <DURATION>: time to send for before measuring (0 = none)\n"
+	       "-D, --drain <DURATION>: time to wait for receivers once senders stop\n"
+	       "-a, --address <ADDR>: IPv4 address of the server\n"
+	       "-h, --help: print this message and exit\n", basename(prog_name));
+}
+
+/**
+ * @brief Parse a message size distribution
+ * @param sizes comma-separated list of sizes (`N`) or size ranges (`MIN-MAX`)
+ * @return true if valid (`bench_args.ranges` set), false otherwise
+ * @details Sizes must be between `MIN_MSG_LEN` and `UINT16_MAX`
+ */
+bool parse_sizes(char *sizes)
+{
+	char *copy, *token, *save, *end;
+	long min, max;
+	bool valid = true;
+
+	copy = strdup(sizes);
+	if (!copy) {
+		p_error("strdup", errno);
+		exit(errno);
+	}
+
+	bench_args.num_ranges = 0;
+	for (token = strtok_r(copy, ",", &save); token && valid;
+			token = strtok_r(NULL, ",", &save)) {
+		min = strtol(token, &end, 10);
+		max = min;
+		if (*end == '-') {
+			max = strtol(end + 1, &end, 10);
+		}
+		if (*end != '\0' || min < (long) MIN_MSG_LEN || max < min
+				|| max > UINT16_MAX
+				|| bench_args.num_ranges == MAX_SIZE_RANGES) {
+			valid = false;
+			break;
+		}
+		bench_args.ranges[bench_args.num_ranges].min = min;
+		bench_args.ranges[bench_args.num_ranges++].max = max;
+	}
+
+	free(copy);
+	return valid && bench_args.num_ranges > 0;
+}
+
+/**
+ * @brief Parse an integer argument within bounds
+ * @param name argument name (for error messages)
+ * @param arg argument
+ * @param min minimum value
+ * @param max maximum value
+ * @return value (exits if invalid)
+ */
+int parse_int_arg(const char *name, const char *arg, int min, int max)
+{
+	int val = atoi(arg);
+
+	if (!valid_int_arg(val, min, max)) {
+		pr_arg_err(name, val, min, max);
+		exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
+/**
+ * @brief Parse command-line arguments into `bench_args`
+ * @param argc argument count
+ * @param argv arguments
+ */
+void parse_bench_args(int argc, char *argv[])
+{
+	int opt, option_index = 0;
+
+	bench_args.extended = false;
+	bench_args.num_senders = DEFAULT_SENDERS;
+	bench_args.rate = DEFAULT_RATE;
+	bench_args.sizes = DEFAULT_SIZES;
+	bench_args.sensitive = DEFAULT_SENSITIVE;
+	bench_args.num_receivers = DEFAULT_RECEIVERS;
+	bench_args.num_slow = DEFAULT_SLOW_RECEIVERS;
+	bench_args.slow_rate = DEFAULT_SLOW_RATE;
+	bench_args.duration_ms = DEFAULT_DURATION_MS;
+	bench_args.warmup_ms = DEFAULT_WARMUP_MS;
+	bench_args.drain_ms = DEFAULT_DRAIN_MS;
+	bench_args.host = DEFAULT_HOST;
+
+	while ((opt = getopt_long(argc, argv, short_opts, long_opts, &option_index)) != -1) {
+		switch (opt) {
+		case 'e':
+			bench_args.extended = true;
+			break;
+		case 'h':
+			bench_usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'n':
+			bench_args.num_senders = parse_int_arg("number of senders",
+					optarg, MIN_SENDERS, MAX_SENDERS);
+			break;
+		case 'm':
+			bench_args.rate = parse_int_arg("rate", optarg, 0, INT_MAX);
+			break;
+		case 'z':
+			bench_args.sizes = optarg;
+			break;
+		case 'x':
+			bench_args.sensitive = parse_int_arg("sensitive percentage",
+					optarg, 0, 100);
+			break;
+		case 'N':
+			bench_args.num_receivers = parse_int_arg("number of receivers",
+					optarg, MIN_RECEIVERS, MAX_RECEIVERS);
+			break;
+		case 'w':
+			bench_args.num_slow = parse_int_arg("number of slow receivers",
+					optarg, MIN_RECEIVERS, MAX_RECEIVERS);
+			break;
+		case 'W':
+			bench_args.slow_rate = parse_size(optarg);
+			if (bench_args.slow_rate <= 0) {
+				pr_err("invalid slow receiver rate %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'd':
+		case 'u':
+		case 'D':
+			if (parse_duration_ms(optarg) < (opt == 'd')) {
+				pr_err("invalid duration %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			if (opt == 'd') {
+				bench_args.duration_ms = parse_duration_ms(optarg);
+			} else if (opt == 'u') {
+				bench_args.warmup_ms = parse_duration_ms(optarg);
+			} else {
+				bench_args.drain_ms = parse_duration_ms(optarg);
+			}
+			break;
+		case 'a':
+			bench_args.host = optarg;
+			break;
+		default:
+			/* invalid argument: print usage and exit */
+			bench_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!parse_sizes(bench_args.sizes)) {
+		pr_err("invalid sizes %s: must be N or MIN-MAX between %zu and %d\n",
+				bench_args.sizes, MIN_MSG_LEN, UINT16_MAX);
+		exit(EXIT_FAILURE);
+	}
+	if (bench_args.sensitive > 0 && !bench_args.extended) {
+		pr_err("sensitive messages need extended CTMP (-e)\n");
+		exit(EXIT_FAILURE);
+	}
+	if (bench_args.num_receivers + bench_args.num_slow == 0) {
+		pr_err("need at least one receiver\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * @brief Read `CLOCK_MONOTONIC` in nanoseconds
+ * @return time in nanoseconds
+ */
+uint64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Sleep until a given time
+ * @param until `CLOCK_MONOTONIC` time in nanoseconds
+ */
+void sleep_until_ns(uint64_t until)
+{
+	struct timespec deadline = {
+		.tv_sec = until / 1000000000ULL,
+		.tv_nsec = until % 1000000000ULL
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+				NULL) == EINTR);
+}
+
+/**
+ * @brief Connect to the server
+ * @param port port to connect to
+ * @return socket file descriptor, -1 if the server could not be reached
+ * @details Retries for up to `CONNECT_RETRIES` attempts, in case the server is
+ * still starting up
+ */
+int connect_server(int port)
+{
+	int fd;
+	struct sockaddr_in address = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port)
+	};
+
+	if (inet_pton(AF_INET, bench_args.host, &address.sin_addr) != 1) {
+		pr_err("invalid address %s\n", bench_args.host);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < CONNECT_RETRIES; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			p_error("socket", errno);
+			exit(errno);
+		}
+		if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+			return fd;
+		}
+		close(fd);
+		usleep(CONNECT_RETRY_MS * 1000);
+	}
+
+	pr_err("could not connect to %s:%d: %s\n", bench_args.host, port,
+			strerror(errno));
+	return -1;
+}
+
+/**
+ * @brief Pick the payload size of a message
+ * @param seed random state
+ * @return size in bytes
+ */
+uint16_t pick_size(unsigned int *seed)
+{
+	struct size_range *range;
+
+	range = &bench_args.ranges[rand_r(seed) % bench_args.num_ranges];
+	return range->min + rand_r(seed) % (range->max - range->min + 1);
+}
+
+/**
+ * @brief Write a message frame
+ * @param sender sender of the message
+ * @param frame buffer to write to (at least `HEADER_LENGTH + len` bytes)
+ * @param len payload length
+ * @param send_ns time to stamp the message with
+ * @details The payload is the stamp followed by filler. Sensitive messages
+ * carry a valid checksum. Only messages sent after warming up are counted.
+ */
+void write_frame(struct bench_sender *sender, unsigned char *frame,
+		uint16_t len, uint64_t send_ns)
+{
+	uint16_t checksum;
+	bool sensitive = false;
+	struct bench_stamp stamp = {
+		.send_ns = htobe64(send_ns),
+		.sender = htobe32(sender->index),
+		.seq = htobe32(sender->sent)
+	};
+
+	memset(frame, PADDING, HEADER_LENGTH);
+	frame[0] = MAGIC;
+	frame[LENGTH_OFFSET] = len >> 8;
+	frame[LENGTH_OFFSET+1] = len & 0xff;
+	memcpy(&frame[HEADER_LENGTH], &stamp, sizeof(stamp));
+
+	if (bench_args.extended && (int) (rand_r(&sender->seed) % 100)
+			< bench_args.sensitive) {
+		frame[OPTIONS_OFFSET] = OPT_SEN;
+		checksum = calc_checksum(frame, &frame[HEADER_LENGTH], len);
+		frame[CHECKSUM_OFFSET] = checksum & 0xff;
+		frame[CHECKSUM_OFFSET+1] = checksum >> 8;
+		sensitive = true;
+	}
+
+	sender->sent++;
+	if (send_ns >= start_ns) {
+		sender->msgs++;
+		sender->bytes += HEADER_LENGTH + len;
+		sender->sensitive += sensitive;
+	}
+}
+
+/**
+ * @brief Run sender
+ * @param data sender (`struct bench_sender`)
+ * @details Send batches of up to `SEND_BATCH_MSGS` messages from `warmup_ns`
+ * until `stop_ns`. With a rate, each batch holds only the messages due by then,
+ * and the sender sleeps until the next one is due.
+ */
+void *run_sender(void *data)
+{
+	struct bench_sender *sender = data;
+	unsigned char *buf;
+	uint64_t now, due, num_due;
+	uint16_t len;
+	size_t buf_len;
+
+	buf = malloc(SEND_BUF_SIZE);
+	if (!buf) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	/* filler after the stamp */
+	memset(buf, 0x5a, SEND_BUF_SIZE);
+
+	sleep_until_ns(warmup_ns);
+	while ((now = now_ns()) < stop_ns) {
+		num_due = SEND_BATCH_MSGS;
+		if (bench_args.rate > 0) {
+			due = (now - warmup_ns) * bench_args.rate / 1000000000ULL + 1;
+			if (due <= sender->sent) {
+				sleep_until_ns(warmup_ns + sender->sent * 1000000000ULL
+						/ bench_args.rate);
+				continue;
+			}
+			num_due = due - sender->sent;
+			if (num_due > SEND_BATCH_MSGS) {
+				num_due = SEND_BATCH_MSGS;
+			}
+		}
+
+		buf_len = 0;
+		for (uint64_t i = 0; i < num_due; i++) {
+			len = pick_size(&sender->seed);
+			write_frame(sender, &buf[buf_len], len, now);
+			buf_len += HEADER_LENGTH + len;
+		}
+
+		if (send_msg(sender->fd, buf, buf_len) < 0) {
+			pr_err("sender %d: connection closed\n", sender->index);
+			break;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/**
+ * @brief Run receiver
+ * @param data receiver (`struct bench_receiver`)
+ * @details Parse and count every message sent after warming up, recording its
+ * latency from the stamp, until the connection is shut down. Slow receivers
+ * sleep after each read for as long as reading that much should take at
+ * `slow_rate`.
+ */
+void *run_receiver(void *data)
+{
+	struct bench_receiver *receiver = data;
+	struct ctmp_stream stream;
+	struct ctmp_msg *msg;
+	struct bench_stamp stamp;
+	ssize_t bytes_read;
+	uint64_t now, send_ns;
+
+	init_ctmp_stream(&stream, receiver->fd, bench_args.extended, 0,
+			&receiver->counters);
+
+	while ((bytes_read = fill_ctmp_stream(&stream)) > 0) {
+		now = now_ns();
+		while ((msg = next_ctmp_msg(&stream))) {
+			memcpy(&stamp, msg->data, sizeof(stamp));
+			send_ns = be64toh(stamp.send_ns);
+			if (send_ns >= start_ns) {
+				add_latency(receiver->latency, now - send_ns);
+				receiver->msgs++;
+				receiver->bytes += HEADER_LENGTH + msg->len;
+				receiver->last_ns = now;
+			}
+			free_ctmp_msg(msg);
+		}
+
+		if (receiver->slow) {
+			sleep_until_ns(now + bytes_read * 1000000000ULL
+					/ bench_args.slow_rate);
+		}
+	}
+
+	receiver->closed = !atomic_load(&stopping);
+	free_ctmp_stream(&stream);
+	return NULL;
+}
+
+/**
+ * @brief Write the results of a class of receivers as a JSON object
+ * @param out stream to write to
+ * @param receivers receivers
+ * @param num_receivers number of receivers
+ * @param sent number of messages sent in total (due to every receiver)
+ * @details Rates are averaged from the end of the warm-up to the last message
+ * received. Drops are messages sent that a receiver never received (counted
+ * once per receiver).
+ */
+void write_receiver_results(FILE *out, struct bench_receiver *receivers,
+		int num_receivers, uint64_t sent)
+{
+	uint64_t msgs = 0, bytes = 0, bad_checksum = 0, last_ns = start_ns;
+	int closed = 0;
+	double secs;
+	struct latency_hist *latency;
+
+	latency = calloc(1, sizeof(struct latency_hist));
+	if (!latency) {
+		p_error("calloc", errno);
+		exit(errno);
+	}
+
+	for (int i = 0; i < num_receivers; i++) {
+		msgs += receivers[i].msgs;
+		bytes += receivers[i].bytes;
+		bad_checksum += receivers[i].counters.bad_checksum;
+		closed += receivers[i].closed;
+		if (receivers[i].last_ns > last_ns) {
+			last_ns = receivers[i].last_ns;
+		}
+		merge_latency_hist(latency, receivers[i].latency);
+	}
+	secs = (last_ns > start_ns) ? (last_ns - start_ns) / 1e9 : 1;
+
+	fprintf(out, "{\"receivers\": %d, \"msgs\": %lu, \"bytes\": %lu, \"msgs_per_sec\": %.1f, \"bytes_per_sec\": %.1f, \"drops\": %lu, \"bad_checksum\": %lu, \"closed\": %d,\n    \"latency\": ",
+			num_receivers, msgs, bytes, msgs / secs, bytes / secs,
+			sent * num_receivers - msgs, bad_checksum, closed);
+	write_latency_hist(out, latency, 1);
+	fprintf(out, "}");
+
+	free(latency);
+}
+
+/**
+ * @brief Write the benchmark results as a JSON object
+ * @param out stream to write to
+ * @param senders senders (finished)
+ * @param receivers fast receivers followed by slow receivers (finished)
+ */
+void write_results(FILE *out, struct bench_sender *senders,
+		struct bench_receiver *receivers)
+{
+	uint64_t msgs = 0, bytes = 0, sensitive = 0;
+	double secs = bench_args.duration_ms / 1000.0;
+
+	for (int i = 0; i < bench_args.num_senders; i++) {
+		msgs += senders[i].msgs;
+		bytes += senders[i].bytes;
+		sensitive += senders[i].sensitive;
+	}
+
+	fprintf(out, "{\n  \"config\": {\"extended\": %s, \"senders\": %d, \"rate\": %ld, \"sizes\": \"%s\", \"sensitive_pct\": %d, \"receivers\": %d, \"slow_receivers\": %d, \"slow_rate\": %lld, \"duration_ms\": %d, \"warmup_ms\": %d},\n",
+			bench_args.extended ? "true" : "false",
+			bench_args.num_senders, bench_args.rate, bench_args.sizes,
+			bench_args.sensitive, bench_args.num_receivers,
+			bench_args.num_slow, bench_args.slow_rate,
+			bench_args.duration_ms, bench_args.warmup_ms);
+	fprintf(out, "  \"sent\": {\"msgs\": %lu, \"bytes\": %lu, \"msgs_per_sec\": %.1f, \"bytes_per_sec\": %.1f, \"sensitive\": %lu},\n",
+			msgs, bytes, msgs / secs, bytes / secs, sensitive);
+	fprintf(out, "  \"received\": ");
+	write_receiver_results(out, receivers, bench_args.num_receivers, msgs);
+	fprintf(out, ",\n  \"slow_received\": ");
+	write_receiver_results(out, &receivers[bench_args.num_receivers],
+			bench_args.num_slow, msgs);
+	fprintf(out, "\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int num_receivers;
+	struct bench_sender *senders;
+	struct bench_receiver *receivers;
+
+	parse_bench_args(argc, argv);
+	num_receivers = bench_args.num_receivers + bench_args.num_slow;
+
+	init_checksum();
+	init_pool(false, -1);
+
+	senders = calloc(bench_args.num_senders, sizeof(struct bench_sender));
+	receivers = calloc(num_receivers, sizeof(struct bench_receiver));
+	if (!senders || !receivers) {
+		p_error("calloc", errno);
+		exit(errno);
+	}
+
+	/* receivers first: every message is due to all of them */
+	for (int i = 0; i < num_receivers; i++) {
+		receivers[i].fd = connect_server(DST_PORT);
+		if (receivers[i].fd < 0) {
+			exit(EXIT_FAILURE);
+		}
+		receivers[i].slow = (i >= bench_args.num_receivers);
+		receivers[i].latency = calloc(1, sizeof(struct latency_hist));
+		if (!receivers[i].latency) {
+			p_error("calloc", errno);
+			exit(errno);
+		}
+	}
+	for (int i = 0; i < bench_args.num_senders; i++) {
+		senders[i].index = i;
+		senders[i].seed = i + 1;
+		senders[i].fd = connect_server(SRC_PORT);
+		if (senders[i].fd < 0) {
+			exit(EXIT_FAILURE);
+		}
+		/* batches are already as large as they can be: don't let Nagle's
+		 * algorithm hold them back */
+		apply_socket_profile(senders[i].fd, PROFILE_LATENCY);
+	}
+
+	warmup_ns = now_ns() + SETTLE_MS * 1000000ULL;
+	start_ns = warmup_ns + bench_args.warmup_ms * 1000000ULL;
+	stop_ns = start_ns + bench_args.duration_ms * 1000000ULL;
+	for (int i = 0; i < num_receivers; i++) {
+		pthread_create(&receivers[i].thread, NULL, run_receiver,
+				&receivers[i]);
+	}
+	for (int i = 0; i < bench_args.num_senders; i++) {
+		pthread_create(&senders[i].thread, NULL, run_sender, &senders[i]);
+	}
+
+	for (int i = 0; i < bench_args.num_senders; i++) {
+		pthread_join(senders[i].thread, NULL);
+		close(senders[i].fd);
+	}
+
+	/* give receivers time to catch up, then shut them down */
+	sleep_until_ns(now_ns() + bench_args.drain_ms * 1000000ULL);
+	atomic_store(&stopping, true);
+	for (int i = 0; i < num_receivers; i++) {
+		shutdown(receivers[i].fd, SHUT_RDWR);
+	}
+	for (int i = 0; i < num_receivers; i++) {
+		pthread_join(receivers[i].thread, NULL);
+		close(receivers[i].fd);
+	}
+
+	write_results(stdout, senders, receivers);
+
+	for (int i = 0; i < num_receivers; i++) {
+		free(receivers[i].latency);
+	}
+	free(receivers);
+	free(senders);
+
+	return EXIT_SUCCESS;
+}
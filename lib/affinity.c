@@ -0,0 +1,186 @@
+/**
+ * @file affinity.c
+ * @brief Definitions of functions for CPU affinity and NUMA placement
+ */
+
+#define _GNU_SOURCE  /* cpu_set_t, pthread_setaffinity_np() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+#include "log.h"
+
+/**
+ * @brief CPU sets threads are pinned to
+ */
+struct cpu_groups {
+	cpu_set_t sets[MAX_CPU_GROUPS];
+	int num_sets;
+};
+
+static cpu_set_t process_cpus;  ///< CPUs the process was started with
+static bool have_process_cpus;  ///< whether `process_cpus` has been saved
+
+/**
+ * @brief Parse a single CPU list
+ * @param list CPU list (e.g. `0-3,8`), terminated by `\0` or `:`
+ * @param set CPU set to fill
+ * @return pointer past the end of the list, NULL if it is invalid
+ */
+static const char *parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	while (1) {
+		first = strtol(list, &end, 10);
+		if (end == list || first < 0 || first >= CPU_SETSIZE) {
+			return NULL;
+		}
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first || last >= CPU_SETSIZE) {
+				return NULL;
+			}
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			CPU_SET(cpu, set);
+		}
+
+		if (*end != ',') {
+			return end;
+		}
+		list = end + 1;
+	}
+}
+
+/**
+ * @brief Parse a group list: one or more CPU lists separated by `:`
+ * @param list group list (e.g. `0-3:8-11`)
+ * @return allocated CPU groups, NULL if the list is invalid
+ */
+struct cpu_groups *parse_cpu_groups(const char *list)
+{
+	struct cpu_groups *groups;
+
+	groups = malloc(sizeof(struct cpu_groups));
+	if (!groups) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+
+	groups->num_sets = 0;
+	while (groups->num_sets < MAX_CPU_GROUPS) {
+		list = parse_cpu_list(list, &groups->sets[groups->num_sets++]);
+		if (!list || (*list != ':' && *list != '\0')) {
+			break;
+		} else if (*list == '\0') {
+			return groups;
+		}
+		list++;
+	}
+
+	free(groups);
+	return NULL;
+}
+
+/**
+ * @brief Save the CPUs the process may run on, before any thread is pinned
+ * @details Threads left unpinned are reset to these CPUs, rather than
+ * inheriting the CPU set of the (possibly pinned) thread that created them
+ */
+void init_affinity(void)
+{
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &process_cpus) < 0) {
+		p_error("sched_getaffinity", errno);
+		return;
+	}
+	have_process_cpus = true;
+}
+
+/**
+ * @brief Pin a thread to one of a number of CPU sets
+ * @param thread thread to pin
+ * @param groups CPU sets (NULL: leave the thread unpinned, on the CPUs saved by
+ * `init_affinity()`)
+ * @param index index of the thread among threads of its kind: the thread is
+ * pinned to set `index % num_sets`
+ * @param name kind of thread (for logging)
+ * @details Failure (e.g. a CPU that is offline or outside the cpuset of the
+ * process) is reported but not fatal
+ */
+void pin_thread(pthread_t thread, struct cpu_groups *groups, int index,
+		const char *name)
+{
+	int res;
+
+	if (!groups && !have_process_cpus) {
+		return;
+	}
+
+	res = pthread_setaffinity_np(thread, sizeof(cpu_set_t), groups
+			? &groups->sets[index % groups->num_sets] : &process_cpus);
+	if (res != 0 && groups) {
+		pr_err("unable to pin %s thread %d: %s\n", name, index,
+				strerror(res));
+	}
+}
+
+/**
+ * @brief Find the NUMA node of the first CPU of a group list
+ * @param groups CPU sets
+ * @return node number, -1 if unknown
+ */
+int cpu_groups_node(struct cpu_groups *groups)
+{
+	char path[64];
+	int cpu = 0;
+
+	while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &groups->sets[0])) {
+		cpu++;
+	}
+
+	/* /sys/devices/system/cpu/cpuN has a nodeM link to its node */
+	for (int node = 0; node < MAX_NUMA_NODES; node++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d",
+				cpu, node);
+		if (access(path, F_OK) == 0) {
+			return node;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Prefer to place a memory range on a given NUMA node
+ * @param addr start of range (page-aligned, not yet touched)
+ * @param len length of range
+ * @param node node number (-1: leave the default first-touch placement)
+ * @details Uses the `mbind()` system call directly, so libnuma is not needed.
+ * Falls back to other nodes if the preferred node runs out of memory.
+ */
+void bind_to_node(void *addr, size_t len, int node)
+{
+	unsigned long nodemask;
+
+	if (node < 0) {
+		return;
+	}
+
+	nodemask = 1UL << node;
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &nodemask,
+				MAX_NUMA_NODES + 1, 0) < 0) {
+		p_error("mbind", errno);
+	}
+}
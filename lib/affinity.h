@@ -0,0 +1,22 @@
+/**
+ * @file affinity.h
+ * @brief Constants, structs, and functions for CPU affinity and NUMA placement
+ * @details CPU lists use the same syntax as `taskset -c` (e.g. `0-3,8`). A
+ * group list separates several CPU lists with `:`, and the i-th thread of a
+ * kind is pinned to group i (modulo the number of groups).
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define MAX_CPU_GROUPS 16  ///< maximum number of CPU sets in a group list
+#define MAX_NUMA_NODES 64  ///< NUMA nodes supported (one `unsigned long` node mask)
+
+struct cpu_groups;
+
+struct cpu_groups *parse_cpu_groups(const char *list);
+void init_affinity(void);
+void pin_thread(pthread_t thread, struct cpu_groups *groups, int index,
+		const char *name);
+int cpu_groups_node(struct cpu_groups *groups);
+void bind_to_node(void *addr, size_t len, int node);
@@ -5,12 +5,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libgen.h>
 
+#include "ctmp.h"
+#include "lag.h"
+#include "budget.h"
+#include "affinity.h"
+#include "socket.h"
+#include "latency.h"
 #include "args.h"
 #include "log.h"
 
-static char *short_opts = "ehn:b:t:";  ///< short option characters
+static char *short_opts = "ehHTcROwun:s:E:b:t:q:Q:F:D:G:Y:X:L:B:A:P:S:Z:p:r:k:l:I:W:C:M:";  ///< short option characters
 
 /**
  * @brief Long options
@@ -20,8 +27,38 @@ static struct option long_opts[]  = {
 	{"help", no_argument, NULL, 'h'},
 	{"extended", no_argument, NULL, 'e'},
 	{"num-workers", required_argument, NULL, 'n'},
+	{"src-threads", required_argument, NULL, 's'},
+	{"egress-threads", required_argument, NULL, 'E'},
 	{"backlog", required_argument, NULL, 'b'},
 	{"ttl", required_argument, NULL, 't'},
+	{"msg-ttl", no_argument, NULL, 'T'},
+	{"channels", no_argument, NULL, 'c'},
+	{"replay", no_argument, NULL, 'R'},
+	{"queue-len", required_argument, NULL, 'q'},
+	{"overwrite", no_argument, NULL, 'w'},
+	{"max-queue-bytes", required_argument, NULL, 'Q'},
+	{"queue-full", required_argument, NULL, 'F'},
+	{"log-dir", required_argument, NULL, 'D'},
+	{"log-segment-size", required_argument, NULL, 'G'},
+	{"log-max-age", required_argument, NULL, 'Y'},
+	{"log-max-bytes", required_argument, NULL, 'X'},
+	{"max-lag", required_argument, NULL, 'L'},
+	{"max-lag-bytes", required_argument, NULL, 'B'},
+	{"max-lag-age", required_argument, NULL, 'A'},
+	{"lag-policy", required_argument, NULL, 'P'},
+	{"huge-pages", no_argument, NULL, 'H'},
+	{"io-uring", no_argument, NULL, 'u'},
+	{"splice", required_argument, NULL, 'S'},
+	{"zerocopy", required_argument, NULL, 'Z'},
+	{"src-profile", required_argument, NULL, 'p'},
+	{"dst-profile", required_argument, NULL, 'r'},
+	{"receiver-profiles", no_argument, NULL, 'O'},
+	{"stats-socket", required_argument, NULL, 'k'},
+	{"latency", required_argument, NULL, 'l'},
+	{"ingest-cpus", required_argument, NULL, 'I'},
+	{"worker-cpus", required_argument, NULL, 'W'},
+	{"cleanup-cpus", required_argument, NULL, 'C'},
+	{"mem-node", required_argument, NULL, 'M'},
 	/* terminate option list with zeroed-struct */
 	{NULL, 0, NULL, 0}
 };
@@ -35,8 +72,38 @@ void usage(char *prog_name)
 	printf("usage: %s [OPTIONS]\n"
 	       "-e, --extended: use extended CTMP\n"
 	       "-n, --num-workers <NUM>: maximum number of client worker threads to use\n"
+	       "-s, --src-threads <NUM>: number of threads receiving from source clients\n"
+	       "-E, --egress-threads <NUM>: serve receivers from NUM event-driven threads instead of one thread each\n"
 	       "-b, --backlog <LEN>: backlog length for listen(2)\n"
-	       "-t, --ttl <DURATION>: message time to live in seconds\n"
+	       "-t, --ttl <DURATION>: message time to live in seconds (or milliseconds with an ms suffix)\n"
+	       "-T, --msg-ttl: accept per-message TTLs from extended CTMP headers\n"
+	       "-c, --channels: accept channel IDs from extended CTMP headers and let receivers subscribe to channels\n"
+	       "-R, --replay: retain messages for their TTL and let receivers replay them\n"
+	       "-q, --queue-len <LEN>: number of messages the queue holds\n"
+	       "-w, --overwrite: overwrite the oldest message when the queue is full instead of pausing sources\n"
+	       "-Q, --max-queue-bytes <BYTES>[K|M|G]: maximum memory held by queued messages\n"
+	       "-F, --queue-full <POLICY>: evict the oldest messages or apply backpressure to sources when over --max-queue-bytes\n"
+	       "-D, --log-dir <DIR>: append every message to a memory-mapped log in DIR (replayed from with --replay)\n"
+	       "-G, --log-segment-size <BYTES>[K|M|G]: size of each message log segment file\n"
+	       "-Y, --log-max-age <SECONDS>: delete logged messages older than SECONDS (0 = keep)\n"
+	       "-X, --log-max-bytes <BYTES>[K|M|G]: delete the oldest logged messages beyond BYTES on disk (0 = no limit)\n"
+	       "-L, --max-lag <NUM>: maximum number of messages a receiver may lag behind\n"
+	       "-B, --max-lag-bytes <BYTES>: maximum number of bytes a receiver may lag behind\n"
+	       "-A, --max-lag-age <MS>: maximum age of the oldest message a receiver has yet to be sent\n"
+	       "-P, --lag-policy <POLICY>: disconnect, skip or expire receivers that exceed a lag limit\n"
+	       "-S, --splice <MIN_LEN>: fan out frames of at least MIN_LEN bytes with tee(2)/splice(2)\n"
+	       "-Z, --zerocopy <MIN_LEN>: send frames of at least MIN_LEN bytes with MSG_ZEROCOPY\n"
+	       "-p, --src-profile <PROFILE>: default, latency or throughput socket options for source connections\n"
+	       "-r, --dst-profile <PROFILE>: default, latency or throughput socket options for receiver connections\n"
+	       "-O, --receiver-profiles: let receivers select their own socket profile\n"
+	       "-k, --stats-socket <PATH>: serve live statistics (JSON) on a Unix socket at PATH\n"
+	       "-l, --latency <CLOCK>: off, tsc or coarse clock to track message latency with\n"
+	       "-H, --huge-pages: back message memory with huge pages\n"
+	       "-I, --ingest-cpus <CPUS>[:<CPUS>...]: pin source threads to CPU sets\n"
+	       "-W, --worker-cpus <CPUS>[:<CPUS>...]: pin destination worker/egress threads to CPU sets\n"
+	       "-C, --cleanup-cpus <CPUS>: pin the accept, cleanup and liveness threads to a CPU set\n"
+	       "-M, --mem-node <NODE>: place message memory on NUMA node NODE\n"
+	       "-u, --io-uring: use io_uring for socket I/O\n"
 	       "-h, --help: print this message and exit\n", basename(prog_name));
 }
 
@@ -48,8 +115,38 @@ void set_default_args(struct args *args)
 {
 	args->extended = DEFAULT_EXTENDED;
 	args->num_workers = DEFAULT_NUM_WORKERS;
+	args->src_threads = DEFAULT_SRC_THREADS;
+	args->egress_threads = DEFAULT_EGRESS_THREADS;
 	args->backlog = DEFAULT_BACKLOG;
 	args->ttl = DEFAULT_TTL;
+	args->msg_ttl = DEFAULT_MSG_TTL;
+	args->channels = DEFAULT_CHANNELS;
+	args->replay = DEFAULT_REPLAY;
+	args->queue_len = DEFAULT_QUEUE_LEN;
+	args->overwrite = DEFAULT_OVERWRITE;
+	args->max_queue_bytes = DEFAULT_QUEUE_BYTES;
+	args->budget_policy = DEFAULT_BUDGET_POLICY;
+	args->log_dir = NULL;
+	args->log_segment_size = DEFAULT_LOG_SEGMENT_SIZE;
+	args->log_max_age = DEFAULT_LOG_MAX_AGE;
+	args->log_max_bytes = DEFAULT_LOG_MAX_BYTES;
+	args->max_lag = DEFAULT_LAG_MSGS;
+	args->max_lag_bytes = DEFAULT_LAG_BYTES;
+	args->max_lag_age = DEFAULT_LAG_AGE;
+	args->lag_policy = DEFAULT_LAG_POLICY;
+	args->huge_pages = DEFAULT_HUGE_PAGES;
+	args->splice_len = DEFAULT_SPLICE_LEN;
+	args->zerocopy_len = DEFAULT_ZEROCOPY_LEN;
+	args->src_profile = DEFAULT_SOCKET_PROFILE;
+	args->dst_profile = DEFAULT_SOCKET_PROFILE;
+	args->receiver_profiles = DEFAULT_RECEIVER_PROFILES;
+	args->stats_socket = NULL;
+	args->latency_clock = DEFAULT_LATENCY_CLOCK;
+	args->io_uring = DEFAULT_IO_URING;
+	args->ingest_cpus = NULL;
+	args->worker_cpus = NULL;
+	args->cleanup_cpus = NULL;
+	args->mem_node = DEFAULT_MEM_NODE;
 }
 
 bool valid_int_arg(int arg, int min, int max)
@@ -57,12 +154,86 @@ bool valid_int_arg(int arg, int min, int max)
 	return (arg >= min && arg <= max);
 }
 
+/**
+ * @brief Parse a duration argument
+ * @param duration duration in seconds, or in milliseconds with an `ms` suffix
+ * @return duration in milliseconds, -1 if invalid
+ */
+int parse_duration_ms(const char *duration)
+{
+	char *end;
+	long val = strtol(duration, &end, 10);
+
+	if (end == duration || val < 0 || val > INT_MAX / 1000) {
+		return -1;
+	}
+
+	if (*end == '\0' || strcmp(end, "s") == 0) {
+		return val * 1000;
+	} else if (strcmp(end, "ms") == 0) {
+		return val;
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Parse a size argument
+ * @param size size in bytes, optionally with a `K`, `M` or `G` (binary) suffix
+ * @return size in bytes, -1 if invalid
+ */
+long long parse_size(const char *size)
+{
+	char *end;
+	int shift = 0;
+	long long val = strtoll(size, &end, 10);
+
+	if (end == size || val < 0) {
+		return -1;
+	}
+
+	if (strcmp(end, "K") == 0) {
+		shift = 10;
+	} else if (strcmp(end, "M") == 0) {
+		shift = 20;
+	} else if (strcmp(end, "G") == 0) {
+		shift = 30;
+	} else if (*end != '\0') {
+		return -1;
+	}
+
+	if (val > (LLONG_MAX >> shift)) {
+		return -1;
+	}
+
+	return val << shift;
+}
+
 void pr_arg_err(const char *arg_name, int arg_val, int min, int max)
 {
 	pr_err("invalid %s %d: must be between %d and %d\n",
 			arg_name, arg_val, min, max);
 }
 
+/**
+ * @brief Parse a CPU group list argument
+ * @param kind kind of thread the CPUs are for (for error messages)
+ * @param list group list (see `affinity.h`)
+ * @return CPU groups (exits if the list is invalid)
+ */
+struct cpu_groups *parse_cpu_arg(const char *kind, const char *list)
+{
+	struct cpu_groups *groups = parse_cpu_groups(list);
+
+	if (!groups) {
+		pr_err("invalid %s CPU list %s: expected e.g. 0-3,8 (up to %d sets separated by :)\n",
+				kind, list, MAX_CPU_GROUPS);
+		exit(EXIT_FAILURE);
+	}
+
+	return groups;
+}
+
 /**
  * @brief Parse command-line arguments
  * @param argc argument count
@@ -93,6 +264,26 @@ void parse_args(int argc, char *argv[], struct args *args)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 's':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_SRC_THREADS, MAX_SRC_THREADS)) {
+				args->src_threads = arg_val;
+			} else {
+				pr_arg_err("number of source threads", arg_val,
+						MIN_SRC_THREADS, MAX_SRC_THREADS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'E':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_EGRESS_THREADS, MAX_EGRESS_THREADS)) {
+				args->egress_threads = arg_val;
+			} else {
+				pr_arg_err("number of egress threads", arg_val,
+						MIN_EGRESS_THREADS, MAX_EGRESS_THREADS);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'b':
 			arg_val = atoi(optarg);
 			if (valid_int_arg(arg_val, MIN_BACKLOG, MAX_BACKLOG)) {
@@ -104,18 +295,222 @@ void parse_args(int argc, char *argv[], struct args *args)
 			}
 			break;
 		case 't':
-			arg_val = atoi(optarg);
+			arg_val = parse_duration_ms(optarg);
 			if (valid_int_arg(arg_val, MIN_TTL, MAX_TTL)) {
 				args->ttl = arg_val;
 			} else {
-				pr_arg_err("TTL", arg_val, MIN_TTL, MAX_TTL);
+				pr_err("invalid TTL %s: must be between %dms and %dms\n",
+						optarg, MIN_TTL, MAX_TTL);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			args->msg_ttl = true;
+			break;
+		case 'c':
+			args->channels = true;
+			break;
+		case 'R':
+			args->replay = true;
+			break;
+		case 'q':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_QUEUE_LEN, MAX_QUEUE_LEN)) {
+				args->queue_len = arg_val;
+			} else {
+				pr_arg_err("queue length", arg_val, MIN_QUEUE_LEN,
+						MAX_QUEUE_LEN);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'w':
+			args->overwrite = true;
+			break;
+		case 'Q':
+			args->max_queue_bytes = parse_size(optarg);
+			if (args->max_queue_bytes != 0
+					&& (args->max_queue_bytes < MIN_QUEUE_BYTES
+					|| args->max_queue_bytes > MAX_QUEUE_BYTES)) {
+				pr_err("invalid maximum queue bytes %s: must be 0 or between %lld and %lld\n",
+						optarg, MIN_QUEUE_BYTES, MAX_QUEUE_BYTES);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'F':
+			arg_val = parse_budget_policy(optarg);
+			if (arg_val >= 0) {
+				args->budget_policy = arg_val;
+			} else {
+				pr_err("invalid queue full policy %s: must be evict or backpressure\n",
+						optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'D':
+			args->log_dir = optarg;
+			break;
+		case 'G':
+			args->log_segment_size = parse_size(optarg);
+			if (args->log_segment_size < MIN_LOG_SEGMENT_SIZE
+					|| args->log_segment_size > MAX_LOG_SEGMENT_SIZE) {
+				pr_err("invalid log segment size %s: must be between %lld and %lld\n",
+						optarg, MIN_LOG_SEGMENT_SIZE,
+						MAX_LOG_SEGMENT_SIZE);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'Y':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_LOG_MAX_AGE, MAX_LOG_MAX_AGE)) {
+				args->log_max_age = arg_val;
+			} else {
+				pr_arg_err("maximum log age", arg_val, MIN_LOG_MAX_AGE,
+						MAX_LOG_MAX_AGE);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'X':
+			args->log_max_bytes = parse_size(optarg);
+			if (args->log_max_bytes < 0
+					|| args->log_max_bytes > MAX_LOG_MAX_BYTES) {
+				pr_err("invalid maximum log bytes %s: must be between 0 and %lld\n",
+						optarg, MAX_LOG_MAX_BYTES);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'L':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_LAG_MSGS, MAX_LAG_MSGS)) {
+				args->max_lag = arg_val;
+			} else {
+				pr_arg_err("maximum lag", arg_val, MIN_LAG_MSGS,
+						MAX_LAG_MSGS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'B':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_LAG_BYTES, MAX_LAG_BYTES)) {
+				args->max_lag_bytes = arg_val;
+			} else {
+				pr_arg_err("maximum lag bytes", arg_val, MIN_LAG_BYTES,
+						MAX_LAG_BYTES);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'A':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_LAG_AGE, MAX_LAG_AGE)) {
+				args->max_lag_age = arg_val;
+			} else {
+				pr_arg_err("maximum lag age", arg_val, MIN_LAG_AGE,
+						MAX_LAG_AGE);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'P':
+			arg_val = parse_lag_policy(optarg);
+			if (arg_val >= 0) {
+				args->lag_policy = arg_val;
+			} else {
+				pr_err("invalid lag policy %s: must be disconnect, skip or expire\n",
+						optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'S':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_SPLICE_LEN, MAX_SPLICE_LEN)) {
+				args->splice_len = arg_val;
+			} else {
+				pr_arg_err("splice frame length", arg_val,
+						MIN_SPLICE_LEN, MAX_SPLICE_LEN);
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'Z':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_ZEROCOPY_LEN, MAX_ZEROCOPY_LEN)) {
+				args->zerocopy_len = arg_val;
+			} else {
+				pr_arg_err("zero-copy frame length", arg_val,
+						MIN_ZEROCOPY_LEN, MAX_ZEROCOPY_LEN);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'H':
+			args->huge_pages = true;
+			break;
+		case 'I':
+			args->ingest_cpus = parse_cpu_arg("ingest", optarg);
+			break;
+		case 'W':
+			args->worker_cpus = parse_cpu_arg("worker", optarg);
+			break;
+		case 'C':
+			args->cleanup_cpus = parse_cpu_arg("cleanup", optarg);
+			break;
+		case 'M':
+			arg_val = atoi(optarg);
+			if (valid_int_arg(arg_val, MIN_MEM_NODE, MAX_MEM_NODE)) {
+				args->mem_node = arg_val;
+			} else {
+				pr_arg_err("NUMA node", arg_val, MIN_MEM_NODE,
+						MAX_MEM_NODE);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+		case 'r':
+			arg_val = parse_socket_profile(optarg);
+			if (arg_val < 0) {
+				pr_err("invalid socket profile %s: must be default, latency or throughput\n",
+						optarg);
+				exit(EXIT_FAILURE);
+			}
+			if (opt == 'p') {
+				args->src_profile = arg_val;
+			} else {
+				args->dst_profile = arg_val;
+			}
+			break;
+		case 'O':
+			args->receiver_profiles = true;
+			break;
+		case 'k':
+			args->stats_socket = optarg;
+			break;
+		case 'l':
+			arg_val = parse_latency_clock(optarg);
+			if (arg_val < 0) {
+				pr_err("invalid latency clock %s: must be off, tsc or coarse\n",
+						optarg);
+				exit(EXIT_FAILURE);
+			}
+			args->latency_clock = arg_val;
+			break;
+		case 'u':
+			args->io_uring = true;
+			break;
 		default:
 			/* invalid argument: print usage and exit */
 			usage(argv[0]);
 			exit(EXIT_FAILURE);
 		}
 	}
+
+	if (args->msg_ttl && !args->extended) {
+		pr_err("per-message TTLs require extended CTMP\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (args->channels && !args->extended) {
+		pr_err("channels require extended CTMP\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (args->egress_threads > 0 && args->splice_len > 0) {
+		pr_err("splice fan-out is not supported with egress threads\n");
+		exit(EXIT_FAILURE);
+	}
 }
@@ -5,21 +5,87 @@
  */
 
 #include <stdbool.h>
+#include <limits.h>
 #include <getopt.h>
 
 #define DEFAULT_EXTENDED false  ///< use original CTMP by default
+#define DEFAULT_HUGE_PAGES false  ///< back message memory with regular pages by default
+#define DEFAULT_IO_URING false  ///< use blocking/epoll socket I/O by default
+#define DEFAULT_REPLAY false  ///< free messages as soon as every receiver has been sent them by default
+#define DEFAULT_SOCKET_PROFILE PROFILE_DEFAULT  ///< keep kernel socket defaults by default
+#define DEFAULT_RECEIVER_PROFILES false  ///< ignore receivers' profile selectors by default
+#define DEFAULT_LATENCY_CLOCK LATENCY_OFF  ///< do not timestamp messages by default
 
 #define MIN_NUM_WORKERS 1  ///< need at least one thread to handle receivers
-#define MAX_NUM_WORKERS 64  ///< bounded by `sent` field `struct msg_entry`
+#define MAX_NUM_WORKERS 64  ///< bounded by `struct status_mask`
 #define DEFAULT_NUM_WORKERS 32 ///< default number of client worker threads
 
 #define MIN_BACKLOG MIN_NUM_WORKERS
-#define MAX_BACKLOG MAX_NUM_WORKERS
+#define MAX_BACKLOG 4096  ///< default `net.core.somaxconn`
 #define DEFAULT_BACKLOG DEFAULT_NUM_WORKERS  ///< default backlog for listen()
 
-#define MIN_TTL 2
-#define MAX_TTL 10
-#define DEFAULT_TTL 5  ///< default time that messages remain in memory for
+#define MIN_SRC_THREADS 1
+#define MAX_SRC_THREADS 16
+#define DEFAULT_SRC_THREADS 1  ///< default number of source (ingest) threads
+
+#define MIN_EGRESS_THREADS 0
+#define MAX_EGRESS_THREADS 64
+#define DEFAULT_EGRESS_THREADS 0  ///< one worker thread per receiver by default
+
+#define MIN_SPLICE_LEN HEADER_LENGTH
+#define MAX_SPLICE_LEN MAX_FRAME_LENGTH
+#define DEFAULT_SPLICE_LEN 0  ///< splice fan-out disabled by default
+
+#define MIN_ZEROCOPY_LEN HEADER_LENGTH
+#define MAX_ZEROCOPY_LEN MAX_FRAME_LENGTH
+#define DEFAULT_ZEROCOPY_LEN 0  ///< zero-copy sends disabled by default
+
+#define MIN_QUEUE_LEN 1024
+#define MAX_QUEUE_LEN (1 << 24)
+#define DEFAULT_QUEUE_LEN 65536  ///< default number of message queue slots
+#define DEFAULT_OVERWRITE false  ///< wait for the oldest message to be released when the queue is full by default
+
+#define MIN_QUEUE_BYTES (1LL << 20)  ///< smallest budget (0 = no budget): fits several maximum-length frames
+#define MAX_QUEUE_BYTES (1LL << 40)
+#define DEFAULT_QUEUE_BYTES 0  ///< queue memory only bounded by the TTL by default
+#define DEFAULT_BUDGET_POLICY BUDGET_EVICT  ///< evict the oldest messages when over budget by default
+
+#define MIN_LOG_SEGMENT_SIZE (1LL << 20)  ///< fits several maximum-length frames
+#define MAX_LOG_SEGMENT_SIZE (1LL << 30)
+#define DEFAULT_LOG_SEGMENT_SIZE (64LL << 20)  ///< default size of message log segment files
+
+#define MIN_LOG_MAX_AGE 0
+#define MAX_LOG_MAX_AGE (7 * 24 * 60 * 60)  ///< one week
+#define DEFAULT_LOG_MAX_AGE 600  ///< keep logged messages for 10 minutes by default
+
+#define MAX_LOG_MAX_BYTES (1LL << 50)
+#define DEFAULT_LOG_MAX_BYTES 0  ///< message log size only bounded by its maximum age by default
+
+#define MIN_LAG_MSGS 0
+#define MAX_LAG_MSGS MAX_QUEUE_LEN
+#define DEFAULT_LAG_MSGS 0  ///< no message lag limit by default
+
+#define MIN_LAG_BYTES 0
+#define MAX_LAG_BYTES INT_MAX
+#define DEFAULT_LAG_BYTES 0  ///< no byte lag limit by default
+
+#define MIN_LAG_AGE 0
+#define MAX_LAG_AGE MAX_TTL  ///< expiry already bounds message age
+#define DEFAULT_LAG_AGE 0  ///< no age lag limit by default
+
+#define DEFAULT_LAG_POLICY LAG_DISCONNECT  ///< disconnect receivers that exceed a lag limit by default
+
+#define MIN_MEM_NODE -1
+#define MAX_MEM_NODE (MAX_NUMA_NODES - 1)
+#define DEFAULT_MEM_NODE -1  ///< node of the first worker CPU if pinned, otherwise first touch
+
+#define MIN_TTL 1
+#define MAX_TTL 10000
+#define DEFAULT_TTL 5000  ///< default time (ms) that messages remain in memory for
+#define DEFAULT_MSG_TTL false  ///< ignore per-message TTLs by default
+#define DEFAULT_CHANNELS false  ///< send every message to every receiver by default
+
+struct cpu_groups;
 
 /**
  * @brief Command-line arguments
@@ -27,12 +93,45 @@
 struct args {
 	bool extended;  ///< use extended CTMP?
 	int num_workers;  ///< number of client worker threads
+	int src_threads;  ///< number of source (ingest) threads
+	int egress_threads;  ///< number of event-driven egress threads (0 = disabled)
 	int backlog;  //< backlog size for listen()
-	int ttl;  ///< message time to live
+	int ttl;  ///< message time to live (ms)
+	bool msg_ttl;  ///< accept per-message TTLs (extended CTMP "TTL" option)?
+	bool channels;  ///< accept channel IDs (extended CTMP "CHAN" option) and subscriptions?
+	bool replay;  ///< retain messages for their TTL and serve replay handshakes?
+	int queue_len;  ///< number of message queue slots (rounded up to a power of 2)
+	bool overwrite;  ///< overwrite the oldest message when the queue is full, even if receivers have yet to be sent it?
+	long long max_queue_bytes;  ///< maximum memory held by queued messages (0 = no limit)
+	int budget_policy;  ///< action when queued messages exceed `max_queue_bytes` (`enum budget_policy`)
+	char *log_dir;  ///< message log directory (NULL = no log)
+	long long log_segment_size;  ///< size of each message log segment file
+	int log_max_age;  ///< delete logged messages after this many seconds (0 = no limit)
+	long long log_max_bytes;  ///< maximum total size of the message log (0 = no limit)
+	int max_lag;  ///< maximum number of messages a receiver may lag behind (0 = no limit)
+	int max_lag_bytes;  ///< maximum number of bytes a receiver may lag behind (0 = no limit)
+	int max_lag_age;  ///< maximum age (ms) of the oldest message a receiver has yet to visit (0 = no limit)
+	int lag_policy;  ///< action for receivers that exceed a lag limit (`enum lag_policy`)
+	bool huge_pages;  ///< back message memory pool with huge pages?
+	struct cpu_groups *ingest_cpus;  ///< CPU sets for source threads (NULL = not pinned)
+	struct cpu_groups *worker_cpus;  ///< CPU sets for destination workers (NULL = not pinned)
+	struct cpu_groups *cleanup_cpus;  ///< CPU sets for housekeeping threads (NULL = not pinned)
+	int mem_node;  ///< NUMA node for message memory (-1 = default placement)
+	bool io_uring;  ///< use the io_uring I/O backend?
+	int splice_len;  ///< minimum frame length for splice fan-out (0 = disabled)
+	int zerocopy_len;  ///< minimum frame length for `MSG_ZEROCOPY` sends (0 = disabled)
+	int src_profile;  ///< socket profile of source connections (`enum socket_profile_id`)
+	int dst_profile;  ///< socket profile of receiver connections (`enum socket_profile_id`)
+	bool receiver_profiles;  ///< let receivers select their own socket profile?
+	char *stats_socket;  ///< path of the stats socket (NULL = no stats socket)
+	int latency_clock;  ///< clock to timestamp messages with (`enum latency_clock`)
 };
 
 void usage(char *prog_name);
 void set_default_args(struct args *args);
 bool valid_int_arg(int arg, int min, int max);
+int parse_duration_ms(const char *duration);
+long long parse_size(const char *size);
 void pr_arg_err(const char *arg_name, int arg_val, int min, int max);
+struct cpu_groups *parse_cpu_arg(const char *kind, const char *list);
 void parse_args(int argc, char *argv[], struct args *args);
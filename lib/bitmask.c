@@ -13,7 +13,7 @@
  */
 bool is_set(uint64_t *mask, int pos)
 {
-	return ((*mask) & (1 << pos));
+	return ((*mask) & ((uint64_t) 1 << pos));
 }
 
 /**
@@ -25,8 +25,45 @@ bool is_set(uint64_t *mask, int pos)
 void set_bit(uint64_t *mask, int pos, bool val)
 {
 	if (val) {
-		*mask |= (1 << pos);
+		*mask |= ((uint64_t) 1 << pos);
 	} else {
-		*mask &= ~(1 << pos);
+		*mask &= ~((uint64_t) 1 << pos);
 	}
 }
+
+/**
+ * @brief Atomically find the lowest clear bit of a mask and set it
+ * @param mask bitmask to update
+ * @param num_bits number of (low) bits of the mask in use
+ * @return position of the bit set, -1 if all bits in use are set
+ * @details Lock-free: retries if another thread updates the mask in between
+ */
+int claim_first_clear(_Atomic uint64_t *mask, int num_bits)
+{
+	int pos;
+	uint64_t old = atomic_load(mask), clear;
+
+	do {
+		clear = ~old;
+		if (num_bits < 64) {
+			clear &= ((uint64_t) 1 << num_bits) - 1;
+		}
+		if (!clear) {
+			return -1;
+		}
+		pos = __builtin_ctzll(clear);
+	} while (!atomic_compare_exchange_weak(mask, &old,
+				old | ((uint64_t) 1 << pos)));
+
+	return pos;
+}
+
+/**
+ * @brief Atomically clear a given bit
+ * @param mask bitmask to update
+ * @param pos position of bit to clear
+ */
+void clear_bit_atomic(_Atomic uint64_t *mask, int pos)
+{
+	atomic_fetch_and(mask, ~((uint64_t) 1 << pos));
+}
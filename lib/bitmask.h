@@ -5,6 +5,10 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 bool is_set(uint64_t *mask, int pos);
 void set_bit(uint64_t *mask, int pos, bool val);
+
+int claim_first_clear(_Atomic uint64_t *mask, int num_bits);
+void clear_bit_atomic(_Atomic uint64_t *mask, int pos);
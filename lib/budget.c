@@ -0,0 +1,132 @@
+/**
+ * @file budget.c
+ * @brief Definitions of functions for the queue memory budget
+ */
+
+#include <string.h>
+
+#include "msg_queue.h"
+#include "budget.h"
+#include "log.h"
+
+struct queue_budget queue_budget;  ///< budget for all queued messages
+
+/**
+ * @brief Budget policy names (indexed by `enum budget_policy`)
+ */
+static const char *budget_policy_names[] = {
+	[BUDGET_EVICT] = "evict",
+	[BUDGET_BACKPRESSURE] = "backpressure"
+};
+
+/**
+ * @brief Look up a budget policy by name
+ * @param name policy name
+ * @return `enum budget_policy` value, -1 if the name is not recognised
+ */
+int parse_budget_policy(const char *name)
+{
+	for (int i = 0; i < (int) (sizeof(budget_policy_names) / sizeof(char *)); i++) {
+		if (strcmp(name, budget_policy_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Set the queue memory budget
+ * @param max_bytes maximum memory held by queued messages (0 = no limit)
+ * @param policy `enum budget_policy` value
+ */
+void init_queue_budget(long long max_bytes, int policy)
+{
+	queue_budget.max_bytes = max_bytes;
+	queue_budget.policy = policy;
+	queue_budget.evict_seq = 0;
+	atomic_init(&queue_budget.evicted, 0);
+	atomic_init(&queue_budget.throttled, 0);
+}
+
+/**
+ * @brief Check whether queued messages exceed the memory budget
+ * @return true if over budget, false otherwise (or if there is no budget)
+ */
+static bool over_budget(void)
+{
+	return (queue_budget.max_bytes
+			&& queue_mem_usage() > queue_budget.max_bytes);
+}
+
+/**
+ * @brief Evict the oldest messages until queued messages are back within the
+ * memory budget (evict policy only)
+ * @param ring message queue
+ * @details Called before appending new entries, with the message queue lock
+ * held. Evicted messages are expired for every receiver yet to claim them, so
+ * they are freed as soon as any sends in progress complete: usage may stay over
+ * budget until then, in which case no more is evicted than the whole queue.
+ */
+void enforce_queue_budget(struct msg_ring *ring)
+{
+	uint64_t tail, head, start;
+
+	if (queue_budget.policy != BUDGET_EVICT || !over_budget()) {
+		return;
+	}
+
+	tail = ring_tail(ring);
+	head = ring_head(ring, tail);
+	if (queue_budget.evict_seq < head) {
+		/* overwritten messages have already been released */
+		queue_budget.evict_seq = head;
+	}
+
+	start = queue_budget.evict_seq;
+	while (over_budget() && queue_budget.evict_seq < tail) {
+		if (expire_msg(ring, queue_budget.evict_seq++) > 0) {
+			atomic_fetch_add_explicit(&queue_budget.evicted, 1,
+					memory_order_relaxed);
+		}
+	}
+
+	if (queue_budget.evict_seq > start) {
+		pr_debug("queue over budget: evicted messages %lu-%lu\n",
+				start, queue_budget.evict_seq - 1);
+	}
+}
+
+/**
+ * @brief Check whether source threads should stop reading
+ * @return true if queued messages are over the memory budget with the
+ * backpressure policy, false otherwise
+ */
+bool ingest_throttled(void)
+{
+	return (queue_budget.policy == BUDGET_BACKPRESSURE && over_budget());
+}
+
+/**
+ * @brief Wait until queued messages are back within the memory budget
+ * (backpressure policy only)
+ * @details Called by source threads before reading: while they wait, data
+ * builds up in the socket receive buffers until TCP flow control stops the
+ * producers. Memory is freed as receivers are sent messages (or messages
+ * expire), so the wait is bounded by the TTL. Sources resume once usage drops
+ * to `THROTTLE_RESUME_PERCENT` of the budget, so they are not woken for every
+ * message freed.
+ */
+void throttle_ingest(void)
+{
+	if (!ingest_throttled()) {
+		return;
+	}
+
+	atomic_fetch_add_explicit(&queue_budget.throttled, 1,
+			memory_order_relaxed);
+	pr_debug("queue over budget (%lu bytes): throttling sources\n",
+			queue_mem_usage());
+
+	wait_for_mem_usage(queue_budget.max_bytes / 100 * THROTTLE_RESUME_PERCENT);
+}
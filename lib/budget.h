@@ -0,0 +1,43 @@
+/**
+ * @file budget.h
+ * @brief Constants, structs, and functions for the queue memory budget
+ * @details Bounds the memory held by queued messages (see `queue_mem_usage()`).
+ * Once it is over budget, either the oldest messages are evicted for every
+ * receiver yet to be sent them, or source threads stop reading until enough
+ * memory has been freed, so TCP flow control throttles the producers.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define THROTTLE_RESUME_PERCENT 90  ///< throttled source threads resume once usage drops to this share of the budget
+
+struct msg_ring;
+
+/**
+ * @brief Action taken when queued messages exceed the memory budget
+ */
+enum budget_policy {
+	BUDGET_EVICT,  ///< evict the oldest messages
+	BUDGET_BACKPRESSURE  ///< stop reading from sources
+};
+
+/**
+ * @brief Queue memory budget
+ */
+struct queue_budget {
+	uint64_t max_bytes;  ///< maximum memory held by queued messages (0 = no limit)
+	enum budget_policy policy;
+	uint64_t evict_seq;  ///< sequence number of the next message to evict (protected by the message queue lock)
+	_Atomic uint64_t evicted;  ///< messages evicted before every receiver was sent them
+	_Atomic uint64_t throttled;  ///< times a source thread stopped reading
+};
+
+extern struct queue_budget queue_budget;
+
+int parse_budget_policy(const char *name);
+void init_queue_budget(long long max_bytes, int policy);
+void enforce_queue_budget(struct msg_ring *ring);
+bool ingest_throttled(void);
+void throttle_ingest(void);
@@ -0,0 +1,301 @@
+/**
+ * @file channel.c
+ * @brief Definitions of functions for topic channels
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "msg_queue.h"
+#include "channel.h"
+#include "log.h"
+
+struct channel_index channel_index;  ///< channels with subscribers
+
+/**
+ * @brief Set up the channel index
+ * @param num_slots number of message queue slots (a power of 2): each channel
+ * ring is as large, so it never wraps around before the queue
+ */
+void init_channel_index(size_t num_slots)
+{
+	channel_index.channels = calloc(MAX_CHANNELS, sizeof(struct channel *));
+	if (!channel_index.channels) {
+		p_error("calloc", errno);
+		exit(errno);
+	}
+	channel_index.mask = num_slots - 1;
+	channel_index.num_subscriptions = 0;
+}
+
+/**
+ * @brief Look up a channel, allocating it if it has never been subscribed to
+ * @param id channel ID
+ * @return channel
+ * @details Caller must hold the message queue lock. Channels are never freed,
+ * so subscribers can keep reading them without a lock.
+ */
+static struct channel *get_channel(uint16_t id)
+{
+	struct channel *channel = channel_index.channels[id];
+
+	if (channel) {
+		return channel;
+	}
+
+	channel = malloc(sizeof(struct channel));
+	if (!channel) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	channel->seqs = malloc((channel_index.mask + 1) * sizeof(uint64_t));
+	channel->offsets = malloc((channel_index.mask + 1) * sizeof(uint64_t));
+	if (!channel->seqs || !channel->offsets) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	channel->subscribers = 0;
+	atomic_init(&channel->tail, 0);
+	atomic_init(&channel->tail_offset, 0);
+
+	channel_index.channels[id] = channel;
+	return channel;
+}
+
+/**
+ * @brief Index a message that is entering the queue
+ * @param id channel the message is sent on
+ * @param seq sequence number of the message
+ * @param frame_len length of the message's frame (header included)
+ * @return number of receivers subscribed to the channel (the message is due to
+ * them on top of every unsubscribed receiver)
+ * @details Caller must hold the message queue lock, and index the message before
+ * it enters the queue. A single lookup: messages on channels without
+ * subscribers are not indexed.
+ */
+uint32_t index_msg(uint16_t id, uint64_t seq, uint32_t frame_len)
+{
+	struct channel *channel;
+	uint64_t tail, offset;
+
+	if (channel_index.num_subscriptions == 0
+			|| !(channel = channel_index.channels[id])
+			|| channel->subscribers == 0) {
+		return 0;
+	}
+
+	tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+	offset = atomic_load_explicit(&channel->tail_offset, memory_order_relaxed);
+	atomic_store_explicit(&channel->offsets[tail & channel_index.mask],
+			offset, memory_order_relaxed);
+	atomic_store_explicit(&channel->tail_offset, offset + frame_len,
+			memory_order_relaxed);
+	/* release: a subscriber that reads the slot's new value also sees the
+	 * tail that marks its previous value as overwritten */
+	atomic_store_explicit(&channel->seqs[tail & channel_index.mask], seq,
+			memory_order_release);
+	atomic_store_explicit(&channel->tail, tail + 1, memory_order_release);
+
+	return channel->subscribers;
+}
+
+/**
+ * @brief Subscribe a receiver to the channels listed in its handshake
+ * @param sub subscription to fill in
+ * @param handshake subscription handshake received in full
+ * @details Caller must hold the message queue lock: the receiver is due the
+ * messages on its channels that enter the queue from then on. Repeated
+ * channel IDs are ignored.
+ */
+void subscribe(struct subscription *sub, unsigned char *handshake)
+{
+	int num_ids = handshake[1];
+	uint16_t id;
+	struct channel *channel;
+
+	sub->num_channels = 0;
+	for (int i = 0; i < num_ids; i++) {
+		id = (handshake[SUBSCRIBE_IDS_OFFSET + 2*i] << 8)
+			| handshake[SUBSCRIBE_IDS_OFFSET + 2*i + 1];
+		channel = get_channel(id);
+
+		for (int j = 0; j < sub->num_channels; j++) {
+			if (sub->channels[j] == channel) {
+				channel = NULL;
+				break;
+			}
+		}
+		if (!channel) {
+			continue;
+		}
+
+		channel->subscribers++;
+		channel_index.num_subscriptions++;
+		sub->channels[sub->num_channels] = channel;
+		sub->positions[sub->num_channels++] = atomic_load(&channel->tail);
+	}
+}
+
+/**
+ * @brief Unsubscribe a disconnected receiver from its channels
+ * @param sub subscription
+ * @details Caller must hold the message queue lock. The subscription is kept
+ * so the receiver can then drop the messages it was due but has not visited
+ * with `drop_due_msgs()`.
+ */
+void unsubscribe(struct subscription *sub)
+{
+	for (int i = 0; i < sub->num_channels; i++) {
+		sub->channels[i]->subscribers--;
+		channel_index.num_subscriptions--;
+	}
+}
+
+/**
+ * @brief Find the next message due to a receiver
+ * @param sub receiver's subscription
+ * @param cursor sequence number of the next message the receiver is to visit,
+ * updated past the message returned
+ * @param end_seq sequence number to stop at (at most the tail)
+ * @return sequence number of the message, `end_seq` if there is none before it
+ * (`cursor` is then `end_seq`)
+ * @details Every message from `cursor` on for unsubscribed receivers. Otherwise
+ * the oldest message on any of the receiver's channels, found from the head of
+ * each channel ring: messages before `cursor` (skipped or overwritten) are
+ * passed over, as are entries the channel ring has since overwritten.
+ */
+uint64_t next_due_seq(struct subscription *sub, uint64_t *cursor,
+		uint64_t end_seq)
+{
+	int next = -1;
+	uint64_t seq, next_seq = end_seq, tail, *pos;
+	struct channel *channel;
+
+	if (sub->num_channels == 0) {
+		return (*cursor < end_seq) ? (*cursor)++ : end_seq;
+	}
+
+	for (int i = 0; i < sub->num_channels; i++) {
+		channel = sub->channels[i];
+		pos = &sub->positions[i];
+
+		while ((tail = atomic_load_explicit(&channel->tail,
+						memory_order_acquire)) > *pos) {
+			/* the oldest slot may be being overwritten */
+			if (tail - *pos > channel_index.mask) {
+				*pos = tail - channel_index.mask;
+				continue;
+			}
+
+			seq = atomic_load_explicit(
+					&channel->seqs[*pos & channel_index.mask],
+					memory_order_acquire);
+			if (atomic_load(&channel->tail) - *pos > channel_index.mask) {
+				/* overwritten while reading */
+				continue;
+			}
+
+			if (seq < *cursor) {
+				(*pos)++;
+				continue;
+			}
+			if (seq < next_seq) {
+				next_seq = seq;
+				next = i;
+			}
+			break;
+		}
+	}
+
+	if (next < 0) {
+		if (*cursor < end_seq) {
+			*cursor = end_seq;
+		}
+		return end_seq;
+	}
+
+	sub->positions[next]++;
+	*cursor = next_seq + 1;
+	return next_seq;
+}
+
+/**
+ * @brief Drop a receiver's claim to the messages it is due but has not visited
+ * @param ring message queue
+ * @param sub receiver's subscription
+ * @param seq sequence number of the first message the receiver has not visited
+ * @param end_seq sequence number of the first message not to drop
+ * @details As `drop_pending_msgs()`, only visiting the messages on the
+ * receiver's channels if it is subscribed
+ */
+void drop_due_msgs(struct msg_ring *ring, struct subscription *sub,
+		uint64_t seq, uint64_t end_seq)
+{
+	uint64_t next;
+	struct msg_entry *entry;
+
+	if (sub->num_channels == 0) {
+		drop_pending_msgs(ring, seq, end_seq);
+		return;
+	}
+
+	while ((next = next_due_seq(sub, &seq, end_seq)) < end_seq) {
+		if ((entry = claim_msg(ring, next))) {
+			release_msg(entry, 1);
+		}
+	}
+}
+
+/**
+ * @brief Measure how far a subscriber is behind on its channels
+ * @param sub receiver's subscription (with at least one channel)
+ * @param seq sequence number of the next message the receiver is to visit
+ * @param msgs set to the number of messages on the receiver's channels from
+ * `seq` on
+ * @param bytes set to the total length of their frames
+ * @return sequence number of the oldest of those messages, `UINT64_MAX` if
+ * there are none
+ * @details Binary search of each channel ring for its first message from `seq`
+ * on. Lock-free, so the result may be slightly out of date.
+ */
+uint64_t channel_lag(struct subscription *sub, uint64_t seq, uint64_t *msgs,
+		uint64_t *bytes)
+{
+	uint64_t oldest = UINT64_MAX, tail, lo, hi, mid, first;
+	struct channel *channel;
+
+	*msgs = 0;
+	*bytes = 0;
+	for (int i = 0; i < sub->num_channels; i++) {
+		channel = sub->channels[i];
+
+		/* the oldest slot may be being overwritten */
+		hi = atomic_load_explicit(&channel->tail, memory_order_acquire);
+		lo = (hi > channel_index.mask) ? hi - channel_index.mask : 0;
+		lo = (lo > sub->positions[i]) ? lo : sub->positions[i];
+		tail = hi;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (atomic_load_explicit(
+						&channel->seqs[mid & channel_index.mask],
+						memory_order_acquire) < seq) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo == tail) {
+			continue;
+		}
+
+		*msgs += tail - lo;
+		*bytes += atomic_load(&channel->tail_offset) - atomic_load(
+				&channel->offsets[lo & channel_index.mask]);
+		first = atomic_load(&channel->seqs[lo & channel_index.mask]);
+		if (first < oldest) {
+			oldest = first;
+		}
+	}
+
+	return oldest;
+}
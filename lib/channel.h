@@ -0,0 +1,86 @@
+/**
+ * @file channel.h
+ * @brief Constants, structs, and functions for topic channels
+ * @details With channels, an extended CTMP message may carry a channel ID (the
+ * "CHAN" option). Receivers that subscribe to a set of channels are only sent
+ * the messages on those channels; other receivers are sent every message.
+ * A receiver subscribes by sending a handshake as soon as it connects:
+ *
+ * | byte(s)     | handshake                      | acknowledgement         |
+ * |-------------|--------------------------------|-------------------------|
+ * | 0           | `SUBSCRIBE_MAGIC`              | `SUBSCRIBE_MAGIC`       |
+ * | 1           | number of channels (n)         | `SUBSCRIBE_ACK`         |
+ * | 2-(2n+1)    | channel IDs                    | padding (0x00) to 7     |
+ * | 8-15        | -                              | first sequence number   |
+ *
+ * Channel IDs are unsigned 16-bit network-order integers; messages without the
+ * "CHAN" option are on channel 0. The subscription applies to messages that
+ * enter the queue from the acknowledged sequence number on.
+ *
+ * Dispatch goes through an index rather than testing receivers against
+ * messages: each channel with subscribers has its own ring of the sequence
+ * numbers of its messages. A producer looks a message's channel up in the
+ * index, appends the message's sequence number to it and makes the message due
+ * to its subscribers (on top of every unsubscribed receiver). Subscribers walk
+ * their channels' rings, merged in sequence order, and never visit messages on
+ * other channels.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define MAX_CHANNELS 65536  ///< number of channel IDs (16 bits)
+#define MAX_SUBSCRIPTIONS 16  ///< maximum number of channels per receiver
+#define SUBSCRIBE_MAGIC 0xce  ///< subscription handshake magic byte
+#define SUBSCRIBE_ACK 0x80  ///< subscription acknowledgement second byte
+#define SUBSCRIBE_IDS_OFFSET 2  ///< first byte of the subscription's channel IDs
+#define MAX_SUBSCRIBE_LENGTH (SUBSCRIBE_IDS_OFFSET + 2 * MAX_SUBSCRIPTIONS)  ///< longest subscription handshake
+
+struct msg_ring;
+
+/**
+ * @brief Index of the messages on a channel
+ * @details Only allocated once a receiver subscribes to the channel. Written
+ * by the producer holding the message queue lock.
+ */
+struct channel {
+	uint32_t subscribers;  ///< number of receivers subscribed (protected by the message queue lock)
+	_Atomic uint64_t *seqs;  ///< ring of message sequence numbers (as many slots as the message queue)
+	_Atomic uint64_t *offsets;  ///< ring of `tail_offset` values as each message was indexed (as `seqs`)
+	_Atomic uint64_t tail;  ///< number of messages ever indexed
+	_Atomic uint64_t tail_offset;  ///< total length of the frames ever indexed
+};
+
+/**
+ * @brief Channel index
+ */
+struct channel_index {
+	struct channel **channels;  ///< one per channel ID (NULL until first subscribed to)
+	uint64_t mask;  ///< number of slots per channel ring - 1
+	uint32_t num_subscriptions;  ///< total subscriptions (producers skip the lookup while 0)
+};
+
+/**
+ * @brief Channels a receiver is subscribed to, and its position in each
+ * @details A receiver with no channels is sent every message
+ */
+struct subscription {
+	int num_channels;  ///< number of channels (0 = not subscribed)
+	struct channel *channels[MAX_SUBSCRIPTIONS];
+	uint64_t positions[MAX_SUBSCRIPTIONS];  ///< position of the next message to visit in each channel ring
+};
+
+extern struct channel_index channel_index;
+
+void init_channel_index(size_t num_slots);
+uint32_t index_msg(uint16_t channel, uint64_t seq, uint32_t frame_len);
+void subscribe(struct subscription *sub, unsigned char *handshake);
+void unsubscribe(struct subscription *sub);
+
+uint64_t next_due_seq(struct subscription *sub, uint64_t *cursor,
+		uint64_t end_seq);
+void drop_due_msgs(struct msg_ring *ring, struct subscription *sub,
+		uint64_t seq, uint64_t end_seq);
+uint64_t channel_lag(struct subscription *sub, uint64_t seq, uint64_t *msgs,
+		uint64_t *bytes);
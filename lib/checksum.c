@@ -0,0 +1,344 @@
+/**
+ * @file checksum.c
+ * @brief Portable and SIMD (SSE2, AVX2, AVX-512) Internet checksum kernels
+ * @details Based on RFC 1071: https://datatracker.ietf.org/doc/html/rfc1071
+ *
+ * Since 2^16 = 1 (mod 2^16 - 1), adding 32-bit words into a 64-bit accumulator
+ * and folding gives the same one's complement sum as adding the 16-bit words
+ * one at a time. The vector kernels therefore widen each 32-bit lane to 64 bits
+ * and add lanes in parallel, leaving any tail shorter than a vector to the
+ * portable kernel.
+ *
+ * Words are loaded in host byte order, with a trailing odd byte added as the
+ * low byte of a word (as in the RFC 1071 example implementation).
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "checksum.h"
+#include "log.h"
+
+/**
+ * @brief Checksum implementation
+ */
+struct csum_impl {
+	const char *name;  ///< implementation name (for logging)
+	/// add `len` bytes of `buf` to `sum`
+	uint64_t (*add)(const unsigned char *buf, size_t len, uint64_t sum);
+};
+
+/**
+ * @brief Portable checksum kernel
+ * @param buf data to sum
+ * @param len length of data in bytes
+ * @param sum running (unfolded) sum
+ * @return updated sum
+ */
+static uint64_t csum_add_portable(const unsigned char *buf, size_t len,
+		uint64_t sum)
+{
+	uint32_t dword;
+	uint16_t word;
+
+	/* 32-bit words (two accumulators to shorten the dependency chain) */
+	uint64_t sum2 = 0;
+	while (len >= 8) {
+		memcpy(&dword, buf, sizeof(dword));
+		sum += dword;
+		memcpy(&dword, &buf[4], sizeof(dword));
+		sum2 += dword;
+		buf += 8;
+		len -= 8;
+	}
+	sum += sum2;
+
+	/* remaining 16-bit words */
+	while (len > 1) {
+		memcpy(&word, buf, sizeof(word));
+		sum += word;
+		buf += 2;
+		len -= 2;
+	}
+
+	/* add leftover byte (if any) */
+	if (len > 0) {
+		sum += *buf;
+	}
+
+	return sum;
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+ * @brief SSE2 checksum kernel (16 bytes per iteration)
+ * @copydetails csum_add_portable
+ */
+__attribute__((target("sse2")))
+static uint64_t csum_add_sse2(const unsigned char *buf, size_t len,
+		uint64_t sum)
+{
+	uint64_t lanes[2];
+	__m128i v, zero = _mm_setzero_si128();
+	__m128i acc_lo = _mm_setzero_si128(), acc_hi = _mm_setzero_si128();
+
+	while (len >= 16) {
+		v = _mm_loadu_si128((const __m128i *) buf);
+		acc_lo = _mm_add_epi64(acc_lo, _mm_unpacklo_epi32(v, zero));
+		acc_hi = _mm_add_epi64(acc_hi, _mm_unpackhi_epi32(v, zero));
+		buf += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *) lanes, _mm_add_epi64(acc_lo, acc_hi));
+	return csum_add_portable(buf, len, sum + lanes[0] + lanes[1]);
+}
+
+/**
+ * @brief AVX2 checksum kernel (64 bytes per iteration)
+ * @copydetails csum_add_portable
+ */
+__attribute__((target("avx2")))
+static uint64_t csum_add_avx2(const unsigned char *buf, size_t len,
+		uint64_t sum)
+{
+	uint64_t lanes[4];
+	__m256i v, w, zero = _mm256_setzero_si256();
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+	__m256i acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+
+	while (len >= 64) {
+		v = _mm256_loadu_si256((const __m256i *) buf);
+		w = _mm256_loadu_si256((const __m256i *) &buf[32]);
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+		acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(w, zero));
+		acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(w, zero));
+		buf += 64;
+		len -= 64;
+	}
+
+	acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1),
+			_mm256_add_epi64(acc2, acc3));
+	_mm256_storeu_si256((__m256i *) lanes, acc0);
+	sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	return csum_add_sse2(buf, len, sum);
+}
+
+/**
+ * @brief AVX-512 checksum kernel (128 bytes per iteration)
+ * @copydetails csum_add_portable
+ */
+__attribute__((target("avx512f")))
+static uint64_t csum_add_avx512(const unsigned char *buf, size_t len,
+		uint64_t sum)
+{
+	__m512i v, w, zero = _mm512_setzero_si512();
+	__m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+	__m512i acc2 = _mm512_setzero_si512(), acc3 = _mm512_setzero_si512();
+
+	while (len >= 128) {
+		v = _mm512_loadu_si512((const void *) buf);
+		w = _mm512_loadu_si512((const void *) &buf[64]);
+		acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v, zero));
+		acc2 = _mm512_add_epi64(acc2, _mm512_unpacklo_epi32(w, zero));
+		acc3 = _mm512_add_epi64(acc3, _mm512_unpackhi_epi32(w, zero));
+		buf += 128;
+		len -= 128;
+	}
+
+	acc0 = _mm512_add_epi64(_mm512_add_epi64(acc0, acc1),
+			_mm512_add_epi64(acc2, acc3));
+	sum += _mm512_reduce_add_epi64(acc0);
+
+	return csum_add_sse2(buf, len, sum);
+}
+#endif
+
+/**
+ * @brief Implementation used by `csum_add()`
+ * @details Portable until `init_checksum()` is called
+ */
+static struct csum_impl impl = { "portable", csum_add_portable };
+
+#ifdef DEBUG
+/**
+ * @brief Check a checksum kernel against the portable kernel
+ * @param kernel kernel to check
+ * @details Sums random data of every length up to 256 bytes and of random
+ * lengths up to `CSUM_CHECK_MAX_LEN`, from every start offset up to
+ * `CSUM_CHECK_MAX_OFFSET` (so vector loads are unaligned and every tail length
+ * is covered), onto random running sums. Aborts on any mismatch.
+ */
+static void check_kernel(struct csum_impl *kernel)
+{
+	unsigned char *buf;
+	uint64_t state = 0x9e3779b97f4a7c15, sum;
+	size_t len;
+
+	buf = malloc(CSUM_CHECK_MAX_LEN + CSUM_CHECK_MAX_OFFSET);
+	if (!buf) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	/* xorshift64 */
+	for (size_t i = 0; i < CSUM_CHECK_MAX_LEN + CSUM_CHECK_MAX_OFFSET; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		buf[i] = state;
+	}
+
+	for (int i = 0; i < 512; i++) {
+		len = (i < 256) ? (size_t) i
+			: (size_t) ((state = state * 6364136223846793005 + 1) >> 33)
+			% CSUM_CHECK_MAX_LEN;
+		for (size_t offset = 0; offset < CSUM_CHECK_MAX_OFFSET; offset++) {
+			sum = (i % 2) ? state >> 20 : 0;
+			if (csum_fold(kernel->add(&buf[offset], len, sum))
+					!= csum_fold(csum_add_portable(&buf[offset],
+							len, sum))) {
+				pr_err("%s checksum kernel mismatch: %zu bytes at offset %zu\n",
+						kernel->name, len, offset);
+				abort();
+			}
+		}
+	}
+
+	free(buf);
+}
+#endif
+
+/**
+ * @brief Select the fastest checksum implementation supported by the CPU
+ * @details Uses CPUID (via `__builtin_cpu_supports()`). Should be called once
+ * at startup, before any other thread computes a checksum. With `DEBUG`,
+ * every kernel the CPU supports is first checked against the portable kernel.
+ */
+void init_checksum(void)
+{
+#ifdef HAVE_X86_SIMD
+	/* slowest first: the last one supported is selected */
+	struct csum_impl kernels[] = {
+		{ "sse2", csum_add_sse2 },
+		{ "avx2", csum_add_avx2 },
+		{ "avx512", csum_add_avx512 }
+	};
+	bool supported[sizeof(kernels) / sizeof(kernels[0])];
+
+	__builtin_cpu_init();
+	supported[0] = __builtin_cpu_supports("sse2");
+	supported[1] = __builtin_cpu_supports("avx2");
+	supported[2] = __builtin_cpu_supports("avx512f");
+
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (!supported[i]) {
+			continue;
+		}
+#ifdef DEBUG
+		check_kernel(&kernels[i]);
+#endif
+		impl = kernels[i];
+	}
+#endif
+}
+
+/**
+ * @brief Get the name of the selected checksum implementation
+ * @return implementation name
+ */
+const char *csum_impl_name(void)
+{
+	return impl.name;
+}
+
+/**
+ * @brief Add data to a running one's complement sum
+ * @param buf data to sum
+ * @param len length of data in bytes
+ * @param sum running (unfolded) sum, 0 to start a new sum
+ * @return updated sum
+ * @details Data should start at an even offset of the checksummed message
+ * (i.e. all chunks but the last should have even length)
+ */
+uint64_t csum_add(const unsigned char *buf, size_t len, uint64_t sum)
+{
+	return impl.add(buf, len, sum);
+}
+
+/**
+ * @brief Add data starting at any offset of a message to a running sum
+ * @param buf data to sum
+ * @param len length of data in bytes
+ * @param offset offset of `buf` in the checksummed message
+ * @param sum running (unfolded) sum
+ * @return updated sum
+ * @details Allows a message to be summed in chunks of any length as it
+ * arrives. A chunk starting at an odd offset has the roles of its high and low
+ * bytes swapped, which (since 2^8 * 2^8 = 1 mod 2^16 - 1) is corrected by
+ * byte-swapping its folded sum.
+ */
+uint64_t csum_add_at(const unsigned char *buf, size_t len, size_t offset,
+		uint64_t sum)
+{
+	uint16_t partial;
+
+	if (offset % 2 == 0) {
+		return csum_add(buf, len, sum);
+	}
+
+	partial = csum_fold(csum_add(buf, len, 0));
+	return sum + (uint16_t) ((partial << 8) | (partial >> 8));
+}
+
+/**
+ * @brief Copy data and add it to a running sum in a single pass
+ * @param dst destination buffer
+ * @param src data to copy and sum
+ * @param len length of data in bytes
+ * @param sum running (unfolded) sum
+ * @return updated sum
+ * @details Copies in blocks of `CSUM_COPY_BLOCK` bytes, summing each block
+ * while it is still in L1 cache. `src` should start at an even offset of the
+ * checksummed message (as for `csum_add()`).
+ */
+uint64_t csum_copy(unsigned char *dst, const unsigned char *src, size_t len,
+		uint64_t sum)
+{
+	size_t block;
+
+	while (len > 0) {
+		block = (len < CSUM_COPY_BLOCK) ? len : CSUM_COPY_BLOCK;
+		memcpy(dst, src, block);
+		sum = csum_add(dst, block, sum);
+		dst += block;
+		src += block;
+		len -= block;
+	}
+
+	return sum;
+}
+
+/**
+ * @brief Fold a running sum into the 16-bit one's complement sum
+ * @param sum running sum returned by `csum_add()`
+ * @return one's complement sum (not complemented)
+ */
+uint16_t csum_fold(uint64_t sum)
+{
+	/* fold to 16 bits by adding 16-bit segments */
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return sum;
+}
@@ -0,0 +1,24 @@
+/**
+ * @file checksum.h
+ * @brief Internet checksum (RFC 1071 one's complement sum) functions
+ * @details The sum is accumulated in 64 bits by `csum_add()` and folded to 16
+ * bits by `csum_fold()`. `init_checksum()` selects the fastest implementation
+ * supported by the CPU; all implementations give identical results (checked
+ * against the portable implementation at startup with `DEBUG`).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CSUM_COPY_BLOCK 4096  ///< `csum_copy()` block size: sums each block while it is still in L1
+#define CSUM_CHECK_MAX_LEN 70000  ///< longest buffer checked against the portable kernel (`DEBUG` only)
+#define CSUM_CHECK_MAX_OFFSET 64  ///< start offsets checked against the portable kernel (`DEBUG` only)
+
+void init_checksum(void);
+const char *csum_impl_name(void);
+uint64_t csum_add(const unsigned char *buf, size_t len, uint64_t sum);
+uint64_t csum_add_at(const unsigned char *buf, size_t len, size_t offset,
+		uint64_t sum);
+uint64_t csum_copy(unsigned char *dst, const unsigned char *src, size_t len,
+		uint64_t sum);
+uint16_t csum_fold(uint64_t sum);
@@ -10,12 +10,22 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
 
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include "ctmp.h"
+#include "checksum.h"
+#include "stats.h"
+#include "pool.h"
 #include "log.h"
 
+_Static_assert(offsetof(struct ctmp_msg, data) ==
+		offsetof(struct ctmp_msg, header) + HEADER_LENGTH,
+		"CTMP header and data must be contiguous");
+
 /**
  * @brief Read a message of a given length from a given file descriptor
  * @param fd file descriptor to read from
@@ -79,7 +89,7 @@ int read_msg(int fd, unsigned char *buf, uint16_t len)
  * - -1: mismatch between expected and actual number of bytes sent
  * - other negative error code: `send()` failure
  */
-int send_msg(int fd, unsigned char *buf, uint16_t len)
+int send_msg(int fd, unsigned char *buf, size_t len)
 {
 	ssize_t bytes_sent = 0, total_bytes_sent = 0;
 
@@ -110,35 +120,70 @@ int send_msg(int fd, unsigned char *buf, uint16_t len)
 }
 
 /**
- * @brief Read in CTMP header
- * @param sender_fd file descriptor to read header from
- * @param msg `struct ctmp_msg` to store header in
- * @return number of bytes read (negative error code on failure)
+ * @brief Send a batch of frames to a given file descriptor with vectored I/O
+ * @param fd file descriptor to send to
+ * @param frames frames to send (modified to track partial sends)
+ * @param num_frames number of frames
+ * @return 0 on success, negative error code otherwise (as `send_msg()`)
+ *
+ * @details Gather every remaining frame into each `sendmsg()` call, continuing
+ * after partial sends until all frames have been sent/send fails
  */
-int read_ctmp_header(int sender_fd, struct ctmp_msg *msg)
+int send_msgs(int fd, struct iovec *frames, int num_frames)
 {
-	/* read in header */
-	return read_msg(sender_fd, msg->header, HEADER_LENGTH);
+	ssize_t bytes_sent = 0;
+	struct msghdr hdr = {
+		.msg_iov = frames,
+		.msg_iovlen = num_frames
+	};
+
+	while (hdr.msg_iovlen > 0) {
+		bytes_sent = sendmsg(fd, &hdr, MSG_NOSIGNAL);
+		if (bytes_sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else {
+				return -errno;
+			}
+		} else if (bytes_sent == 0) {
+			return -1;
+		}
+
+		/* skip frames sent in full, then the sent part of the next */
+		while (hdr.msg_iovlen > 0
+				&& (size_t) bytes_sent >= hdr.msg_iov->iov_len) {
+			bytes_sent -= hdr.msg_iov->iov_len;
+			hdr.msg_iov++;
+			hdr.msg_iovlen--;
+		}
+		if (hdr.msg_iovlen > 0) {
+			hdr.msg_iov->iov_base = (unsigned char *) hdr.msg_iov->iov_base
+				+ bytes_sent;
+			hdr.msg_iov->iov_len -= bytes_sent;
+		}
+	}
+
+	return 0;
 }
 
 /**
  * @brief Validate CTMP header magic byte
- * @param msg message to validate magic byte of
+ * @param header header to validate magic byte of
  * @return true if valid magic byte, false otherwise
  */
-bool valid_magic(struct ctmp_msg *msg)
+bool valid_magic(unsigned char *header)
 {
-	return (msg->header[0] == MAGIC);
+	return (header[0] == MAGIC);
 }
 
 /**
  * @brief Validate CTMP header padding
  * @details Header bytes 1 and 4-7 should contain 0x00
- * @param msg message to validate padding of
+ * @param header header to validate padding of
  * @param extended whether extended mode is enabled
  * @return true if valid padding, false otherwise
  */
-bool valid_padding(struct ctmp_msg *msg, bool extended)
+bool valid_padding(unsigned char *header, bool extended)
 {
 	int start, end;
 
@@ -152,13 +197,13 @@ bool valid_padding(struct ctmp_msg *msg, bool extended)
 
 		/* options byte should always be set to padding value if not in
 		 * extended mode */
-		if ((msg->header[OPTIONS_OFFSET] & PADDING) != 0) {
+		if ((header[OPTIONS_OFFSET] & PADDING) != 0) {
 			return false;
 		}
 	}
 
 	for (int i = start; i <= end; i++) {
-		if ((msg->header[i] & PADDING) != 0) {
+		if ((header[i] & PADDING) != 0) {
 			return false;
 		}
 	}
@@ -167,109 +212,163 @@ bool valid_padding(struct ctmp_msg *msg, bool extended)
 }
 
 /**
- * @brief Set CTMP message length
+ * @brief Get CTMP message length
  * @details Message length is stored in header bytes 2 and 3 as an unsigned
  * 16-bit network-order integer
- * @param msg `struct ctmp_msg` to set length of
+ * @param header header to read length from
+ * @return length of data following the header
  */
-void set_msg_length(struct ctmp_msg *msg)
+uint16_t get_msg_length(unsigned char *header)
 {
+	uint16_t len;
+
 	/* length = header bytes 2 and 3 */
-	msg->len = (msg->header[LENGTH_OFFSET+1] << 8) + msg->header[LENGTH_OFFSET];
+	len = (header[LENGTH_OFFSET+1] << 8) + header[LENGTH_OFFSET];
 	/* convert from network to host order */
-	msg->len = ntohs(msg->len);
+	return ntohs(len);
 }
 
 /**
- * @brief Read CTMP data based on header information
- * @param sender_fd file descriptor to read data from
- * @param msg `struct ctmp_msg` to store data in
- * @return number of bytes read (negative error code on failure)
+ * @brief Get the TTL carried by an extended CTMP message
+ * @details The TTL is stored in header bytes 6 and 7 as an unsigned 16-bit
+ * network-order integer if the "TTL" option is set
+ * @param header header of a message accepted with the "TTL" option enabled
+ * @return TTL in milliseconds, 0 if the message does not carry one
  */
-int read_ctmp_data(int sender_fd, struct ctmp_msg *msg)
+uint16_t get_msg_ttl(unsigned char *header)
 {
-	int bytes_read = 0;
-
-	msg->data = malloc((msg->len+1) * sizeof(unsigned char));
-	if (!msg->data) {
-		p_error("malloc", errno);
-		exit(errno);
+	if (!(header[OPTIONS_OFFSET] & OPT_TTL)) {
+		return 0;
 	}
 
-	/* explicitly set last byte to NULL terminator before reading in message */
-	msg->data[msg->len] = '\0';
-
-	bytes_read = read_msg(sender_fd, msg->data, msg->len);
-	return bytes_read;
+	return (header[TTL_OFFSET] << 8) | header[TTL_OFFSET+1];
 }
 
 /**
- * @brief Free a given `struct ctmp_msg` object
- * @param msg object to free
+ * @brief Get the channel an extended CTMP message is sent on
+ * @details The channel ID is stored in header bytes 6 and 7 as an unsigned
+ * 16-bit network-order integer if the "CHAN" option is set
+ * @param header header of a message accepted with the "CHAN" option enabled
+ * @return channel ID, 0 (the default channel) if the message does not carry one
  */
-void free_ctmp_msg(struct ctmp_msg *msg)
+uint16_t get_msg_channel(unsigned char *header)
 {
-	if (msg) {
-		if (msg->data) {
-			free(msg->data);
-		}
-		free(msg);
+	if (!(header[OPTIONS_OFFSET] & OPT_CHAN)) {
+		return 0;
 	}
+
+	return (header[CHANNEL_OFFSET] << 8) | header[CHANNEL_OFFSET+1];
 }
 
 /**
- * @brief Parse CTMP message on a given socket
- * @param sender_fd file desciptor to read message from
- * @return parsed message structure, NULL on error (invalid message/failed
- * to read)
+ * @brief Validate extended CTMP options
+ * @param header header of message to validate
+ * @param options optional options accepted (`OPT_TTL` and/or `OPT_CHAN`)
+ * @return true if the options are valid, false if the message should be
+ * dropped
+ * @details "TTL" and "CHAN" both use header bytes 6 and 7, so a message may
+ * only carry one of them
  */
-struct ctmp_msg *parse_ctmp_msg(int sender_fd)
+bool valid_options(unsigned char *header, unsigned char options)
 {
-	int res = 0;
-	struct ctmp_msg *msg = NULL;
+	unsigned char opts = header[OPTIONS_OFFSET];
 
-	msg = malloc(sizeof(struct ctmp_msg));
-	if (!msg) {
-		p_error("malloc", errno);
-		exit(errno);
+	if ((opts & ~(OPT_SEN | options)) == 0
+			&& (opts & (OPT_TTL | OPT_CHAN)) != (OPT_TTL | OPT_CHAN)) {
+		return true;
 	}
-	msg->data = NULL;
 
-	/* read in header */
-	res = read_ctmp_header(sender_fd, msg);
-	if (res < 0) {
-		free_ctmp_msg(msg);
-		msg = NULL;
-		goto out;
-	}
+	pr_err("invalid options (0x%02x)\n", opts);
+	return false;
+}
 
-	/* validate magic byte (first byte of header) */
-	if (!valid_magic(msg)) {
-		pr_err("invalid message: magic byte check failed (found 0x%02x, expected 0x%02x)\n",
-				msg->header[0], MAGIC);
-		free_ctmp_msg(msg);
-		msg = NULL;
-		goto out;
-	}
+/**
+ * @brief Determine whether a message is sensitive (needs its checksum validated)
+ * @param header message header
+ * @param extended whether extended mode is enabled
+ * @return true if the message is sensitive, false otherwise
+ */
+bool is_sensitive(unsigned char *header, bool extended)
+{
+	return (extended && (header[OPTIONS_OFFSET] & OPT_SEN));
+}
 
-	/* check padding correctly set to 0x00s */
-	if (!valid_padding(msg, false)) {
-		pr_err("invalid message: incorrect padding\n");
-	}
+/**
+ * @brief Start the one's complement sum of a CTMP message with its header
+ * @param msg_header CTMP header of the message
+ * @return running (unfolded) sum of the header
+ * @details For purposes of computing the checksum, the value of the checksum
+ * field is filled with 0xCC (magic) bytes
+ */
+uint64_t header_sum(unsigned char *msg_header)
+{
+	unsigned char header[HEADER_LENGTH];
 
-	/* get message length from header */
-	set_msg_length(msg);
+	/* copy header to preserve original checksum value */
+	memcpy(header, msg_header, HEADER_LENGTH);
 
-	res = read_ctmp_data(sender_fd, msg);
-	if (res < 0) {
-		free_ctmp_msg(msg);
-		msg = NULL;
+	/* fill checksum field (bytes 4 and 5) with MAGIC (0xCC) */
+	header[CHECKSUM_OFFSET] = MAGIC;
+	header[CHECKSUM_OFFSET+1] = MAGIC;
+
+	return csum_add(header, HEADER_LENGTH, 0);
+}
+
+/**
+ * @brief Validate the checksum of a sensitive message
+ * @param header message header (containing the expected checksum)
+ * @param sum running sum of the whole message (header and data)
+ * @return true if the checksum is valid, false otherwise
+ */
+bool valid_checksum(unsigned char *header, uint64_t sum)
+{
+	uint16_t header_checksum, expected_checksum;
+
+	header_checksum = (header[CHECKSUM_OFFSET+1] << 8) + header[CHECKSUM_OFFSET];
+	/* one's complement of the one's complement sum */
+	expected_checksum = ~csum_fold(sum);
+	pr_debug("checksum in header: %u, calculated: %u\n", header_checksum, expected_checksum);
+
+	if (header_checksum != expected_checksum) {
+		pr_err("invalid message: checksum validation failed (found %u, expected %u)\n",
+				header_checksum, expected_checksum);
+		return false;
 	}
 
-out:
+	return true;
+}
+
+/**
+ * @brief Allocate a `struct ctmp_msg` for a given header
+ * @param header message header (copied into the message)
+ * @return newly allocated message (exits on allocation failure)
+ * @details The message is allocated from the pool as a single object. The
+ * data (`len` bytes, from the header) is left for the caller to fill in.
+ */
+struct ctmp_msg *new_ctmp_msg(unsigned char *header)
+{
+	struct ctmp_msg *msg = NULL;
+	uint16_t len = get_msg_length(header);
+
+	msg = pool_alloc(CTMP_MSG_SIZE(len));
+	msg->len = len;
+	memcpy(msg->header, header, HEADER_LENGTH);
+	/* explicitly set last byte to NULL terminator */
+	msg->data[msg->len] = '\0';
+
 	return msg;
 }
 
+/**
+ * @brief Free a given `struct ctmp_msg` object
+ * @param msg object to free
+ */
+void free_ctmp_msg(struct ctmp_msg *msg)
+{
+	if (msg) {
+		pool_free(msg, CTMP_MSG_SIZE(msg->len));
+	}
+}
 
 /**
  * @brief Send a CTMP message
@@ -279,18 +378,8 @@ out:
  */
 ssize_t send_ctmp_msg(int receiver_fd, struct ctmp_msg *msg)
 {
-	int res = 0;
-
-	/* send header */
-	res = send_msg(receiver_fd, msg->header, HEADER_LENGTH);
-	if (res < 0) {
-		goto out;
-	}
-
-	res = send_msg(receiver_fd, msg->data, msg->len);
-
-out:
-	return res;
+	/* header and data are contiguous: send as a single frame */
+	return send_msg(receiver_fd, msg->header, HEADER_LENGTH + msg->len);
 }
 
 /**
@@ -298,132 +387,298 @@ out:
  * @details Checksum is the 16-bit one's complement sum of all 16-bit words in
  * the header and the data. For purposes of computing the checksum, the value of
  * the checksum field is filled with 0xCC (magic) bytes
- * @param msg CTMP message to calculate checksum for
+ * @param msg_header CTMP header of the message
+ * @param data data following the header
+ * @param len length of data
  * @return calculated checksum
  */
-uint16_t calc_checksum(struct ctmp_msg *msg)
+uint16_t calc_checksum(unsigned char *msg_header, unsigned char *data,
+		uint16_t len)
 {
-	register long sum = 0;
-	uint16_t count;
-	uint16_t *addr;
-	unsigned char header[HEADER_LENGTH];
+	uint64_t sum;
 
-	/* copy header to preserve original checksum value */
-	memcpy(header, msg->header, HEADER_LENGTH);
+	/* header portion, then data portion (header length is even, so the data
+	 * starts on a 16-bit word boundary) */
+	sum = header_sum(msg_header);
+	sum = csum_add(data, len, sum);
 
-	/* based on RFC 1071 implementation of the IP checksum:
-	 * https://datatracker.ietf.org/doc/html/rfc1071
-	 */
+	/* one's complement of the one's complement sum */
+	return ~csum_fold(sum);
+}
 
-	/* fill checksum field (bytes 4 and 5) with MAGIC (0xCC) */
-	header[CHECKSUM_OFFSET] = MAGIC;
-	header[CHECKSUM_OFFSET+1] = MAGIC;
+/**
+ * @brief Initialise a CTMP ingest stream for a given connection
+ * @param stream stream to initialise
+ * @param fd file descriptor to read frames from
+ * @param extended whether to parse frames as extended CTMP
+ * @param options optional options to accept (`OPT_TTL` and/or `OPT_CHAN`,
+ * extended CTMP only)
+ * @param counters counters of the source thread receiving from the stream
+ * (dropped frames are counted here)
+ */
+void init_ctmp_stream(struct ctmp_stream *stream, int fd, bool extended,
+		unsigned char options, struct ingest_counters *counters)
+{
+	stream->fd = fd;
+	stream->extended = extended;
+	stream->options = extended ? options : 0;
+	stream->start = 0;
+	stream->end = 0;
+	stream->skip = 0;
+	stream->msg = NULL;
+	stream->received = 0;
+	stream->sum = 0;
+	stream->counters = counters;
+
+	stream->buf = malloc(STREAM_BUF_SIZE * sizeof(unsigned char));
+	if (!stream->buf) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+}
+
+/**
+ * @brief Free the buffer (and any partially received message) of a given CTMP
+ * ingest stream
+ * @param stream stream to free
+ */
+void free_ctmp_stream(struct ctmp_stream *stream)
+{
+	free(stream->buf);
+	stream->buf = NULL;
 
-	addr = (uint16_t *) header;
-	/* header portion */
-	for (int i = 0; i < HEADER_LENGTH; i += 2) {
-		sum += (uint16_t) *addr++;
+	free_ctmp_msg(stream->msg);
+	stream->msg = NULL;
+}
+
+/**
+ * @brief Carry a partial header over to the start of the stream buffer
+ * @param stream stream to compact
+ */
+void compact_ctmp_stream(struct ctmp_stream *stream)
+{
+	if (stream->start > 0) {
+		memmove(stream->buf, &stream->buf[stream->start],
+				stream->end - stream->start);
+		stream->end -= stream->start;
+		stream->start = 0;
 	}
+}
 
-	addr = (uint16_t *) msg->data;
-	count = msg->len;
-	/* data portion */
-	while (count > 1) {
-		sum += (uint16_t) *addr++;
-		count -= 2;
+/**
+ * @brief Account for a chunk of a partially received message's frame
+ * @param stream stream the message is being received on
+ * @param len number of bytes received (stored after `received` bytes of the
+ * frame)
+ * @details Sums the new chunk of a sensitive message while it is still in cache
+ */
+void frame_chunk_received(struct ctmp_stream *stream, size_t len)
+{
+	if (is_sensitive(stream->msg->header, stream->extended)) {
+		stream->sum = csum_add_at(&stream->msg->header[stream->received],
+				len, stream->received, stream->sum);
 	}
+	stream->received += len;
+}
 
-	/* add leftover byte (if any) */
-	if (count > 0) {
-		sum += * (uint8_t *) addr;
+/**
+ * @brief Receive as much data as is available into a CTMP ingest stream
+ * @param stream stream to read into
+ * @return number of bytes read, 0 if the connection has been closed, negative
+ * error code on `recv()` failure (`-EAGAIN` if nothing is available on a
+ * non-blocking socket)
+ *
+ * @details If a message is partially received, the rest of its frame is read
+ * directly into the message and any following bytes into the stream buffer,
+ * with a single `readv()`. The checksum of a sensitive message is updated
+ * with each chunk as it arrives.
+ */
+ssize_t fill_ctmp_stream(struct ctmp_stream *stream)
+{
+	ssize_t bytes_read;
+	size_t frame_len = 0, frame_bytes = 0;
+	struct iovec iov[2];
+	int iovcnt = 0;
+
+	compact_ctmp_stream(stream);
+
+	if (stream->msg) {
+		frame_len = HEADER_LENGTH + stream->msg->len;
+		iov[iovcnt].iov_base = &stream->msg->header[stream->received];
+		iov[iovcnt].iov_len = frame_len - stream->received;
+		iovcnt++;
 	}
+	iov[iovcnt].iov_base = &stream->buf[stream->end];
+	iov[iovcnt].iov_len = STREAM_BUF_SIZE - stream->end;
+	iovcnt++;
 
-	/* fold to 16 bits by adding 16-bit segments */
-	while (sum >> 16)
-		sum = (sum & 0xffff) + (sum >> 16);
+	do {
+		bytes_read = readv(stream->fd, iov, iovcnt);
+	} while (bytes_read < 0 && errno == EINTR);
 
-	/* one's complement of the one's complement sum */
-	return ~sum;
+	if (bytes_read < 0) {
+		/* nothing to read on a non-blocking socket is not an error */
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			p_error("readv", errno);
+		}
+		return -errno;
+	}
+
+	if (stream->msg) {
+		frame_bytes = frame_len - stream->received;
+		if ((size_t) bytes_read < frame_bytes) {
+			frame_bytes = bytes_read;
+		}
+		frame_chunk_received(stream, frame_bytes);
+	}
+	stream->end += bytes_read - frame_bytes;
+
+	return bytes_read;
 }
 
 /**
- * @brief Parse an extended CTMP message
- * @details Calculate and validate the checksum for messages where the sensitive
- * options bit is 1, dropping messages with invalid checksums
- * @param sender_fd file desciptor to read message from
- * @return parsed message structure, NULL on error (invalid message/failed
- * to read)
+ * @brief Add data received elsewhere (e.g. into an io_uring provided buffer) to a
+ * CTMP ingest stream
+ * @param stream stream to add data to
+ * @param data received data
+ * @param len length of data (at most `STREAM_BUF_SIZE - HEADER_LENGTH`)
+ * @details Equivalent to `fill_ctmp_stream()` receiving `data`: the rest of a
+ * partially received message is copied straight into the message
  */
-struct ctmp_msg *parse_ctmp_msg_extended(int sender_fd)
+void feed_ctmp_stream(struct ctmp_stream *stream, unsigned char *data,
+		size_t len)
 {
-	int res = 0;
-	struct ctmp_msg *msg = NULL;
-	uint16_t header_checksum, expected_checksum;
+	size_t frame_bytes = 0;
 
-	msg = malloc(sizeof(struct ctmp_msg));
-	if (!msg) {
-		p_error("malloc", errno);
-		exit(errno);
+	compact_ctmp_stream(stream);
+
+	if (stream->msg) {
+		frame_bytes = HEADER_LENGTH + stream->msg->len - stream->received;
+		if (len < frame_bytes) {
+			frame_bytes = len;
+		}
+		memcpy(&stream->msg->header[stream->received], data, frame_bytes);
+		frame_chunk_received(stream, frame_bytes);
 	}
-	msg->data = NULL;
 
-	/* read in header */
-	res = read_ctmp_header(sender_fd, msg);
-	if (res < 0) {
-		/* read failed */
+	memcpy(&stream->buf[stream->end], &data[frame_bytes], len - frame_bytes);
+	stream->end += len - frame_bytes;
+}
+
+/**
+ * @brief Finish a message once its whole frame has been received
+ * @param stream stream the message was received on
+ * @param msg message to finish
+ * @return `msg` if it is valid, NULL if it has been dropped
+ */
+struct ctmp_msg *finish_ctmp_msg(struct ctmp_stream *stream,
+		struct ctmp_msg *msg)
+{
+	if (is_sensitive(msg->header, stream->extended)
+			&& !valid_checksum(msg->header, stream->sum)) {
+		add_count(&stream->counters->bad_checksum, 1);
 		free_ctmp_msg(msg);
-		msg = NULL;
-		goto out;
+		return NULL;
 	}
 
-	/* validate magic byte (first byte of header) */
-	if (!valid_magic(msg)) {
-		pr_err("invalid message: magic byte check failed (found 0x%02x, expected 0x%02x)\n",
-				msg->header[0], MAGIC);
-		free(msg);
-		msg = NULL;
-		goto out;
-	}
+	return msg;
+}
 
-	/* check padding correctly set to 0x00s */
-	if (!valid_padding(msg, true)) {
-		pr_err("invalid message: incorrect padding\n");
-	}
+/**
+ * @brief Get the next complete, valid CTMP message from an ingest stream
+ * @param stream stream to parse
+ * @return parsed message structure, NULL if the stream does not contain a
+ * complete frame (call `fill_ctmp_stream()` and try again)
+ *
+ * @details Headers are validated in place in the stream buffer: invalid frames
+ * are consumed and dropped without being copied. Data is copied from the
+ * stream buffer into the message and summed in the same pass; if the frame is
+ * incomplete, the rest of it is received directly into the message.
+ */
+struct ctmp_msg *next_ctmp_msg(struct ctmp_stream *stream)
+{
+	unsigned char *header;
+	size_t avail, data_bytes;
+	struct ctmp_msg *msg = NULL;
 
-	set_msg_length(msg);
+	/* message whose frame was (partially) received directly */
+	if (stream->msg) {
+		if (stream->received < HEADER_LENGTH + stream->msg->len) {
+			return NULL;
+		}
+		msg = stream->msg;
+		stream->msg = NULL;
 
-	res = read_ctmp_data(sender_fd, msg);
-	if (res < 0) {
-		free_ctmp_msg(msg);
-		msg = NULL;
-		goto out;
+		msg = finish_ctmp_msg(stream, msg);
+		if (msg) {
+			return msg;
+		}
 	}
 
-	/* check options */
-	switch (msg->header[OPTIONS_OFFSET]) {
-	case OPT_NORM:
-		/* do nothing */
-		break;
-	case OPT_SEN:
-		/* validate checksum */
-		header_checksum = (msg->header[CHECKSUM_OFFSET+1] << 8) + msg->header[CHECKSUM_OFFSET];
-		expected_checksum = calc_checksum(msg);
-		pr_debug("checksum in header: %u, calculated: %u\n", header_checksum, expected_checksum);
-
-		if (header_checksum != expected_checksum) {
-			pr_err("invalid message: checksum validation failed (found %u, expected %u)\n",
-					header_checksum, expected_checksum);
-			free_ctmp_msg(msg);
-			msg = NULL;
+	while (stream->end - stream->start >= HEADER_LENGTH || stream->skip > 0) {
+		avail = stream->end - stream->start;
+
+		/* discard data of a dropped frame */
+		if (stream->skip > 0) {
+			data_bytes = (avail < stream->skip) ? avail : stream->skip;
+			stream->start += data_bytes;
+			stream->skip -= data_bytes;
+			if (stream->skip > 0) {
+				return NULL;
+			}
+			continue;
+		}
+
+		header = &stream->buf[stream->start];
+		stream->start += HEADER_LENGTH;
+		avail -= HEADER_LENGTH;
+
+		/* validate magic byte (first byte of header) */
+		if (!valid_magic(header)) {
+			pr_err("invalid message: magic byte check failed (found 0x%02x, expected 0x%02x)\n",
+					header[0], MAGIC);
+			add_count(&stream->counters->bad_magic, 1);
+			/* drop the header */
+			continue;
+		}
+
+		/* check padding correctly set to 0x00s */
+		if (!valid_padding(header, stream->extended)) {
+			pr_err("invalid message: incorrect padding\n");
+		}
+
+		/* check options (extended CTMP only): drop the whole frame */
+		if (stream->extended && !valid_options(header, stream->options)) {
+			add_count(&stream->counters->bad_options, 1);
+			stream->skip = get_msg_length(header);
+			continue;
+		}
+
+		msg = new_ctmp_msg(header);
+		stream->sum = 0;
+		data_bytes = (avail < msg->len) ? avail : msg->len;
+
+		/* copy (and sum) the data received so far */
+		if (is_sensitive(header, stream->extended)) {
+			stream->sum = csum_copy(msg->data, &stream->buf[stream->start],
+					data_bytes, header_sum(header));
+		} else {
+			memcpy(msg->data, &stream->buf[stream->start], data_bytes);
+		}
+		stream->start += data_bytes;
+
+		if (data_bytes < msg->len) {
+			/* receive the rest of the frame directly into the message */
+			stream->msg = msg;
+			stream->received = HEADER_LENGTH + data_bytes;
+			return NULL;
+		}
+
+		msg = finish_ctmp_msg(stream, msg);
+		if (msg) {
+			return msg;
 		}
-		break;
-	default:
-		pr_err("invalid options (0x%02x)\n", msg->header[OPTIONS_OFFSET]);
-		free_ctmp_msg(msg);
-		msg = NULL;
-		break;
 	}
 
-out:
-	return msg;
+	return NULL;
 }
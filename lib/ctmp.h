@@ -5,6 +5,9 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define MAGIC 0xcc  ///< CTMP header magic byte
 #define HEADER_LENGTH 8  ///< CTMP header length
@@ -14,6 +17,8 @@
 #define LENGTH_OFFSET 2 ///< first byte of message length: 2 bytes long
 #define OPTIONS_OFFSET 1  ///< options = first byte of header in extended version
 #define CHECKSUM_OFFSET 4  ///< first byte of checksum: 2 bytes long
+#define TTL_OFFSET 6  ///< first byte of message TTL (extended CTMP "TTL" option only): 2 bytes long
+#define CHANNEL_OFFSET 6  ///< first byte of channel ID (extended CTMP "CHAN" option only): 2 bytes long
 
 #define PADDING_START 4  ///< start of base CTMP padding (excluding byte 1)
 #define PADDING_END 7  ///< end of base CTMP padding (excluding byte 1)
@@ -23,24 +28,72 @@
 
 #define OPT_NORM 0x00  ///< extended CTMP "NORMAL" option
 #define OPT_SEN 0x40  ///< extended CTMP "SEN" (sensitive) option
+#define OPT_TTL 0x80  ///< extended CTMP "TTL" option: header carries the message TTL (milliseconds)
+#define OPT_CHAN 0x20  ///< extended CTMP "CHAN" option: header carries a channel ID (not combined with "TTL")
+
+#define MAX_FRAME_LENGTH (HEADER_LENGTH + UINT16_MAX)  ///< header + maximum data length
+#define STREAM_BUF_SIZE (128 * 1024)  ///< ingest buffer size (maximum bytes per `readv()`)
+
+#define SEND_BATCH_FRAMES 64  ///< maximum number of frames per vectored send
+#define SEND_BATCH_BYTES (256 * 1024)  ///< stop adding frames to a vectored send past this many bytes
 
 /**
  * @brief CTMP message
+ * @details Allocated as a single object: `header` and `data` are contiguous, so
+ * `header` is a ready-to-send wire frame of `HEADER_LENGTH + len` bytes
  */
 struct ctmp_msg
 {
-	unsigned char header[HEADER_LENGTH];  ///< message header
 	uint16_t len;  ///< length of data following header
-	unsigned char *data;  ///< data following header
+	unsigned char header[HEADER_LENGTH];  ///< message header
+	unsigned char data[];  ///< data following header (NULL-terminated)
+};
+
+/**
+ * @brief Size of the allocation holding a message with `len` bytes of data
+ */
+#define CTMP_MSG_SIZE(len) (sizeof(struct ctmp_msg) + (len) + 1)
+
+struct ingest_counters;
+
+/**
+ * @brief Buffered CTMP ingest stream for a single source connection
+ * @details Data is received in large chunks and as many frames as possible are
+ * parsed from each chunk. Bytes in `buf[start, end)` have been received but not
+ * yet consumed (at most a partial header after `next_ctmp_msg()` returns NULL).
+ * The rest of a partially received frame is received directly into `msg`.
+ */
+struct ctmp_stream {
+	int fd;  ///< file descriptor to receive from
+	bool extended;  ///< parse frames as extended CTMP?
+	unsigned char options;  ///< optional options accepted (`OPT_TTL` and/or `OPT_CHAN`, extended CTMP only)
+	unsigned char *buf;  ///< receive buffer (`STREAM_BUF_SIZE` bytes)
+	size_t start;  ///< offset of first unconsumed byte
+	size_t end;  ///< offset one past the last received byte
+	size_t skip;  ///< number of bytes still to discard from a dropped frame
+	struct ctmp_msg *msg;  ///< partially received message (NULL if none)
+	size_t received;  ///< number of frame bytes of `msg` received so far
+	uint64_t sum;  ///< running checksum of `msg` (sensitive messages only)
+	struct ingest_counters *counters;  ///< counters of the source thread receiving from the stream
 };
 
 int read_msg(int fd, unsigned char *buf, uint16_t len);
-int send_msg(int fd, unsigned char *buf, uint16_t len);
+int send_msg(int fd, unsigned char *buf, size_t len);
+int send_msgs(int fd, struct iovec *frames, int num_frames);
 
 void free_ctmp_msg(struct ctmp_msg *msg);
-struct ctmp_msg *parse_ctmp_msg(int sender_fd);
 ssize_t send_ctmp_msg(int receiver_fd, struct ctmp_msg *msg);
 
+void init_ctmp_stream(struct ctmp_stream *stream, int fd, bool extended,
+		unsigned char options, struct ingest_counters *counters);
+void free_ctmp_stream(struct ctmp_stream *stream);
+ssize_t fill_ctmp_stream(struct ctmp_stream *stream);
+void feed_ctmp_stream(struct ctmp_stream *stream, unsigned char *data,
+		size_t len);
+struct ctmp_msg *next_ctmp_msg(struct ctmp_stream *stream);
+uint16_t get_msg_ttl(unsigned char *header);
+uint16_t get_msg_channel(unsigned char *header);
+
 /* Wire Storm Reloaded (extended CTMP) */
-uint16_t calc_checksum(struct ctmp_msg *msg);
-struct ctmp_msg *parse_ctmp_msg_extended(int sender_fd);
+uint16_t calc_checksum(unsigned char *msg_header, unsigned char *data,
+		uint16_t len);
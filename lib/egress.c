@@ -0,0 +1,368 @@
+/**
+ * @file egress.c
+ * @brief Definitions of functions for the event-driven egress engine
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "ctmp.h"
+#include "msg_queue.h"
+#include "msg_log.h"
+#include "channel.h"
+#include "replay.h"
+#include "egress.h"
+#include "zerocopy.h"
+#include "lag.h"
+#include "stats.h"
+#include "latency.h"
+#include "probes.h"
+#include "log.h"
+
+/**
+ * @brief Initialise an egress worker
+ * @param worker worker to initialise
+ * @details Creates its epoll instance and event file descriptor (registered
+ * with `data.ptr` = NULL). The worker thread itself is not started.
+ */
+void init_egress_worker(struct egress_worker *worker)
+{
+	struct epoll_event event;
+
+	worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (worker->epoll_fd < 0) {
+		p_error("epoll_create1", errno);
+		exit(errno);
+	}
+
+	worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->event_fd < 0) {
+		p_error("eventfd", errno);
+		exit(errno);
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd,
+				&event) < 0) {
+		p_error("epoll_ctl", errno);
+		exit(errno);
+	}
+
+	atomic_init(&worker->waiting, true);
+	atomic_init(&worker->num_receivers, 0);
+	worker->num_handshakes = 0;
+	pthread_mutex_init(&worker->lock, NULL);
+	TAILQ_INIT(&worker->incoming);
+	TAILQ_INIT(&worker->receivers);
+}
+
+/**
+ * @brief Find the egress worker serving the fewest receivers
+ * @param workers array of egress workers
+ * @param num_workers number of egress workers
+ * @return least loaded egress worker
+ */
+struct egress_worker *least_loaded_egress_worker(struct egress_worker *workers,
+		int num_workers)
+{
+	struct egress_worker *best = &workers[0];
+
+	for (int i = 1; i < num_workers; i++) {
+		if (atomic_load(&workers[i].num_receivers)
+				< atomic_load(&best->num_receivers)) {
+			best = &workers[i];
+		}
+	}
+
+	return best;
+}
+
+/**
+ * @brief Signal an egress worker's event file descriptor
+ * @param worker worker to signal
+ */
+static void signal_egress_worker(struct egress_worker *worker)
+{
+	uint64_t one = 1;
+
+	if (write(worker->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		p_error("write", errno);
+	}
+}
+
+/**
+ * @brief Hand a new receiver connection over to an egress worker
+ * @param worker worker to serve the receiver
+ * @param fd (non-blocking) receiver socket file descriptor
+ * @details The worker adopts the receiver the next time it wakes up
+ */
+void assign_receiver(struct egress_worker *worker, int fd)
+{
+	struct receiver *receiver;
+
+	receiver = malloc(sizeof(struct receiver));
+	if (!receiver) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	receiver->fd = fd;
+	receiver->cursor = 0;
+	receiver->batch_start = 0;
+	receiver->batch_end = 0;
+	receiver->offset = 0;
+	receiver->zc = NULL;
+	receiver->zc_len = 0;
+	receiver->blocked = false;
+	receiver->corked = false;
+	receiver->awaiting_handshake = false;
+	init_handshake(&receiver->handshake, false);
+	receiver->sub.num_channels = 0;
+	receiver->log_cursor = NULL;
+	receiver->stats = NULL;
+
+	atomic_fetch_add(&worker->num_receivers, 1);
+
+	pthread_mutex_lock(&worker->lock);
+	TAILQ_INSERT_TAIL(&worker->incoming, receiver, entries);
+	pthread_mutex_unlock(&worker->lock);
+
+	signal_egress_worker(worker);
+}
+
+/**
+ * @brief Notify an egress worker of new messages
+ * @param worker worker to notify
+ * @details Only signals the worker if it is waiting, so a busy worker costs
+ * producers a single atomic operation
+ */
+void wake_egress_worker(struct egress_worker *worker)
+{
+	if (atomic_exchange(&worker->waiting, false)) {
+		signal_egress_worker(worker);
+	}
+}
+
+/**
+ * @brief Reset an egress worker's event file descriptor after it has fired
+ * @param worker worker to reset
+ */
+void clear_egress_event(struct egress_worker *worker)
+{
+	uint64_t count;
+
+	if (read(worker->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		p_error("read", errno);
+	}
+}
+
+/**
+ * @brief Continue sending a receiver's batch of claimed frames
+ * @param receiver receiver to send to
+ * @return 0 once the whole batch has been sent, `-EAGAIN` if the socket send
+ * buffer is full, other negative errno on error
+ * @details Every remaining frame goes into a single `sendmsg()` call (repeated
+ * after partial sends), except that frames of at least `zc_len` bytes are sent
+ * on their own with `MSG_ZEROCOPY` if enabled. The receiver's reference to each
+ * frame is released as soon as it has been sent in full.
+ */
+static int send_receiver_batch(struct receiver *receiver)
+{
+	int num_frames;
+	size_t frame_len;
+	ssize_t res;
+	uint64_t done_tick;
+	struct iovec frames[SEND_BATCH_FRAMES];
+	struct msghdr hdr = {
+		.msg_iov = frames
+	};
+	struct ctmp_msg *msg;
+	struct msg_entry *entry;
+
+	while (receiver->batch_start < receiver->batch_end) {
+		num_frames = 0;
+		for (int i = receiver->batch_start; i < receiver->batch_end; i++) {
+			msg = receiver->batch[i]->msg;
+			frame_len = HEADER_LENGTH + msg->len;
+			if (receiver->zc && frame_len >= receiver->zc_len
+					&& num_frames > 0) {
+				/* zero-copy frame: send on its own */
+				break;
+			}
+			frames[num_frames].iov_base = msg->header;
+			frames[num_frames++].iov_len = frame_len;
+			if (receiver->zc && frame_len >= receiver->zc_len) {
+				break;
+			}
+		}
+
+		if (receiver->zc && frames[0].iov_len >= receiver->zc_len) {
+			res = send_zc_msg(receiver->zc, receiver->fd,
+					receiver->batch[receiver->batch_start],
+					receiver->offset, MSG_DONTWAIT);
+		} else {
+			/* resume a partially sent frame */
+			frames[0].iov_base = (unsigned char *) frames[0].iov_base
+				+ receiver->offset;
+			frames[0].iov_len -= receiver->offset;
+			hdr.msg_iovlen = num_frames;
+
+			res = sendmsg(receiver->fd, &hdr,
+					MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (res < 0) {
+				res = -errno;
+			}
+		}
+		if (res == -EINTR) {
+			continue;
+		} else if (res < 0) {
+			return res;
+		}
+
+		/* release frames sent in full */
+		res += receiver->offset;
+		done_tick = latency_tick();
+		while (receiver->batch_start < receiver->batch_end) {
+			entry = receiver->batch[receiver->batch_start];
+			frame_len = HEADER_LENGTH + entry->msg->len;
+			if ((size_t) res < frame_len) {
+				break;
+			}
+			res -= frame_len;
+			PROBE_MSG_SENT(entry->seq, receiver->fd);
+			record_send_latency(entry->parse_tick,
+					receiver->pickup_tick, done_tick);
+			release_msg(entry, 1);
+			receiver->batch_start++;
+			add_count(&receiver->stats->msgs, 1);
+			add_count(&receiver->stats->bytes, frame_len);
+		}
+		receiver->offset = res;
+	}
+
+	receiver->batch_start = 0;
+	receiver->batch_end = 0;
+	return 0;
+}
+
+/**
+ * @brief Release a receiver's references to the frames it has claimed but not
+ * sent in full (and to the message log, if replaying from it)
+ * @param receiver receiver (closed)
+ */
+void release_receiver_batch(struct receiver *receiver)
+{
+	while (receiver->batch_start < receiver->batch_end) {
+		release_msg(receiver->batch[receiver->batch_start++], 1);
+	}
+	receiver->batch_end = 0;
+
+	if (receiver->log_cursor) {
+		close_log_cursor(receiver->log_cursor);
+		receiver->log_cursor = NULL;
+	}
+}
+
+/**
+ * @brief Claim the next batch of messages due to a receiver
+ * @param receiver receiver (with an empty batch)
+ * @param ring message queue
+ * @return number of messages claimed (0 if the receiver is caught up),
+ * `-ECONNABORTED` if the receiver exceeds a lag limit and should be disconnected
+ * @details Claims up to `SEND_BATCH_FRAMES` frames or `SEND_BATCH_BYTES` bytes
+ * (only on its channels if the receiver is subscribed), after applying the lag
+ * policy. With latency tracking, the time each message waited in the queue is
+ * recorded.
+ */
+static int claim_receiver_batch(struct receiver *receiver,
+		struct msg_ring *ring)
+{
+	size_t num_bytes = 0;
+	uint64_t tail = ring_tail(ring), head = ring_head(ring, tail), seq;
+	struct msg_entry *entry;
+
+	if (receiver->cursor < head) {
+		pr_debug("dst connection %d: skipping %lu overwritten messages\n",
+				receiver->fd, head - receiver->cursor);
+		receiver->cursor = head;
+	}
+	if (enforce_lag_limits(ring, &receiver->sub, &receiver->cursor,
+				receiver->fd) < 0) {
+		return -ECONNABORTED;
+	}
+
+	receiver->pickup_tick = latency_tick();
+	while (receiver->batch_end < SEND_BATCH_FRAMES && num_bytes < SEND_BATCH_BYTES
+			&& (seq = next_due_seq(&receiver->sub, &receiver->cursor,
+					tail)) < tail) {
+		if ((entry = claim_msg(ring, seq))) {
+			PROBE_MSG_PICKED(seq, receiver->fd);
+			if (latency_enabled()) {
+				record_latency(STAGE_QUEUE,
+						msg_enqueue_tick(ring, seq),
+						receiver->pickup_tick);
+			}
+			receiver->batch[receiver->batch_end++] = entry;
+			num_bytes += HEADER_LENGTH + entry->msg->len;
+		}
+	}
+	receiver->offset = 0;
+	atomic_store_explicit(&receiver->stats->cursor, receiver->cursor,
+			memory_order_relaxed);
+
+	return receiver->batch_end;
+}
+
+/**
+ * @brief Send a receiver every message it is due, until it catches up or its
+ * socket would block
+ * @param receiver receiver to send to
+ * @param ring message queue
+ * @return 0 if the receiver has caught up, `-EAGAIN` if its socket send buffer
+ * is full (wait for `EPOLLOUT`), other negative errno on error or if the
+ * receiver should be disconnected
+ * @details Messages replayed from the message log are sent first
+ */
+int pump_receiver(struct receiver *receiver, struct msg_ring *ring)
+{
+	int res;
+
+	if (receiver->log_cursor) {
+		res = send_log_frames(receiver->log_cursor, receiver->fd,
+				MSG_DONTWAIT);
+		if (res < 0) {
+			return res;
+		}
+		close_log_cursor(receiver->log_cursor);
+		receiver->log_cursor = NULL;
+	}
+
+	do {
+		if ((res = send_receiver_batch(receiver)) < 0) {
+			return res;
+		}
+	} while ((res = claim_receiver_batch(receiver, ring)) > 0);
+
+	return res;
+}
+
+/**
+ * @brief Discard any data sent by a receiver
+ * @param receiver receiver to read from
+ * @return true if the connection is still open, false if it has been closed
+ * (or has failed)
+ */
+bool drain_receiver(struct receiver *receiver)
+{
+	char buf[512];
+	ssize_t res;
+
+	while ((res = recv(receiver->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0);
+
+	return (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+				|| errno == EINTR));
+}
@@ -0,0 +1,84 @@
+/**
+ * @file egress.h
+ * @brief Constants, structs, and functions for the event-driven egress engine
+ * @details An alternative to one worker thread per receiver: a small number of
+ * egress threads each multiplex many non-blocking receiver sockets with
+ * `epoll`. Every receiver keeps its own position in the message queue and the
+ * state of any partially-sent frame, so a slow receiver never blocks the
+ * others served by the same thread.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <pthread.h>
+
+struct msg_entry;
+struct msg_ring;
+struct zc_socket;
+struct log_cursor;
+struct receiver_stats;
+
+/**
+ * @brief Event-driven receiver connection
+ */
+struct receiver {
+	int fd;  ///< (non-blocking) socket file descriptor
+	uint64_t cursor;  ///< sequence number of the next message to visit
+	/**
+	 * @brief claimed entries not yet sent in full
+	 * @details Sent with vectored sends: `batch[batch_start, batch_end)`
+	 * remain
+	 */
+	struct msg_entry *batch[SEND_BATCH_FRAMES];
+	int batch_start;  ///< index of the first entry of `batch` not yet sent in full
+	int batch_end;  ///< number of entries in `batch`
+	size_t offset;  ///< number of bytes of `batch[batch_start]` already sent
+	uint64_t pickup_tick;  ///< latency clock tick `batch` was claimed at (0 if not tracked)
+	struct zc_socket *zc;  ///< zero-copy send state (NULL if not in use)
+	size_t zc_len;  ///< minimum frame length to send with `MSG_ZEROCOPY`
+	bool blocked;  ///< socket send buffer full: waiting for `EPOLLOUT`
+	bool corked;  ///< socket corked by its profile: flushed whenever the receiver catches up
+	bool awaiting_handshake;  ///< not sent anything until its handshake is served
+	struct receiver_handshake handshake;  ///< replay or subscription handshake received so far
+	struct timespec handshake_deadline;  ///< when to stop waiting for the handshake
+	struct subscription sub;  ///< channels the receiver is subscribed to
+	struct log_cursor *log_cursor;  ///< replay from the message log still to send before the queue (NULL if none)
+	struct receiver_stats *stats;  ///< counters (NULL until adopted)
+	TAILQ_ENTRY(receiver) entries;  ///< prev + next pointers for receiver list
+};
+TAILQ_HEAD(receiver_list, receiver);
+
+/**
+ * @brief Egress thread state
+ */
+struct egress_worker {
+	pthread_t thread;
+	int epoll_fd;
+	int event_fd;  ///< signalled for new receivers and new messages
+	/**
+	 * @brief whether the worker needs `event_fd` to be signalled for new
+	 * messages
+	 * @details Set by the worker before it catches up its receivers, cleared
+	 * by the first producer to signal it afterwards
+	 */
+	_Atomic bool waiting;
+	_Atomic int num_receivers;  ///< number of receivers assigned to the worker
+	int num_handshakes;  ///< number of receivers awaiting their handshake (worker only)
+	pthread_mutex_t lock;  ///< protects `incoming`
+	struct receiver_list incoming;  ///< receivers assigned but not yet adopted
+	struct receiver_list receivers;  ///< receivers being served (worker only)
+};
+
+void init_egress_worker(struct egress_worker *worker);
+struct egress_worker *least_loaded_egress_worker(struct egress_worker *workers,
+		int num_workers);
+void assign_receiver(struct egress_worker *worker, int fd);
+void wake_egress_worker(struct egress_worker *worker);
+void clear_egress_event(struct egress_worker *worker);
+
+int pump_receiver(struct receiver *receiver, struct msg_ring *ring);
+void release_receiver_batch(struct receiver *receiver);
+bool drain_receiver(struct receiver *receiver);
@@ -0,0 +1,159 @@
+/**
+ * @file expiry.c
+ * @brief Definitions of functions for message expiry
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "msg_queue.h"
+#include "expiry.h"
+#include "timestamp.h"
+#include "log.h"
+
+/**
+ * @brief Initialise an empty timer wheel starting now
+ * @param wheel timer wheel to initialise
+ */
+void init_timer_wheel(struct timer_wheel *wheel)
+{
+	for (int i = 0; i < WHEEL_SLOTS; i++) {
+		wheel->buckets[i].timers = NULL;
+		wheel->buckets[i].len = 0;
+		wheel->buckets[i].cap = 0;
+	}
+
+	get_clock_time(&wheel->start);
+	wheel->tick = 0;
+	wheel->num_timers = 0;
+}
+
+/**
+ * @brief Convert a time to a wheel tick
+ * @param wheel timer wheel
+ * @param time time to convert
+ * @param round_up round up to the next tick (rather than down)?
+ * @return tick (0 for times before the wheel started)
+ */
+static uint64_t time_to_tick(struct timer_wheel *wheel, struct timespec *time,
+		bool round_up)
+{
+	int64_t ns = (int64_t) (time->tv_sec - wheel->start.tv_sec) * 1000000000
+		+ (time->tv_nsec - wheel->start.tv_nsec);
+
+	if (ns <= 0) {
+		return 0;
+	}
+
+	return (ns + (round_up ? WHEEL_TICK_NS - 1 : 0)) / WHEEL_TICK_NS;
+}
+
+/**
+ * @brief Schedule a message to expire
+ * @param wheel timer wheel
+ * @param seq sequence number of the message
+ * @param deadline time the message expires
+ * @details Deadlines that have already passed expire at the next tick processed
+ */
+void schedule_expiry(struct timer_wheel *wheel, uint64_t seq,
+		struct timespec *deadline)
+{
+	uint64_t tick = time_to_tick(wheel, deadline, true);
+	struct wheel_bucket *bucket;
+
+	if (tick < wheel->tick) {
+		tick = wheel->tick;
+	}
+
+	bucket = &wheel->buckets[tick & (WHEEL_SLOTS - 1)];
+	if (bucket->len == bucket->cap) {
+		bucket->cap = bucket->cap ? 2 * bucket->cap : 16;
+		bucket->timers = realloc(bucket->timers,
+				bucket->cap * sizeof(struct wheel_timer));
+		if (!bucket->timers) {
+			p_error("realloc", errno);
+			exit(errno);
+		}
+	}
+
+	bucket->timers[bucket->len++] = (struct wheel_timer) {
+		.seq = seq,
+		.tick = tick
+	};
+	wheel->num_timers++;
+}
+
+/**
+ * @brief Find when the next bucket holding timers comes round
+ * @param wheel timer wheel
+ * @param deadline set to the start of the bucket's tick
+ * @return true if any timers are scheduled, false otherwise (`deadline` is not
+ * set)
+ * @details The bucket may only hold timers for later revolutions, in which case
+ * nothing expires at `deadline`
+ */
+bool next_expiry(struct timer_wheel *wheel, struct timespec *deadline)
+{
+	uint64_t tick = wheel->tick, ns;
+
+	if (wheel->num_timers == 0) {
+		return false;
+	}
+
+	while (wheel->buckets[tick & (WHEEL_SLOTS - 1)].len == 0) {
+		tick++;
+	}
+
+	ns = tick * WHEEL_TICK_NS + wheel->start.tv_nsec;
+	deadline->tv_sec = wheel->start.tv_sec + ns / 1000000000;
+	deadline->tv_nsec = ns % 1000000000;
+
+	return true;
+}
+
+/**
+ * @brief Expire every message whose deadline has passed
+ * @param wheel timer wheel
+ * @param ring message queue
+ * @param now current time
+ * @return number of messages expired for at least one receiver
+ * @details Visits each bucket from the last tick processed up to `now` (every
+ * bucket at most once). Messages every receiver has already claimed (or that
+ * have been overwritten) are simply dropped from the wheel.
+ */
+int expire_due_msgs(struct timer_wheel *wheel, struct msg_ring *ring,
+		struct timespec *now)
+{
+	int num_expired = 0, num_receivers, kept;
+	uint64_t now_tick = time_to_tick(wheel, now, false);
+	struct wheel_bucket *bucket;
+
+	for (uint64_t tick = wheel->tick;
+			tick <= now_tick && tick < wheel->tick + WHEEL_SLOTS; tick++) {
+		bucket = &wheel->buckets[tick & (WHEEL_SLOTS - 1)];
+
+		kept = 0;
+		for (int i = 0; i < bucket->len; i++) {
+			if (bucket->timers[i].tick > now_tick) {
+				/* later revolution */
+				bucket->timers[kept++] = bucket->timers[i];
+				continue;
+			}
+
+			num_receivers = expire_msg(ring, bucket->timers[i].seq);
+			if (num_receivers > 0) {
+				pr_debug("cleanup: expired message (seq %lu) for %d receivers\n",
+						bucket->timers[i].seq, num_receivers);
+				num_expired++;
+			}
+		}
+		wheel->num_timers -= bucket->len - kept;
+		bucket->len = kept;
+	}
+
+	if (now_tick >= wheel->tick) {
+		wheel->tick = now_tick + 1;
+	}
+
+	return num_expired;
+}
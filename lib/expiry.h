@@ -0,0 +1,52 @@
+/**
+ * @file expiry.h
+ * @brief Constants, structs, and functions for message expiry
+ * @details Messages are expired by a hashed timer wheel: each message still due
+ * to some receiver gets a timer in the bucket of the tick its TTL ends in, so
+ * scheduling and expiring a message are O(1) whatever the mix of TTLs. Timers
+ * more than one revolution away stay in their bucket until their tick comes.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define WHEEL_SLOTS 4096  ///< number of wheel buckets (power of 2)
+#define WHEEL_TICK_NS 1000000  ///< wheel resolution: 1 ms per tick
+
+struct msg_ring;
+
+/**
+ * @brief Expiry timer of a message
+ */
+struct wheel_timer {
+	uint64_t seq;  ///< sequence number of the message
+	uint64_t tick;  ///< tick the message expires in
+};
+
+/**
+ * @brief Timer wheel bucket
+ */
+struct wheel_bucket {
+	struct wheel_timer *timers;  ///< array of `cap` timers, `len` in use
+	int len;
+	int cap;
+};
+
+/**
+ * @brief Timer wheel
+ * @details Only used by a single thread
+ */
+struct timer_wheel {
+	struct wheel_bucket buckets[WHEEL_SLOTS];
+	struct timespec start;  ///< start of tick 0
+	uint64_t tick;  ///< next tick to process
+	uint64_t num_timers;  ///< number of timers scheduled
+};
+
+void init_timer_wheel(struct timer_wheel *wheel);
+void schedule_expiry(struct timer_wheel *wheel, uint64_t seq,
+		struct timespec *deadline);
+bool next_expiry(struct timer_wheel *wheel, struct timespec *deadline);
+int expire_due_msgs(struct timer_wheel *wheel, struct msg_ring *ring,
+		struct timespec *now);
@@ -0,0 +1,165 @@
+/**
+ * @file fanout.c
+ * @brief Definitions of functions for zero-copy message fan-out
+ * @details Pipes hold pipe buffer pages rather than user memory, so a frame's
+ * pipe can be duplicated with `tee()` as many times as needed while the
+ * original `struct ctmp_msg` remains the fallback for the regular send path.
+ */
+
+#define _GNU_SOURCE  /* tee(), splice(), pipe2(), F_SETPIPE_SZ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "ctmp.h"
+#include "fanout.h"
+#include "socket.h"
+#include "log.h"
+
+static int null_fd = -1;  ///< `/dev/null`: target for draining worker pipes
+
+/**
+ * @brief Set up process-wide state for pipe fan-out
+ * @details `splice()` has no `MSG_NOSIGNAL` equivalent, so `SIGPIPE` is
+ * ignored (a closed receiver shows up as `EPIPE` instead). The open file limit
+ * is raised to its hard limit since every queued frame holds a pipe.
+ */
+void init_fanout(void)
+{
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+
+	null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (null_fd < 0) {
+		p_error("open", errno);
+		exit(errno);
+	}
+}
+
+/**
+ * @brief Write a frame into a new pipe
+ * @param msg message to write
+ * @return read end of the pipe on success, -1 if the frame could not be
+ * written (the regular send path should be used)
+ * @details Fails if out of file descriptors or if the pipe cannot hold the
+ * whole frame (e.g. once `/proc/sys/fs/pipe-user-pages-soft` is exceeded)
+ */
+int create_frame_pipe(struct ctmp_msg *msg)
+{
+	int frame_pipe[2];
+	size_t len = HEADER_LENGTH + msg->len;
+	ssize_t bytes_written;
+
+	if (pipe2(frame_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		pr_debug("pipe2 failed (%s): using regular send\n", strerror(errno));
+		return -1;
+	}
+
+	/* default capacity (64 KiB) is too small for the largest frames */
+	if (len > (size_t) fcntl(frame_pipe[1], F_GETPIPE_SZ)) {
+		fcntl(frame_pipe[1], F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+	}
+
+	bytes_written = write(frame_pipe[1], msg->header, len);
+	close(frame_pipe[1]);
+
+	if (bytes_written != (ssize_t) len) {
+		pr_debug("frame pipe too small: using regular send\n");
+		close(frame_pipe[0]);
+		return -1;
+	}
+
+	return frame_pipe[0];
+}
+
+/**
+ * @brief Create the pipe a worker uses to move frames to its receiver
+ * @param worker_pipe output pipe file descriptors
+ * @return true on success, false on failure
+ */
+bool init_worker_pipe(int worker_pipe[2])
+{
+	if (pipe2(worker_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		p_error("pipe2", errno);
+		worker_pipe[0] = worker_pipe[1] = -1;
+		return false;
+	}
+	fcntl(worker_pipe[1], F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+
+	return true;
+}
+
+/**
+ * @brief Discard data left in a worker pipe
+ * @param worker_pipe worker pipe file descriptors
+ * @param len number of bytes to discard
+ */
+void drain_worker_pipe(int worker_pipe[2], size_t len)
+{
+	ssize_t res;
+
+	while (len > 0) {
+		res = splice(worker_pipe[0], NULL, null_fd, NULL, len, 0);
+		if (res <= 0 && errno != EINTR) {
+			break;
+		}
+		len -= (res > 0) ? res : 0;
+	}
+}
+
+/**
+ * @brief Send a CTMP message by splicing its frame pipe to a receiver
+ * @param receiver_fd file descriptor of receiver
+ * @param frame_pipe pipe holding the frame (from `create_frame_pipe()`)
+ * @param worker_pipe (empty) pipe of the sending worker
+ * @param msg message being sent (used for the fallback path)
+ * @return number of bytes sent (negative on error)
+ * @details If the frame cannot be duplicated whole or the receiver's socket
+ * does not accept the whole splice, whatever is left in the worker pipe is
+ * discarded and the rest of the frame is sent from `msg` with `send()`.
+ */
+ssize_t splice_ctmp_msg(int receiver_fd, int frame_pipe, int worker_pipe[2],
+		struct ctmp_msg *msg)
+{
+	size_t len = HEADER_LENGTH + msg->len;
+	ssize_t duplicated, res;
+	size_t spliced = 0;
+
+	/* duplicate the frame without consuming it */
+	do {
+		duplicated = tee(frame_pipe, worker_pipe[1], len, SPLICE_F_NONBLOCK);
+	} while (duplicated < 0 && errno == EINTR);
+
+	if (duplicated < (ssize_t) len) {
+		if (duplicated > 0) {
+			drain_worker_pipe(worker_pipe, duplicated);
+		}
+		return send_ctmp_msg(receiver_fd, msg);
+	}
+
+	/* move the duplicate to the receiver's socket */
+	while (spliced < len) {
+		res = splice(worker_pipe[0], NULL, receiver_fd, NULL,
+				len - spliced, SPLICE_F_MOVE);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		} else if (res < 0 && errno != EAGAIN) {
+			/* connection closed */
+			drain_worker_pipe(worker_pipe, len - spliced);
+			return -errno;
+		} else if (res <= 0) {
+			break;
+		}
+		spliced += res;
+	}
+
+	if (spliced < len) {
+		/* fall back to sending the rest from user space */
+		drain_worker_pipe(worker_pipe, len - spliced);
+		return send_msg(receiver_fd, &msg->header[spliced], len - spliced);
+	}
+
+	return 0;
+}
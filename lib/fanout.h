@@ -0,0 +1,21 @@
+/**
+ * @file fanout.h
+ * @brief Functions for zero-copy message fan-out with pipes and `tee()`/`splice()`
+ * @details Each frame is written once into its own pipe at ingest. Workers
+ * duplicate it into their own pipe with `tee()` and move it to their receiver's
+ * socket with `splice()`, so the frame is never copied back through user space
+ * per receiver.
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define FANOUT_PIPE_SIZE (128 * 1024)  ///< pipe capacity: fits a maximum-length frame
+
+struct ctmp_msg;
+
+void init_fanout(void);
+int create_frame_pipe(struct ctmp_msg *msg);
+bool init_worker_pipe(int worker_pipe[2]);
+ssize_t splice_ctmp_msg(int receiver_fd, int frame_pipe, int worker_pipe[2],
+		struct ctmp_msg *msg);
@@ -0,0 +1,242 @@
+/**
+ * @file lag.c
+ * @brief Definitions of functions for the slow-consumer policy
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "msg_queue.h"
+#include "channel.h"
+#include "lag.h"
+#include "timestamp.h"
+#include "log.h"
+
+struct lag_limits lag_limits;  ///< limits for every receiver
+struct lag_stats lag_stats;  ///< actions taken for all receivers
+#ifndef DEBUG
+static _Atomic int64_t next_log_ns;  ///< earliest time the next lag action may be logged
+#endif
+static _Atomic uint64_t unlogged;  ///< lag actions not logged since the last one that was
+
+/**
+ * @brief Lag policy names (indexed by `enum lag_policy`)
+ */
+static const char *lag_policy_names[] = {
+	[LAG_DISCONNECT] = "disconnect",
+	[LAG_SKIP] = "skip",
+	[LAG_EXPIRE] = "expire"
+};
+
+/**
+ * @brief Look up a lag policy by name
+ * @param name policy name
+ * @return `enum lag_policy` value, -1 if the name is not recognised
+ */
+int parse_lag_policy(const char *name)
+{
+	for (int i = 0; i < (int) (sizeof(lag_policy_names) / sizeof(char *)); i++) {
+		if (strcmp(name, lag_policy_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Set the lag limits for every receiver
+ * @param max_msgs maximum number of messages behind the tail (0 = no limit)
+ * @param max_bytes maximum number of bytes behind the tail (0 = no limit)
+ * @param max_age maximum age in milliseconds of the oldest message not yet
+ * visited (0 = no limit)
+ * @param policy `enum lag_policy` value
+ */
+void init_lag_limits(int max_msgs, int max_bytes, int max_age, int policy)
+{
+	lag_limits.max_msgs = max_msgs;
+	lag_limits.max_bytes = max_bytes;
+	lag_limits.max_age = max_age;
+	lag_limits.policy = policy;
+}
+
+/**
+ * @brief Check whether any lag limit is set
+ * @return true if at least one limit is set, false otherwise
+ */
+bool lag_limited(void)
+{
+	return (lag_limits.max_msgs || lag_limits.max_bytes || lag_limits.max_age);
+}
+
+/**
+ * @brief Check whether a lag action should be logged
+ * @param num_unlogged set to the number of actions not logged since the last
+ * one that was
+ * @return true if the action should be logged, false otherwise
+ * @details At most one action is logged per `LAG_LOG_INTERVAL_MS` (so a burst
+ * of slow receivers does not hold up the workers with output), every one with
+ * `DEBUG`. Every action is counted in `lag_stats` either way.
+ */
+static bool lag_log_due(uint64_t *num_unlogged)
+{
+#ifndef DEBUG
+	struct timespec now;
+	int64_t next = atomic_load_explicit(&next_log_ns, memory_order_relaxed);
+
+	get_clock_time(&now);
+	if (time_to_ns(&now) < next || !atomic_compare_exchange_strong(
+				&next_log_ns, &next, time_to_ns(&now)
+				+ (int64_t) LAG_LOG_INTERVAL_MS * 1000000)) {
+		atomic_fetch_add_explicit(&unlogged, 1, memory_order_relaxed);
+		return false;
+	}
+#endif
+	*num_unlogged = atomic_exchange(&unlogged, 0);
+	return true;
+}
+
+/**
+ * @brief Check whether a receiver at a given position is within the lag limits
+ * @param ring message queue
+ * @param sub receiver's subscription
+ * @param seq sequence number of the next message the receiver is to visit
+ * @param tail tail sequence number (greater than `seq`)
+ * @param now current time (only used with an age limit)
+ * @return true if within every limit, false otherwise (or if the message has
+ * been overwritten)
+ * @details Only messages the receiver is due count towards its lag: a
+ * subscriber's lag is measured on its channels. Lag only decreases as `seq`
+ * increases.
+ */
+static bool within_lag_limits(struct msg_ring *ring, struct subscription *sub,
+		uint64_t seq, uint64_t tail, struct timespec *now)
+{
+	struct timespec timestamp;
+	uint64_t msgs = tail - seq, bytes = 0, offset;
+
+	if (sub->num_channels > 0) {
+		seq = channel_lag(sub, seq, &msgs, &bytes);
+		if (seq >= tail) {
+			/* nothing due that has entered the queue */
+			return true;
+		}
+	}
+
+	if (lag_limits.max_msgs && msgs > lag_limits.max_msgs) {
+		return false;
+	}
+	if (!lag_limits.max_bytes && !lag_limits.max_age) {
+		return true;
+	}
+
+	if (!peek_msg(ring, seq, &timestamp, &offset)) {
+		return false;
+	}
+	if (sub->num_channels == 0) {
+		bytes = atomic_load(&ring->tail_offset) - offset;
+	}
+	if (lag_limits.max_bytes && bytes > lag_limits.max_bytes) {
+		return false;
+	}
+	if (lag_limits.max_age) {
+		add_time_ms(&timestamp, lag_limits.max_age);
+		if (compare_times(&timestamp, now)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief Apply the lag policy to a receiver if it exceeds a lag limit
+ * @param ring message queue
+ * @param sub receiver's subscription
+ * @param cursor sequence number of the next message the receiver is to visit,
+ * updated if the receiver skips messages
+ * @param fd receiver socket file descriptor (for logging)
+ * @return 0 if the receiver may carry on, `-ECONNABORTED` if it should be
+ * disconnected
+ * @details Skipped messages are dropped as they would be had the receiver
+ * disconnected, so they can be freed. Messages the receiver has already claimed
+ * are unaffected. With the expire policy, the messages dropped are those that
+ * put the receiver over the limits: every message older than the age limit,
+ * and the oldest messages beyond the message and byte limits. They are
+ * expired for this receiver only.
+ */
+int enforce_lag_limits(struct msg_ring *ring, struct subscription *sub,
+		uint64_t *cursor, int fd)
+{
+	uint64_t tail = ring_tail(ring), seq, mid, end, num_unlogged;
+	struct timespec now = { 0 };
+
+	if (!lag_limited() || *cursor >= tail) {
+		return 0;
+	}
+	if (lag_limits.max_age) {
+		get_clock_time(&now);
+	}
+	if (within_lag_limits(ring, sub, *cursor, tail, &now)) {
+		return 0;
+	}
+
+	switch (lag_limits.policy) {
+	case LAG_DISCONNECT:
+		atomic_fetch_add(&lag_stats.disconnected, 1);
+		if (lag_log_due(&num_unlogged)) {
+			pr_info("dst connection %d: over the lag limits, disconnecting (%lu actions unlogged)\n",
+					fd, num_unlogged);
+		}
+		return -ECONNABORTED;
+	case LAG_SKIP:
+		seq = tail;
+		break;
+	default:
+		/* binary search for the oldest message within the limits */
+		seq = *cursor + 1;
+		end = tail;
+		while (seq < end) {
+			mid = seq + (end - seq) / 2;
+			if (within_lag_limits(ring, sub, mid, tail, &now)) {
+				end = mid;
+			} else {
+				seq = mid + 1;
+			}
+		}
+		break;
+	}
+
+	drop_due_msgs(ring, sub, *cursor, seq);
+	if (lag_limits.policy == LAG_SKIP) {
+		atomic_fetch_add(&lag_stats.skipped, 1);
+		atomic_fetch_add(&lag_stats.skipped_msgs, seq - *cursor);
+	} else {
+		atomic_fetch_add(&lag_stats.expired, 1);
+		atomic_fetch_add(&lag_stats.expired_msgs, seq - *cursor);
+	}
+	if (lag_log_due(&num_unlogged)) {
+		pr_info("dst connection %d: lagging, %s %lu messages (%lu actions unlogged)\n",
+				fd, (lag_limits.policy == LAG_SKIP) ? "skipped"
+				: "expired", seq - *cursor, num_unlogged);
+	}
+	*cursor = seq;
+
+	return 0;
+}
+
+/**
+ * @brief Record the disconnection of a receiver whose socket has not accepted
+ * any data for longer than the age limit
+ * @param fd receiver socket file descriptor (for logging)
+ */
+void report_stalled_receiver(int fd)
+{
+	uint64_t num_unlogged;
+
+	atomic_fetch_add(&lag_stats.stalled, 1);
+	if (lag_log_due(&num_unlogged)) {
+		pr_info("dst connection %d: stalled for %d ms, disconnecting (%lu actions unlogged)\n",
+				fd, lag_limits.max_age, num_unlogged);
+	}
+}
@@ -0,0 +1,59 @@
+/**
+ * @file lag.h
+ * @brief Constants, structs, and functions for the slow-consumer policy
+ * @details A receiver's lag is measured from its cursor to the tail of the
+ * message queue: in messages, in bytes, and as the age of the oldest message it
+ * has yet to visit. Only messages it is due count, so a subscriber's lag is
+ * measured on its channels alone. A receiver that exceeds any of the configured limits is
+ * dealt with according to the lag policy.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define LAG_LOG_INTERVAL_MS 1000  ///< minimum interval between logged lag actions (all are logged with `DEBUG`)
+
+struct msg_ring;
+struct subscription;
+
+/**
+ * @brief Action taken for a receiver that exceeds a lag limit
+ */
+enum lag_policy {
+	LAG_DISCONNECT,  ///< close the connection
+	LAG_SKIP,  ///< skip every message the receiver has yet to visit
+	LAG_EXPIRE  ///< treat the messages that put it over the limits as expired for it
+};
+
+/**
+ * @brief Per-receiver lag limits (0 = no limit)
+ */
+struct lag_limits {
+	uint64_t max_msgs;  ///< maximum number of messages behind the tail
+	uint64_t max_bytes;  ///< maximum number of bytes behind the tail
+	int max_age;  ///< maximum age (milliseconds) of the oldest message not yet visited
+	enum lag_policy policy;
+};
+
+/**
+ * @brief Slow-consumer actions taken for all receivers
+ */
+struct lag_stats {
+	_Atomic uint64_t disconnected;  ///< receivers disconnected for exceeding a limit
+	_Atomic uint64_t stalled;  ///< receivers disconnected for accepting no data
+	_Atomic uint64_t skipped;  ///< times a receiver skipped messages (skip policy)
+	_Atomic uint64_t skipped_msgs;  ///< messages skipped in total (skip policy)
+	_Atomic uint64_t expired;  ///< times messages expired for a receiver (expire policy)
+	_Atomic uint64_t expired_msgs;  ///< messages expired for a receiver in total (expire policy)
+};
+
+extern struct lag_limits lag_limits;
+extern struct lag_stats lag_stats;
+
+int parse_lag_policy(const char *name);
+void init_lag_limits(int max_msgs, int max_bytes, int max_age, int policy);
+bool lag_limited(void);
+int enforce_lag_limits(struct msg_ring *ring, struct subscription *sub,
+		uint64_t *cursor, int fd);
+void report_stalled_receiver(int fd);
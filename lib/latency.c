@@ -0,0 +1,359 @@
+/**
+ * @file latency.c
+ * @brief Definitions of functions for message latency tracking
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "latency.h"
+#include "log.h"
+
+enum latency_clock latency_clock = LATENCY_OFF;  ///< clock messages are timestamped with
+
+static double ticks_per_ns = 1.0;  ///< latency clock frequency (GHz)
+static pthread_mutex_t recorders_lock = PTHREAD_MUTEX_INITIALIZER;  ///< protects `recorders`
+static struct latency_recorder_list recorders = LIST_HEAD_INITIALIZER(recorders);  ///< histograms of every thread that has recorded a latency
+static _Thread_local struct latency_recorder *recorder = NULL;  ///< histograms of the calling thread
+
+static const char *clock_names[] = {
+	[LATENCY_OFF] = "off",
+	[LATENCY_TSC] = "tsc",
+	[LATENCY_COARSE] = "coarse"
+};
+
+static const char *stage_names[NUM_STAGES] = {
+	[STAGE_ENQUEUE] = "enqueue",
+	[STAGE_QUEUE] = "queue",
+	[STAGE_SEND] = "send",
+	[STAGE_TOTAL] = "total"
+};
+
+/**
+ * @brief Read a clock in nanoseconds
+ * @param clock_id clock to read
+ * @return time in nanoseconds
+ */
+static uint64_t clock_ns(clockid_t clock_id)
+{
+	struct timespec now;
+
+	clock_gettime(clock_id, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Read the latency clock
+ * @return current tick (only meaningful relative to other ticks)
+ */
+uint64_t read_latency_tick(void)
+{
+	if (latency_clock == LATENCY_COARSE) {
+		return clock_ns(CLOCK_MONOTONIC_COARSE);
+	}
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return clock_ns(CLOCK_MONOTONIC);
+#endif
+}
+
+/**
+ * @brief Look up a latency clock by name
+ * @param name clock name (`off`, `tsc` or `coarse`)
+ * @return `enum latency_clock` value, -1 if the name is not recognised
+ */
+int parse_latency_clock(const char *name)
+{
+	for (int i = 0; i < (int) (sizeof(clock_names) / sizeof(clock_names[0])); i++) {
+		if (strcmp(name, clock_names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+#ifdef HAVE_TSC
+/**
+ * @brief Measure the TSC frequency
+ * @details Against `CLOCK_MONOTONIC` over `TSC_CALIBRATION_MS` (assumes an
+ * invariant TSC, as on any recent x86 CPU)
+ */
+static void calibrate_tsc(void)
+{
+	uint64_t start_ns, start_tick;
+	struct timespec calibration = {
+		.tv_sec = 0,
+		.tv_nsec = TSC_CALIBRATION_MS * 1000000L
+	};
+
+	start_ns = clock_ns(CLOCK_MONOTONIC);
+	start_tick = __rdtsc();
+	nanosleep(&calibration, NULL);
+	ticks_per_ns = (double) (__rdtsc() - start_tick)
+		/ (clock_ns(CLOCK_MONOTONIC) - start_ns);
+	pr_debug("TSC frequency: %.3f GHz\n", ticks_per_ns);
+}
+#endif
+
+/**
+ * @brief Set up latency tracking
+ * @param clock clock to timestamp messages with (`enum latency_clock`)
+ */
+void init_latency(int clock)
+{
+	latency_clock = clock;
+	if (clock != LATENCY_TSC) {
+		return;
+	}
+
+#ifdef HAVE_TSC
+	calibrate_tsc();
+#else
+	pr_info("no TSC: timestamping messages with CLOCK_MONOTONIC\n");
+#endif
+}
+
+/**
+ * @brief Set up the histograms of the calling thread
+ * @return histograms (listed for snapshots)
+ */
+static struct latency_recorder *new_recorder(void)
+{
+	struct latency_recorder *new;
+
+	new = aligned_alloc(64, sizeof(struct latency_recorder));
+	if (!new) {
+		p_error("aligned_alloc", errno);
+		exit(errno);
+	}
+	memset(new, 0, sizeof(struct latency_recorder));
+
+	pthread_mutex_lock(&recorders_lock);
+	LIST_INSERT_HEAD(&recorders, new, entries);
+	pthread_mutex_unlock(&recorders_lock);
+
+	return new;
+}
+
+/**
+ * @brief Find the histogram bucket of a value
+ * @param value value in ticks
+ * @return bucket index
+ */
+static inline int bucket_index(uint64_t value)
+{
+	int exp;
+
+	if (value < LATENCY_SUB_BUCKETS) {
+		return value;
+	}
+
+	exp = 63 - __builtin_clzll(value);
+	if (exp > LATENCY_MAX_EXP) {
+		return LATENCY_BUCKETS - 1;
+	}
+	return (exp - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS
+		+ ((value >> (exp - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief Find the largest value a histogram bucket holds
+ * @param index bucket index
+ * @return value in ticks
+ */
+static uint64_t bucket_max(int index)
+{
+	int group = index / LATENCY_SUB_BUCKETS;
+	uint64_t sub = index % LATENCY_SUB_BUCKETS;
+
+	if (group == 0) {
+		return sub;
+	}
+	return ((LATENCY_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+/**
+ * @brief Add a value to a histogram
+ * @param hist histogram, only ever written by the calling thread
+ * @param value value in ticks
+ */
+void add_latency(struct latency_hist *hist, uint64_t value)
+{
+	_Atomic uint64_t *count = &hist->counts[bucket_index(value)];
+
+	/* single writer: no read-modify-write needed */
+	atomic_store_explicit(count,
+			atomic_load_explicit(count, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+	if (value > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+		atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Record the latency of a stage of the message path
+ * @param stage stage
+ * @param start tick the stage started at (0 if not tracked)
+ * @param end tick the stage ended at
+ * @details Into the calling thread's histograms (set up on first use).
+ * Stages with no start tick (e.g. messages that entered the queue before
+ * latency tracking was enabled) are skipped.
+ */
+void record_latency(enum latency_stage stage, uint64_t start, uint64_t end)
+{
+	if (start == 0) {
+		return;
+	}
+
+	if (!recorder) {
+		recorder = new_recorder();
+	}
+	add_latency(&recorder->hists[stage], (end > start) ? end - start : 0);
+}
+
+/**
+ * @brief Record the latencies of a message sent to a receiver
+ * @param parse_tick tick the message was parsed at
+ * @param pickup_tick tick the message was picked up for the receiver at
+ * @param done_tick tick the message was sent to the receiver in full at
+ */
+void record_send_latency(uint64_t parse_tick, uint64_t pickup_tick,
+		uint64_t done_tick)
+{
+	record_latency(STAGE_SEND, pickup_tick, done_tick);
+	record_latency(STAGE_TOTAL, parse_tick, done_tick);
+}
+
+/**
+ * @brief Add a histogram to another
+ * @param total histogram to add to (not shared with other threads)
+ * @param hist histogram to add (may still be written by its own thread)
+ */
+void merge_latency_hist(struct latency_hist *total, struct latency_hist *hist)
+{
+	uint64_t max;
+
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		total->counts[i] += atomic_load_explicit(&hist->counts[i],
+				memory_order_relaxed);
+	}
+	max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+	if (max > total->max) {
+		total->max = max;
+	}
+}
+
+/**
+ * @brief Add up every thread's histogram of a stage
+ * @param stage stage
+ * @param total histogram to set to the sum
+ * @details Caller must hold `recorders_lock`
+ */
+static void sum_hists(enum latency_stage stage, struct latency_hist *total)
+{
+	struct latency_recorder *rec;
+
+	memset(total, 0, sizeof(struct latency_hist));
+	LIST_FOREACH(rec, &recorders, entries) {
+		merge_latency_hist(total, &rec->hists[stage]);
+	}
+}
+
+/**
+ * @brief Find a percentile of a histogram
+ * @param hist histogram
+ * @param num_values number of values recorded in the histogram
+ * @param percentile percentile (0-100)
+ * @return upper bound of the bucket the percentile falls in (in ticks, at
+ * most the largest value recorded)
+ */
+static uint64_t hist_percentile(struct latency_hist *hist, uint64_t num_values,
+		double percentile)
+{
+	uint64_t rank = (uint64_t) (num_values * percentile / 100.0 + 0.5);
+	uint64_t seen = 0, value;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank) {
+			value = bucket_max(i);
+			return (value < hist->max) ? value : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+/**
+ * @brief Write the percentiles of a histogram as a JSON object
+ * @param out stream to write to
+ * @param hist histogram (not shared with other threads)
+ * @param ns_per_tick nanoseconds per tick of the values in the histogram
+ * @details Number of values, then p50, p99, p99.9 and maximum in nanoseconds
+ * (if there are any values)
+ */
+void write_latency_hist(FILE *out, struct latency_hist *hist,
+		double ns_per_tick)
+{
+	uint64_t num_values = 0;
+
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		num_values += hist->counts[i];
+	}
+
+	fprintf(out, "{\"count\": %lu", num_values);
+	if (num_values > 0) {
+		fprintf(out, ", \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p99.9_ns\": %.0f, \"max_ns\": %.0f",
+				hist_percentile(hist, num_values, 50) * ns_per_tick,
+				hist_percentile(hist, num_values, 99) * ns_per_tick,
+				hist_percentile(hist, num_values, 99.9) * ns_per_tick,
+				hist->max * ns_per_tick);
+	}
+	fprintf(out, "}");
+}
+
+/**
+ * @brief Write latency percentiles as a JSON object
+ * @param out stream to write to
+ * @details p50, p99, p99.9 and maximum of each stage, in nanoseconds
+ */
+void write_latency_stats(FILE *out)
+{
+	struct latency_hist *total;
+
+	fprintf(out, "{\"clock\": \"%s\"", clock_names[latency_clock]);
+	if (!latency_enabled()) {
+		fprintf(out, "}");
+		return;
+	}
+
+	total = malloc(sizeof(struct latency_hist));
+	if (!total) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+
+	pthread_mutex_lock(&recorders_lock);
+	for (int stage = 0; stage < NUM_STAGES; stage++) {
+		sum_hists(stage, total);
+		fprintf(out, ",\n    \"%s\": ", stage_names[stage]);
+		write_latency_hist(out, total, 1 / ticks_per_ns);
+	}
+	pthread_mutex_unlock(&recorders_lock);
+
+	fprintf(out, "\n  }");
+	free(total);
+}
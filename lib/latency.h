@@ -0,0 +1,95 @@
+/**
+ * @file latency.h
+ * @brief Constants, structs, and functions for message latency tracking
+ * @details Each message is timestamped when it has been parsed and when it
+ * enters the queue, and again when a worker picks it up for a receiver and
+ * when it has been sent to that receiver in full. Timestamps are ticks of a
+ * cheap clock: the TSC, or `CLOCK_MONOTONIC_COARSE`. The time between them is
+ * recorded in log-linear (HDR-style) histograms: `LATENCY_SUB_BUCKETS` linear
+ * buckets per power of two, so every value is recorded to within about 3%.
+ * Every thread records into histograms of its own (only ever written by that
+ * thread, with no lock and no atomic read-modify-write), which are added up
+ * when a snapshot is taken.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/queue.h>
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)  ///< linear buckets per power of two
+#define LATENCY_MAX_EXP 40  ///< values of 2^(LATENCY_MAX_EXP + 1) ticks or more go in the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) * LATENCY_SUB_BUCKETS)  ///< buckets per histogram
+#define TSC_CALIBRATION_MS 20  ///< how long to measure the TSC frequency for
+
+/**
+ * @brief Clock to timestamp messages with
+ */
+enum latency_clock {
+	LATENCY_OFF,  ///< latency tracking disabled
+	LATENCY_TSC,  ///< time stamp counter (`CLOCK_MONOTONIC` if there is none)
+	LATENCY_COARSE  ///< `CLOCK_MONOTONIC_COARSE` (resolution of a scheduler tick)
+};
+
+/**
+ * @brief Stretch of the message path a histogram covers
+ */
+enum latency_stage {
+	STAGE_ENQUEUE,  ///< parsed to entering the queue
+	STAGE_QUEUE,  ///< entering the queue to picked up for a receiver
+	STAGE_SEND,  ///< picked up to sent to the receiver in full
+	STAGE_TOTAL,  ///< parsed to sent to the receiver in full
+	NUM_STAGES
+};
+
+/**
+ * @brief Histogram of latencies (in ticks)
+ */
+struct latency_hist {
+	_Atomic uint64_t counts[LATENCY_BUCKETS];
+	_Atomic uint64_t max;  ///< largest value recorded
+};
+
+/**
+ * @brief Histograms of a single thread
+ */
+struct latency_recorder {
+	struct latency_hist hists[NUM_STAGES];
+	LIST_ENTRY(latency_recorder) entries;  ///< next pointer for recorder list
+} __attribute__((aligned(64)));
+LIST_HEAD(latency_recorder_list, latency_recorder);
+
+extern enum latency_clock latency_clock;
+
+uint64_t read_latency_tick(void);
+
+/**
+ * @brief Check whether latency tracking is enabled
+ * @return true if messages are timestamped
+ */
+static inline bool latency_enabled(void)
+{
+	return latency_clock != LATENCY_OFF;
+}
+
+/**
+ * @brief Read the latency clock, if enabled
+ * @return current tick, 0 if latency tracking is disabled
+ */
+static inline uint64_t latency_tick(void)
+{
+	return latency_enabled() ? read_latency_tick() : 0;
+}
+
+int parse_latency_clock(const char *name);
+void init_latency(int clock);
+void add_latency(struct latency_hist *hist, uint64_t value);
+void merge_latency_hist(struct latency_hist *total, struct latency_hist *hist);
+void write_latency_hist(FILE *out, struct latency_hist *hist,
+		double ns_per_tick);
+void record_latency(enum latency_stage stage, uint64_t start, uint64_t end);
+void record_send_latency(uint64_t parse_tick, uint64_t pickup_tick,
+		uint64_t done_tick);
+void write_latency_stats(FILE *out);
@@ -59,6 +59,22 @@ void pr_err(char *fmt, ...)
 	va_end(args);
 }
 
+/**
+ * @brief Print informational message to stdout
+ * @param fmt format string
+ * @param ... format arguments
+ */
+void pr_info(char *fmt, ...)
+{
+	va_list args;
+	char msg[MAX_LOG_MSG];
+
+	va_start(args, fmt);
+	format_msg(msg, fmt, args);
+	printf("%s", msg);
+	va_end(args);
+}
+
 /**
  * @brief Print debug message
  * @details Only runs when compiled with `-DDEBUG`
@@ -28,4 +28,5 @@ void format_time(char *time_str);
 void format_msg(char *msg, char *fmt, va_list args);
 
 void pr_err(char *fmt, ...);
+void pr_info(char *fmt, ...);
 void pr_debug(char *fmt, ...);
@@ -0,0 +1,759 @@
+/**
+ * @file msg_log.c
+ * @brief Definitions of functions for the on-disk message log
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "ctmp.h"
+#include "msg_queue.h"
+#include "msg_log.h"
+#include "log.h"
+
+_Static_assert(sizeof(struct log_header) % LOG_ALIGN == 0,
+		"log records should start aligned");
+_Static_assert(sizeof(struct log_record) % LOG_ALIGN == 0,
+		"log frames should start aligned");
+
+/**
+ * @brief Get the length of a record
+ * @param frame_len length of the record's frame
+ * @return record length (header and padding included)
+ */
+static inline size_t record_len(uint32_t frame_len)
+{
+	return (sizeof(struct log_record) + frame_len + LOG_ALIGN - 1)
+		& ~((size_t) LOG_ALIGN - 1);
+}
+
+/**
+ * @brief Get the record at a given offset of a segment
+ * @param segment segment
+ * @param offset offset of the record
+ * @return record
+ */
+static inline struct log_record *record_at(struct log_segment *segment,
+		size_t offset)
+{
+	return (struct log_record *) (segment->map + offset);
+}
+
+/**
+ * @brief Get the current wall-clock time
+ * @return nanoseconds since the epoch
+ */
+static int64_t realtime_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief Account for a record appended to (or recovered from) a segment
+ * @param segment segment
+ * @param offset offset of the record
+ * @param record record
+ * @details Indexes every `LOG_INDEX_INTERVAL`th record
+ */
+static void add_record(struct log_segment *segment, size_t offset,
+		struct log_record *record)
+{
+	uint64_t num_index = atomic_load_explicit(&segment->num_index,
+			memory_order_relaxed);
+
+	if (segment->num_records % LOG_INDEX_INTERVAL == 0
+			&& num_index < segment->max_index) {
+		segment->index[num_index] = (struct log_index) {
+			.seq = record->seq,
+			.offset = offset,
+			.time_ns = record->time_ns
+		};
+		atomic_store_explicit(&segment->num_index, num_index + 1,
+				memory_order_release);
+	}
+	segment->num_records++;
+	atomic_store_explicit(&segment->last_time_ns, record->time_ns,
+			memory_order_relaxed);
+}
+
+/**
+ * @brief Recover the records of an existing segment
+ * @param segment segment (mapped)
+ * @details Stops at the end marker, or at the first record that is out of
+ * sequence or runs past the end of the file (torn by a crash)
+ */
+static void scan_segment(struct log_segment *segment)
+{
+	size_t offset = sizeof(struct log_header), len;
+	uint64_t seq = segment->first_seq;
+	struct log_record *record;
+
+	while (offset + sizeof(struct log_record) <= segment->size) {
+		record = record_at(segment, offset);
+		len = record_len(record->frame_len);
+		if (record->frame_len < HEADER_LENGTH || record->seq != seq
+				|| offset + len > segment->size) {
+			break;
+		}
+		add_record(segment, offset, record);
+		offset += len;
+		seq++;
+	}
+
+	/* mark the end for the next append */
+	if (offset + sizeof(struct log_record) <= segment->size) {
+		memset(record_at(segment, offset), 0, sizeof(struct log_record));
+	}
+	atomic_store(&segment->used, offset);
+	atomic_store(&segment->next_seq, seq);
+}
+
+/**
+ * @brief Map a segment file
+ * @param path path of the file
+ * @param size size of a new file (ignored for existing files)
+ * @param first_seq sequence number of the first record of a new file, or
+ * `UINT64_MAX` to open an existing file
+ * @return segment (with a single reference), NULL on error
+ * @details Every block of a new file is allocated before it is mapped. A new
+ * file that cannot be allocated (e.g. the disk is full) is deleted again.
+ */
+static struct log_segment *map_segment(const char *path, size_t size,
+		uint64_t first_seq)
+{
+	bool create = (first_seq != UINT64_MAX);
+	int res;
+	struct log_segment *segment;
+	struct log_header *header;
+	struct stat st;
+
+	segment = calloc(1, sizeof(struct log_segment));
+	if (!segment) {
+		p_error("calloc", errno);
+		exit(errno);
+	}
+	snprintf(segment->path, sizeof(segment->path), "%s", path);
+
+	segment->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),
+			0644);
+	if (segment->fd < 0) {
+		p_error("open", errno);
+		free(segment);
+		return NULL;
+	}
+
+	if (create) {
+		/* allocate every block up front: writing to a hole of a sparse
+		 * file through the mapping raises SIGBUS when the disk is full */
+		if ((res = posix_fallocate(segment->fd, 0, size)) != 0) {
+			p_error("posix_fallocate", res);
+			goto fail;
+		}
+	} else {
+		if (fstat(segment->fd, &st) < 0) {
+			p_error("fstat", errno);
+			goto fail;
+		}
+		size = st.st_size;
+		if (size < sizeof(struct log_header)) {
+			pr_err("log: %s is not a segment file\n", path);
+			goto fail;
+		}
+	}
+	segment->size = size;
+
+	segment->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			segment->fd, 0);
+	if (segment->map == MAP_FAILED) {
+		p_error("mmap", errno);
+		goto fail;
+	}
+
+	/* smallest record: header only */
+	segment->max_index = size / (sizeof(struct log_record) + HEADER_LENGTH)
+		/ LOG_INDEX_INTERVAL + 1;
+	segment->index = malloc(segment->max_index * sizeof(struct log_index));
+	if (!segment->index) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	atomic_init(&segment->num_index, 0);
+	atomic_init(&segment->last_time_ns, 0);
+	atomic_init(&segment->refs, 1);
+
+	header = (struct log_header *) segment->map;
+	if (create) {
+		memcpy(header->magic, LOG_MAGIC, sizeof(header->magic));
+		header->first_seq = first_seq;
+		segment->first_seq = first_seq;
+		atomic_init(&segment->used, sizeof(struct log_header));
+		atomic_init(&segment->next_seq, first_seq);
+	} else {
+		if (memcmp(header->magic, LOG_MAGIC, sizeof(header->magic)) != 0) {
+			pr_err("log: %s is not a segment file\n", path);
+			munmap(segment->map, size);
+			free(segment->index);
+			goto fail;
+		}
+		segment->first_seq = header->first_seq;
+		scan_segment(segment);
+	}
+
+	return segment;
+
+fail:
+	if (create && unlink(path) < 0) {
+		p_error("unlink", errno);
+	}
+	close(segment->fd);
+	free(segment);
+	return NULL;
+}
+
+/**
+ * @brief Release a reference to a segment
+ * @param segment segment to release
+ * @details Unmaps the segment when the last reference is released
+ */
+static void put_segment(struct log_segment *segment)
+{
+	if (atomic_fetch_sub(&segment->refs, 1) == 1) {
+		munmap(segment->map, segment->size);
+		close(segment->fd);
+		free(segment->index);
+		free(segment);
+	}
+}
+
+/**
+ * @brief Start a new active segment
+ * @param log message log
+ * @param first_seq sequence number of its first record
+ * @return true on success, false on error (no segment is active)
+ * @details Deletes segments beyond the retention limits. The previous active
+ * segment is written back by `sync_msg_log()`, off the append path.
+ */
+static bool roll_segment(struct msg_log *log, uint64_t first_seq)
+{
+	char path[PATH_MAX];
+	struct log_segment *segment;
+
+	snprintf(path, sizeof(path), "%s/%020lu.seg", log->dir, first_seq);
+	segment = map_segment(path, log->segment_size, first_seq);
+
+	pthread_mutex_lock(&log->lock);
+	log->active = segment;
+	if (segment) {
+		TAILQ_INSERT_TAIL(&log->segments, segment, entries);
+		log->total_bytes += segment->size;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	if (!segment) {
+		pr_err("log: error creating segment %s\n", path);
+		return false;
+	}
+
+	pr_debug("log: new segment %s\n", path);
+	trim_msg_log(log);
+	return true;
+}
+
+/**
+ * @brief Open the message log, recovering any existing segments
+ * @param dir log directory (created if it does not exist)
+ * @param segment_size size of each segment file
+ * @param max_age delete segments whose last record is older than this many
+ * seconds (0 = no limit)
+ * @param max_bytes delete the oldest segments beyond this total size (0 = no
+ * limit)
+ * @return message log (exits on failure)
+ * @details Appends continue in the newest existing segment, from the sequence
+ * number after its last record
+ */
+struct msg_log *open_msg_log(const char *dir, size_t segment_size, int max_age,
+		uint64_t max_bytes)
+{
+	int num_files;
+	char path[PATH_MAX];
+	struct dirent **files;
+	struct msg_log *log;
+	struct log_segment *segment;
+	uint64_t next_seq = 0;
+
+	log = malloc(sizeof(struct msg_log));
+	if (!log) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	log->dir = dir;
+	log->segment_size = segment_size;
+	log->max_age = max_age;
+	log->max_bytes = max_bytes;
+	log->total_bytes = 0;
+	log->active = NULL;
+	pthread_mutex_init(&log->lock, NULL);
+	TAILQ_INIT(&log->segments);
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		p_error("mkdir", errno);
+		exit(errno);
+	}
+
+	/* zero-padded names: alphabetical order is sequence order */
+	num_files = scandir(dir, &files, NULL, alphasort);
+	if (num_files < 0) {
+		p_error("scandir", errno);
+		exit(errno);
+	}
+	for (int i = 0; i < num_files; i++) {
+		if (strlen(files[i]->d_name) == 24
+				&& strcmp(files[i]->d_name + 20, ".seg") == 0) {
+			snprintf(path, sizeof(path), "%s/%s", dir,
+					files[i]->d_name);
+			segment = map_segment(path, 0, UINT64_MAX);
+			if (segment && segment->first_seq >= next_seq) {
+				TAILQ_INSERT_TAIL(&log->segments, segment, entries);
+				log->total_bytes += segment->size;
+				next_seq = atomic_load(&segment->next_seq);
+			} else if (segment) {
+				pr_err("log: ignoring out of sequence segment %s\n",
+						path);
+				put_segment(segment);
+			}
+		}
+		free(files[i]);
+	}
+	free(files);
+
+	segment = TAILQ_LAST(&log->segments, segment_list);
+	if (segment) {
+		pr_info("log: recovered messages %lu-%lu\n",
+				TAILQ_FIRST(&log->segments)->first_seq, next_seq - 1);
+		log->active = segment;
+	} else if (!roll_segment(log, 0)) {
+		exit(EXIT_FAILURE);
+	}
+
+	trim_msg_log(log);
+	return log;
+}
+
+/**
+ * @brief Get the sequence number of the next message to be logged
+ * @param log message log
+ * @return sequence number one past the last record
+ */
+uint64_t log_next_seq(struct msg_log *log)
+{
+	uint64_t next_seq;
+
+	pthread_mutex_lock(&log->lock);
+	next_seq = log->active ? atomic_load(&log->active->next_seq) : 0;
+	pthread_mutex_unlock(&log->lock);
+
+	return next_seq;
+}
+
+/**
+ * @brief Get the sequence number of the oldest logged message
+ * @param log message log
+ * @return sequence number of the first record of the oldest segment
+ */
+uint64_t log_first_seq(struct msg_log *log)
+{
+	uint64_t first_seq = 0;
+
+	pthread_mutex_lock(&log->lock);
+	if (!TAILQ_EMPTY(&log->segments)) {
+		first_seq = TAILQ_FIRST(&log->segments)->first_seq;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	return first_seq;
+}
+
+/**
+ * @brief Append a batch of messages to the log
+ * @param log message log
+ * @param entries entries to append (in queue order)
+ * @param num_entries number of entries
+ * @param first_seq sequence number of the first entry
+ * @details Only one producer may append at a time (the caller must hold the
+ * message queue lock). Rolls over to a new segment when the active one is full.
+ * Messages that cannot be logged (no segment can be created) are skipped.
+ */
+void append_msg_log(struct msg_log *log, struct msg_entry **entries,
+		int num_entries, uint64_t first_seq)
+{
+	int64_t now = realtime_ns();
+	size_t offset, len;
+	uint32_t frame_len;
+	struct log_segment *segment;
+	struct log_record *record;
+
+	for (int i = 0; i < num_entries; i++) {
+		frame_len = HEADER_LENGTH + entries[i]->msg->len;
+		len = record_len(frame_len);
+
+		/* roll over when full (leaving room for the end marker) or
+		 * after skipping messages */
+		segment = log->active;
+		if (!segment || atomic_load(&segment->next_seq) != first_seq + i
+				|| atomic_load(&segment->used) + len
+				+ sizeof(struct log_record) > segment->size) {
+			if (!roll_segment(log, first_seq + i)) {
+				continue;
+			}
+			segment = log->active;
+		}
+
+		offset = atomic_load_explicit(&segment->used, memory_order_relaxed);
+		record = record_at(segment, offset);
+		record->seq = first_seq + i;
+		record->time_ns = now;
+		record->reserved = 0;
+		memcpy(record + 1, entries[i]->msg->header, frame_len);
+		/* the record is only valid once its length is set */
+		__atomic_store_n(&record->frame_len, frame_len, __ATOMIC_RELEASE);
+
+		add_record(segment, offset, record);
+		atomic_store_explicit(&segment->used, offset + len,
+				memory_order_release);
+		atomic_store_explicit(&segment->next_seq, first_seq + i + 1,
+				memory_order_release);
+	}
+}
+
+/**
+ * @brief Write back the segments that are no longer being appended to
+ * @param log message log
+ * @details Each segment is synced to disk once, after it has been rolled over
+ * (so messages survive a crash once their segment is closed). Appends are
+ * made with the message queue locked, so this is left to the cleanup thread.
+ */
+void sync_msg_log(struct msg_log *log)
+{
+	struct log_segment *segment;
+
+	while (true) {
+		pthread_mutex_lock(&log->lock);
+		TAILQ_FOREACH(segment, &log->segments, entries) {
+			if (segment != log->active && !segment->synced) {
+				break;
+			}
+		}
+		if (!segment) {
+			pthread_mutex_unlock(&log->lock);
+			return;
+		}
+		/* keep it mapped if it is trimmed meanwhile */
+		atomic_fetch_add(&segment->refs, 1);
+		pthread_mutex_unlock(&log->lock);
+
+		if (msync(segment->map, atomic_load(&segment->used), MS_SYNC) < 0) {
+			p_error("msync", errno);
+		}
+		segment->synced = true;
+		pr_debug("log: synced segment %s\n", segment->path);
+		put_segment(segment);
+	}
+}
+
+/**
+ * @brief Delete the oldest segments beyond the retention limits
+ * @param log message log
+ * @details Segments (other than the active one) are deleted while the log is
+ * over its maximum size, or while the oldest is empty or past the maximum
+ * age. Cursors still reading a deleted segment keep it mapped until they are
+ * done.
+ */
+void trim_msg_log(struct msg_log *log)
+{
+	int64_t oldest = realtime_ns() - (int64_t) log->max_age * 1000000000;
+	struct log_segment *segment;
+
+	pthread_mutex_lock(&log->lock);
+	while ((segment = TAILQ_FIRST(&log->segments)) && segment != log->active) {
+		if (segment->num_records > 0
+				&& (!log->max_bytes || log->total_bytes <= log->max_bytes)
+				&& (!log->max_age
+					|| atomic_load(&segment->last_time_ns) >= oldest)) {
+			break;
+		}
+
+		TAILQ_REMOVE(&log->segments, segment, entries);
+		log->total_bytes -= segment->size;
+		if (unlink(segment->path) < 0) {
+			p_error("unlink", errno);
+		}
+		pr_debug("log: deleted segment %s\n", segment->path);
+		put_segment(segment);
+	}
+	pthread_mutex_unlock(&log->lock);
+}
+
+/**
+ * @brief Find the offset of the first record of a segment with at least a
+ * given sequence number or time
+ * @param segment segment
+ * @param by_time search by time rather than by sequence number
+ * @param seq sequence number to find (ignored when searching by time)
+ * @param time_ns time to find (ignored when searching by sequence number)
+ * @return offset of the record, `used` if there is none
+ * @details Binary search of the sparse index, then a scan of at most
+ * `LOG_INDEX_INTERVAL` records
+ */
+static size_t find_record(struct log_segment *segment, bool by_time,
+		uint64_t seq, int64_t time_ns)
+{
+	size_t used = atomic_load_explicit(&segment->used, memory_order_acquire);
+	uint64_t lo = 0, hi, mid;
+	size_t offset = sizeof(struct log_header);
+	struct log_record *record;
+
+	/* last index entry before the record */
+	hi = atomic_load_explicit(&segment->num_index, memory_order_acquire);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (by_time ? segment->index[mid].time_ns < time_ns
+				: segment->index[mid].seq < seq) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo > 0) {
+		offset = segment->index[lo - 1].offset;
+	}
+
+	while (offset < used) {
+		record = record_at(segment, offset);
+		if (by_time ? record->time_ns >= time_ns : record->seq >= seq) {
+			break;
+		}
+		offset += record_len(record->frame_len);
+	}
+
+	return offset;
+}
+
+/**
+ * @brief Find the oldest logged message that entered the queue no earlier than
+ * a given time
+ * @param log message log
+ * @param time_ns `CLOCK_REALTIME` time in nanoseconds
+ * @return sequence number of the message, the next sequence number to be logged
+ * if every message is older
+ */
+uint64_t find_log_seq_by_time(struct msg_log *log, int64_t time_ns)
+{
+	uint64_t seq = 0;
+	size_t offset;
+	struct log_segment *segment;
+
+	pthread_mutex_lock(&log->lock);
+	TAILQ_FOREACH(segment, &log->segments, entries) {
+		seq = atomic_load(&segment->next_seq);
+		if (atomic_load(&segment->last_time_ns) >= time_ns) {
+			offset = find_record(segment, true, 0, time_ns);
+			if (offset < atomic_load(&segment->used)) {
+				seq = record_at(segment, offset)->seq;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	return seq;
+}
+
+/**
+ * @brief Start replaying logged messages
+ * @param log message log
+ * @param seq sequence number of the first message to replay
+ * @param end_seq sequence number to stop at
+ * @return cursor positioned at the first logged message from `seq` on (see
+ * `cursor->seq`), NULL if there are no such messages before `end_seq`
+ */
+struct log_cursor *open_log_cursor(struct msg_log *log, uint64_t seq,
+		uint64_t end_seq)
+{
+	struct log_cursor *cursor;
+	struct log_segment *segment = NULL, *next;
+	size_t offset;
+
+	pthread_mutex_lock(&log->lock);
+	TAILQ_FOREACH(next, &log->segments, entries) {
+		if (next->first_seq > seq && segment) {
+			break;
+		}
+		segment = next;
+	}
+	if (!segment) {
+		pthread_mutex_unlock(&log->lock);
+		return NULL;
+	}
+	if (seq < segment->first_seq) {
+		/* deleted: start from the oldest message */
+		seq = segment->first_seq;
+	}
+	offset = find_record(segment, false, seq, 0);
+	if (offset < atomic_load(&segment->used)) {
+		seq = record_at(segment, offset)->seq;
+	}
+	atomic_fetch_add(&segment->refs, 1);
+	pthread_mutex_unlock(&log->lock);
+
+	if (seq >= end_seq) {
+		put_segment(segment);
+		return NULL;
+	}
+
+	cursor = malloc(sizeof(struct log_cursor));
+	if (!cursor) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	cursor->log = log;
+	cursor->segment = segment;
+	cursor->offset = offset;
+	cursor->sent = 0;
+	cursor->seq = seq;
+	cursor->end_seq = end_seq;
+
+	return cursor;
+}
+
+/**
+ * @brief Move a cursor to the start of the segment after its current one
+ * @param cursor cursor at the end of its segment
+ * @return true on success, false if there is no later segment
+ */
+static bool next_log_segment(struct log_cursor *cursor)
+{
+	struct log_segment *segment;
+
+	pthread_mutex_lock(&cursor->log->lock);
+	TAILQ_FOREACH(segment, &cursor->log->segments, entries) {
+		if (segment->first_seq >= cursor->seq
+				&& segment != cursor->segment) {
+			atomic_fetch_add(&segment->refs, 1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cursor->log->lock);
+
+	if (!segment) {
+		return false;
+	}
+
+	put_segment(cursor->segment);
+	cursor->segment = segment;
+	cursor->offset = sizeof(struct log_header);
+	cursor->sent = 0;
+	cursor->seq = segment->first_seq;
+	return true;
+}
+
+/**
+ * @brief Send a receiver the logged messages a cursor has yet to reach
+ * @param cursor replay cursor
+ * @param fd receiver socket file descriptor
+ * @param flags `send()` flags (e.g. `MSG_DONTWAIT`)
+ * @return 0 once every message up to `end_seq` has been sent, `-EAGAIN` if the
+ * socket send buffer is full (non-blocking sends only), other negative errno on
+ * error
+ * @details Frames are sent straight from the segment mappings with vectored
+ * sends, continuing after partial sends
+ */
+int send_log_frames(struct log_cursor *cursor, int fd, int flags)
+{
+	int num_frames;
+	size_t used, offset, num_bytes;
+	uint64_t seq;
+	ssize_t res;
+	struct log_record *record;
+	struct iovec frames[SEND_BATCH_FRAMES];
+	struct msghdr hdr = {
+		.msg_iov = frames
+	};
+
+	while (cursor->seq < cursor->end_seq) {
+		used = atomic_load_explicit(&cursor->segment->used,
+				memory_order_acquire);
+		if (cursor->offset >= used) {
+			if (!next_log_segment(cursor)) {
+				return 0;
+			}
+			continue;
+		}
+
+		/* gather frames from the current record on */
+		num_frames = 0;
+		num_bytes = 0;
+		offset = cursor->offset;
+		seq = cursor->seq;
+		while (num_frames < SEND_BATCH_FRAMES && num_bytes < SEND_BATCH_BYTES
+				&& offset < used && seq < cursor->end_seq) {
+			record = record_at(cursor->segment, offset);
+			frames[num_frames].iov_base = record + 1;
+			frames[num_frames++].iov_len = record->frame_len;
+			num_bytes += record->frame_len;
+			offset += record_len(record->frame_len);
+			seq++;
+		}
+
+		/* resume a partially sent frame */
+		frames[0].iov_base = (unsigned char *) frames[0].iov_base
+			+ cursor->sent;
+		frames[0].iov_len -= cursor->sent;
+		hdr.msg_iovlen = num_frames;
+
+		res = sendmsg(fd, &hdr, flags | MSG_NOSIGNAL);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+
+		/* skip records sent in full */
+		res += cursor->sent;
+		while (cursor->offset < used) {
+			record = record_at(cursor->segment, cursor->offset);
+			if ((size_t) res < record->frame_len) {
+				break;
+			}
+			res -= record->frame_len;
+			cursor->offset += record_len(record->frame_len);
+			cursor->seq++;
+		}
+		cursor->sent = res;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Stop replaying logged messages
+ * @param cursor cursor to close (freed)
+ */
+void close_log_cursor(struct log_cursor *cursor)
+{
+	put_segment(cursor->segment);
+	free(cursor);
+}
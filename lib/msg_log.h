@@ -0,0 +1,125 @@
+/**
+ * @file msg_log.h
+ * @brief Constants, structs, and functions for the on-disk message log
+ * @details An optional storage tier behind the message queue: every message is
+ * appended (in sequence order) to fixed-size memory-mapped segment files in the
+ * log directory, named after the sequence number of their first message. Each
+ * record holds the sequence number, the (wall-clock) time the message entered
+ * the queue, and the frame exactly as it is sent. Every `LOG_INDEX_INTERVAL`th
+ * record of a segment is indexed, so a message is found by sequence number or
+ * time with a binary search and a short scan. Segments are deleted once older
+ * than the maximum age or beyond the maximum total size, and are recovered on
+ * startup so the retained window survives a restart.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/queue.h>
+#include <pthread.h>
+
+#define LOG_MAGIC "WSLOG001"  ///< segment file magic (8 bytes, no terminator)
+#define LOG_INDEX_INTERVAL 256  ///< number of records per sparse index entry
+#define LOG_ALIGN 8  ///< record alignment
+
+struct msg_entry;
+
+/**
+ * @brief Segment file header
+ */
+struct log_header {
+	char magic[8];  ///< `LOG_MAGIC`
+	uint64_t first_seq;  ///< sequence number of the first record
+	uint64_t reserved[2];
+};
+
+/**
+ * @brief Record header (followed by the frame, padded to `LOG_ALIGN` bytes)
+ * @details A record with `frame_len` 0 marks the end of the segment
+ */
+struct log_record {
+	uint64_t seq;  ///< sequence number of the message
+	int64_t time_ns;  ///< `CLOCK_REALTIME` time the message entered the queue (ns)
+	uint32_t frame_len;  ///< length of the frame (header included)
+	uint32_t reserved;
+};
+
+/**
+ * @brief Sparse index entry
+ */
+struct log_index {
+	uint64_t seq;  ///< sequence number of the record
+	uint64_t offset;  ///< offset of the record in the segment
+	int64_t time_ns;  ///< time of the record
+};
+
+/**
+ * @brief Segment file
+ * @details The active segment is only written by the producer holding the
+ * message queue lock. Readers only read records before `used`.
+ */
+struct log_segment {
+	int fd;
+	unsigned char *map;  ///< mapping of the whole file
+	size_t size;  ///< file size
+	_Atomic size_t used;  ///< offset one past the last record
+	uint64_t first_seq;
+	_Atomic uint64_t next_seq;  ///< sequence number one past the last record
+	_Atomic int64_t last_time_ns;  ///< time of the last record (0 if empty)
+	uint64_t num_records;
+	struct log_index *index;  ///< sparse index (`max_index` entries)
+	_Atomic uint64_t num_index;  ///< number of index entries written
+	uint64_t max_index;
+	/**
+	 * @brief number of references to the segment
+	 * @details One for the log while it lists the segment plus one per
+	 * cursor reading it: unmapped when this drops to 0
+	 */
+	_Atomic int refs;
+	bool synced;  ///< written back to disk since it stopped being active
+	char path[PATH_MAX];
+	TAILQ_ENTRY(log_segment) entries;  ///< prev + next pointers for segment list
+};
+TAILQ_HEAD(segment_list, log_segment);
+
+/**
+ * @brief Message log
+ */
+struct msg_log {
+	const char *dir;  ///< log directory
+	size_t segment_size;  ///< size of each segment file
+	int max_age;  ///< delete segments whose last record is older (seconds, 0 = no limit)
+	uint64_t max_bytes;  ///< delete the oldest segments beyond this total size (0 = no limit)
+	pthread_mutex_t lock;  ///< protects `segments`, `total_bytes` and `active`
+	struct segment_list segments;  ///< oldest first, last = active
+	uint64_t total_bytes;  ///< total size of the segment files
+	struct log_segment *active;  ///< segment being appended to (NULL if none)
+};
+
+/**
+ * @brief Position of a receiver replaying messages from the log
+ */
+struct log_cursor {
+	struct msg_log *log;
+	struct log_segment *segment;  ///< segment being read (referenced)
+	size_t offset;  ///< offset of the current record in the segment
+	size_t sent;  ///< number of bytes of the current record's frame already sent
+	uint64_t seq;  ///< sequence number of the current record
+	uint64_t end_seq;  ///< sequence number to stop at
+};
+
+struct msg_log *open_msg_log(const char *dir, size_t segment_size, int max_age,
+		uint64_t max_bytes);
+uint64_t log_next_seq(struct msg_log *log);
+uint64_t log_first_seq(struct msg_log *log);
+void append_msg_log(struct msg_log *log, struct msg_entry **entries,
+		int num_entries, uint64_t first_seq);
+void sync_msg_log(struct msg_log *log);
+void trim_msg_log(struct msg_log *log);
+
+uint64_t find_log_seq_by_time(struct msg_log *log, int64_t time_ns);
+struct log_cursor *open_log_cursor(struct msg_log *log, uint64_t seq,
+		uint64_t end_seq);
+int send_log_frames(struct log_cursor *cursor, int fd, int flags);
+void close_log_cursor(struct log_cursor *cursor);
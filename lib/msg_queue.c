@@ -4,166 +4,770 @@
  */
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "ctmp.h"
+#include "pool.h"
 #include "msg_queue.h"
 #include "timestamp.h"
 #include "log.h"
 
+_Static_assert(sizeof(struct msg_entry) == CACHE_LINE_SIZE,
+		"message queue entries should fill exactly one cache line");
+_Static_assert(sizeof(struct msg_slot) == CACHE_LINE_SIZE,
+		"message queue slots should fill exactly one cache line");
+
+/**
+ * @brief Memory held by message queue entries and their message data (bytes)
+ * @details Counted from the time an entry is initialised until it is freed
+ */
+static _Atomic uint64_t queue_bytes = 0;
+
+/**
+ * @brief Usage at which threads waiting in `wait_for_mem_usage()` are woken
+ * (0 if none are waiting)
+ */
+static _Atomic uint64_t usage_low_water = 0;
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;  ///< protects waits on `usage_cond`
+static pthread_cond_t usage_cond = PTHREAD_COND_INITIALIZER;  ///< signalled once usage drops to `usage_low_water`
+
+/**
+ * @brief Size of a given entry and its message data
+ * @param entry message queue entry
+ * @return size in bytes
+ */
+static inline uint64_t msg_entry_size(struct msg_entry *entry)
+{
+	return sizeof(struct msg_entry) + CTMP_MSG_SIZE(entry->msg->len);
+}
+
+/**
+ * @brief Get the lap of the ring a given sequence number is written in
+ * @param ring message queue
+ * @param seq sequence number
+ * @return lap (truncated to 32 bits)
+ */
+static inline uint32_t ring_lap(struct msg_ring *ring, uint64_t seq)
+{
+	return (uint32_t) (seq >> ring->lap_shift);
+}
+
+/**
+ * @brief Combine a lap and the lower half of a slot state
+ * @param lap ring lap
+ * @param unclaimed unclaimed count and `MSG_EXPIRED` flag
+ * @return slot state
+ */
+static inline uint64_t slot_state(uint32_t lap, uint32_t unclaimed)
+{
+	return ((uint64_t) lap << 32) | unclaimed;
+}
+
+/**
+ * @brief Initialise the message queue
+ * @param ring message queue to initialise
+ * @param num_slots number of slots (rounded up to a power of 2)
+ * @param retain keep every message until it expires (or is overwritten), even
+ * once every receiver has been sent it, so receivers can replay it?
+ * @param overwrite overwrite the oldest message once the ring is full, even if
+ * receivers have yet to claim it (rather than wait for them)?
+ * @param first_seq sequence number of the first message to enter the queue
+ * (continues the message log, if any)
+ */
+void init_msg_ring(struct msg_ring *ring, size_t num_slots, bool retain,
+		bool overwrite, uint64_t first_seq)
+{
+	ring->lap_shift = 0;
+	while (((size_t) 1 << ring->lap_shift) < num_slots) {
+		ring->lap_shift++;
+	}
+	num_slots = (size_t) 1 << ring->lap_shift;
+	ring->mask = num_slots - 1;
+
+	ring->slots = aligned_alloc(CACHE_LINE_SIZE,
+			num_slots * sizeof(struct msg_slot));
+	if (!ring->slots) {
+		p_error("aligned_alloc", errno);
+		exit(errno);
+	}
+
+	/* no lap matches UINT32_MAX until the sequence number wraps around */
+	for (size_t i = 0; i < num_slots; i++) {
+		atomic_init(&ring->slots[i].state, slot_state(UINT32_MAX, MSG_EXPIRED));
+		atomic_init(&ring->slots[i].entry, NULL);
+	}
+
+	ring->retain = retain ? 1 : 0;
+	ring->overwrite = overwrite;
+	atomic_init(&ring->tail, first_seq);
+	atomic_init(&ring->tail_offset, 0);
+	atomic_init(&ring->overwritten, 0);
+	atomic_init(&ring->full, 0);
+	atomic_init(&ring->full_waiters, 0);
+	pthread_mutex_init(&ring->full_lock, NULL);
+	pthread_cond_init(&ring->full_cond, NULL);
+}
+
+/**
+ * @brief Check whether a message's slot can be reused without any receiver
+ * missing it
+ * @param ring message queue
+ * @param seq sequence number of the message
+ * @return true if the slot has moved on, or the message has expired or been
+ * claimed by every receiver it is due to (the ring may still retain it), false
+ * otherwise
+ */
+static inline bool slot_released(struct msg_ring *ring, uint64_t seq)
+{
+	uint64_t state = atomic_load(&ring->slots[seq & ring->mask].state);
+
+	return ((uint32_t) (state >> 32) != ring_lap(ring, seq)
+			|| (state & MSG_EXPIRED)
+			|| (state & MSG_UNCLAIMED_MASK) <= ring->retain);
+}
+
+/**
+ * @brief Wake producers waiting for the ring to have room
+ * @param ring message queue
+ * @details Called after releasing a message's slot (see `slot_released()`).
+ * Sequentially consistent with `wait_for_free_slots()`: either the waiter sees
+ * the released slot or this sees the waiter.
+ */
+static inline void wake_full_waiters(struct msg_ring *ring)
+{
+	if (atomic_load(&ring->full_waiters) > 0) {
+		pthread_mutex_lock(&ring->full_lock);
+		pthread_cond_broadcast(&ring->full_cond);
+		pthread_mutex_unlock(&ring->full_lock);
+	}
+}
+
+/**
+ * @brief Check whether a slot only appears to have no unclaimed references
+ * because a receiver is joining its message
+ * @param ring message queue
+ * @param state slot state
+ * @param lap lap of the message being looked up
+ * @return true if the caller should reload the state and try again, false
+ * otherwise
+ * @details With retention, the ring holds an unclaimed reference to every
+ * message until it expires or is overwritten, so the count can only drop to 0
+ * while `join_retained_msgs()` has borrowed it
+ */
+static inline bool joining_msg(struct msg_ring *ring, uint64_t state,
+		uint32_t lap)
+{
+	return (ring->retain && (uint32_t) (state >> 32) == lap
+			&& !(state & (MSG_EXPIRED | MSG_UNCLAIMED_MASK)));
+}
+
+/**
+ * @brief Wait for a receiver to finish joining a message
+ * @param ring message queue
+ * @param slot slot of the message
+ * @param state slot state last loaded
+ * @param lap lap of the message being looked up
+ * @return slot state once no receiver is joining the message
+ * @details The join only takes a few instructions, so this spins (with a pause
+ * hint), but yields the CPU after `JOIN_SPINS` spins in case the joining thread
+ * has been preempted
+ */
+static inline uint64_t wait_for_join(struct msg_ring *ring, struct msg_slot *slot,
+		uint64_t state, uint32_t lap)
+{
+	for (int spins = 0; joining_msg(ring, state, lap); spins++) {
+		if (spins < JOIN_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#elif defined(__aarch64__)
+			__asm__ __volatile__("yield");
+#endif
+		} else {
+			sched_yield();
+		}
+		state = atomic_load(&slot->state);
+	}
+
+	return state;
+}
+
 /**
  * @brief Initialise a message queue entry
  * @param entry entry to initialise
  * @param msg CTMP message structure the entry should represent
- * @param num_threads number of worker threads
- * @details `num_threads` is used when initialising the `sent` member
+ * @param ttl time to live in milliseconds
+ * @details The entry is allocated from the pool. No receiver is due to send it
+ * until it is appended to the queue.
  */
-void init_msg_entry(struct msg_entry **entry, struct ctmp_msg *msg,
-		int num_threads)
+void init_msg_entry(struct msg_entry **entry, struct ctmp_msg *msg, int ttl)
 {
-	(*entry) = malloc(sizeof(struct msg_entry));
-	if (!(*entry)) {
-		p_error("malloc", errno);
-		exit(errno);
-	}
+	(*entry) = pool_alloc(sizeof(struct msg_entry));
 
-	/* init timestamp */
+	/* init timestamp and expiry deadline */
 	get_clock_time(&(*entry)->timestamp);
+	(*entry)->deadline = (*entry)->timestamp;
+	add_time_ms(&(*entry)->deadline, ttl);
 
-	/* init sent status bitmask and associated lock */
-	(*entry)->sent = malloc(sizeof(uint64_t));
-	if (!(*entry)->sent) {
-		p_error("malloc", errno);
-		exit(errno);
-	}
-	*((*entry)->sent) = 0;
-	pthread_rwlock_init(&(*entry)->sent_lock, NULL);
+	/* init reference count */
+	atomic_init(&(*entry)->refs, 0);
+
+	/* no frame pipe unless splice fan-out is enabled */
+	(*entry)->pipe_fd = -1;
 
 	/* set pointer to message data */
 	(*entry)->msg = msg;
+	(*entry)->parse_tick = 0;
+
+	atomic_fetch_add_explicit(&queue_bytes, msg_entry_size(*entry),
+			memory_order_relaxed);
 }
 
 /**
- * @brief Free CTMP message data of a given message queue entry
- * @param entry entry to free message data of
- * @param msg_lock message queue lock
- * @details Free message sent status bitmask and `struct ctmp_msg` data
+ * @brief Free a message queue entry and its CTMP message data
+ * @param entry entry to free
+ * @details Return the `struct ctmp_msg` frame and the entry to the pool and
+ * close its frame pipe (if any)
  */
-void free_msg_data(struct msg_entry **entry, pthread_mutex_t *msg_lock)
+static void free_msg_entry(struct msg_entry *entry)
 {
-	pthread_mutex_lock(msg_lock);
+	uint64_t size = msg_entry_size(entry), usage, low_water;
+
+	pr_debug("freeing %d-byte message (seq %lu)\n", entry->msg->len,
+			entry->seq);
 
-	/* free sent status bitmask and related lock */
-	free((*entry)->sent);
-	(*entry)->sent = NULL;
-	pthread_rwlock_destroy(&(*entry)->sent_lock);
+	/* close frame pipe */
+	if (entry->pipe_fd >= 0) {
+		close(entry->pipe_fd);
+	}
 
 	/* free message data */
-	free_ctmp_msg((*entry)->msg);
-	(*entry)->msg = NULL;
+	free_ctmp_msg(entry->msg);
+	pool_free(entry, sizeof(struct msg_entry));
 
-	pthread_mutex_unlock(msg_lock);
+	/* sequentially consistent with `wait_for_mem_usage()`: either it sees
+	 * the new usage or this sees its low-water mark */
+	usage = atomic_fetch_sub(&queue_bytes, size) - size;
+	low_water = atomic_load(&usage_low_water);
+	if (low_water && usage <= low_water) {
+		pthread_mutex_lock(&usage_lock);
+		atomic_store(&usage_low_water, 0);
+		pthread_cond_broadcast(&usage_cond);
+		pthread_mutex_unlock(&usage_lock);
+	}
 }
 
 /**
- * @brief Get the next message queue entry to process
- * @param head message queue head
- * @param lock message queue lock
- * @param cond message queue condition variable
- * @param current current entry to process
- * @param prev previous message queue entry
- * @param to_start whether to return to the start of the queue or go to the next
- * entry (after `prev`)
- * @return `current` (unchanged) if it is not NULL, the first entry of the queue
- * if `to_start = true`, the entry after `prev` otherwise
- * @details Wait for the desired message queue to become available (added to the
- * queue) if `current` is NULL
- */
-struct msg_entry *get_msg_entry(struct msg_queue *head, pthread_mutex_t *lock,
-		pthread_cond_t *cond, struct msg_entry *current,
-		struct msg_entry *prev, bool to_start)
-{
-	struct msg_entry *new_entry = NULL;
-
-	if (TAILQ_EMPTY(head) || !current) {
-		pthread_mutex_lock(lock);
-		/* wait on different conditions depending on if the queue is
-		 * empty or we are just waiting for the next message */
-		if (TAILQ_EMPTY(head) || !prev) {
-			/* wait for first entry */
-			while (TAILQ_EMPTY(head)) {
-				pthread_cond_wait(cond, lock);
-			}
-			new_entry = TAILQ_FIRST(head);
-		} else {
-			/* wait for next entry */
-			while (!TAILQ_NEXT(prev, entries)) {
-				pthread_cond_wait(cond, lock);
-			}
+ * @brief Wait until a batch of entries can be appended to the message queue
+ * without overwriting a message still due to a receiver
+ * @param ring message queue
+ * @param num_entries number of entries to append
+ * @param lock message queue lock (held by the caller)
+ * @return tail sequence number: the first entry's sequence number
+ * @details Returns straight away unless the ring is full. Otherwise the lock is
+ * dropped while waiting, so receivers can leave, and is held again on return.
+ * The wait is bounded by the TTL, as expired messages are released. Does not
+ * wait if overwriting is enabled.
+ */
+uint64_t wait_for_free_slots(struct msg_ring *ring, int num_entries,
+		pthread_mutex_t *lock)
+{
+	uint64_t tail, seq, old_seq;
+
+	while (true) {
+		tail = ring_tail(ring);
+		if (ring->overwrite) {
+			return tail;
+		}
 
-			/* set current based on to_start argument */
-			if (to_start) {
-				new_entry = TAILQ_FIRST(head);
-			} else {
-				new_entry = TAILQ_NEXT(prev, entries);
+		/* find the first entry that would overwrite a pending message */
+		for (seq = tail; seq < tail + num_entries; seq++) {
+			if (seq > ring->mask
+					&& !slot_released(ring, seq - ring->mask - 1)) {
+				break;
 			}
 		}
+		if (seq == tail + num_entries) {
+			return tail;
+		}
+		old_seq = seq - ring->mask - 1;
+
+		atomic_fetch_add_explicit(&ring->full, 1, memory_order_relaxed);
+		pr_debug("message queue full: waiting for message %lu\n", old_seq);
+
 		pthread_mutex_unlock(lock);
-	} else {
-		/* leave unchanged */
-		new_entry = current;
+		pthread_mutex_lock(&ring->full_lock);
+		atomic_fetch_add(&ring->full_waiters, 1);
+		while (!slot_released(ring, old_seq)) {
+			pthread_cond_wait(&ring->full_cond, &ring->full_lock);
+		}
+		atomic_fetch_sub(&ring->full_waiters, 1);
+		pthread_mutex_unlock(&ring->full_lock);
+
+		/* another producer may have appended in the meantime */
+		pthread_mutex_lock(lock);
+	}
+}
+
+/**
+ * @brief Append a batch of entries to the message queue
+ * @param ring message queue
+ * @param entries entries to append
+ * @param num_entries number of entries
+ * @param num_receivers number of connected receivers due every message
+ * @param num_subscribers number of further receivers due each entry (channel
+ * subscribers), NULL if none
+ * @param tick latency clock tick the entries enter the queue at (0 if not
+ * tracked)
+ * @details Entries are given consecutive sequence numbers in queue order, and
+ * are due to be claimed by each of the receivers they are due to (and held by
+ * the ring itself with retention). Each entry overwrites the one a full lap of
+ * the ring earlier: receivers that have yet to claim that one no longer can
+ * (unless overwriting is enabled, the caller waits for them first with
+ * `wait_for_free_slots()`). Entries with no references are freed straight away.
+ * Only one producer may append at a time (the caller must hold the message
+ * queue lock).
+ */
+void append_msg_entries(struct msg_ring *ring, struct msg_entry **entries,
+		int num_entries, uint32_t num_receivers, uint32_t *num_subscribers,
+		uint64_t tick)
+{
+	uint32_t lap, unclaimed, refs;
+	uint64_t seq = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint64_t offset = atomic_load_explicit(&ring->tail_offset,
+			memory_order_relaxed);
+	struct msg_slot *slot;
+	struct msg_entry *entry;
+
+	for (int i = 0; i < num_entries; i++, seq++) {
+		entry = entries[i];
+		entry->seq = seq;
+		refs = num_receivers + ring->retain
+			+ (num_subscribers ? num_subscribers[i] : 0);
+		atomic_store(&entry->refs, refs);
+
+		/* retire the previous entry in the slot (no claims can succeed
+		 * until the new entry is published) */
+		slot = &ring->slots[seq & ring->mask];
+		lap = ring_lap(ring, seq);
+		unclaimed = atomic_exchange(&slot->state,
+				slot_state(lap, MSG_EXPIRED)) & MSG_UNCLAIMED_MASK;
+		/* seqlock write: a reader of the previous lap that sees any of
+		 * the new values below also sees the new lap */
+		atomic_thread_fence(memory_order_release);
+		if (unclaimed > ring->retain) {
+			atomic_fetch_add(&ring->overwritten, 1);
+		}
+		if (unclaimed > 0) {
+			release_msg(atomic_load(&slot->entry), unclaimed);
+		}
+
+		/* publish the new entry */
+		atomic_store(&slot->entry, entry);
+		atomic_store_explicit(&slot->timestamp_ns,
+				time_to_ns(&entry->timestamp), memory_order_relaxed);
+		atomic_store_explicit(&slot->deadline_ns,
+				time_to_ns(&entry->deadline), memory_order_relaxed);
+		atomic_store_explicit(&slot->offset, offset, memory_order_relaxed);
+		slot->enqueue_tick = tick;
+		offset += HEADER_LENGTH + entry->msg->len;
+		atomic_store(&slot->state, slot_state(lap, refs));
+
+		if (refs == 0) {
+			free_msg_entry(entry);
+		}
+	}
+
+	atomic_store_explicit(&ring->tail_offset, offset, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, seq, memory_order_release);
+}
+
+/**
+ * @brief Get the memory held by message queue entries
+ * @return number of bytes held by entries and their message data, including
+ * entries not yet appended to the queue
+ */
+uint64_t queue_mem_usage(void)
+{
+	return atomic_load_explicit(&queue_bytes, memory_order_relaxed);
+}
+
+/**
+ * @brief Wait until the memory held by message queue entries drops to a given
+ * level
+ * @param low_water number of bytes to wait for
+ * @details Woken by the release of the entry that brings usage down to
+ * `low_water`, rather than polling
+ */
+void wait_for_mem_usage(uint64_t low_water)
+{
+	pthread_mutex_lock(&usage_lock);
+	atomic_store(&usage_low_water, low_water);
+	while (atomic_load(&queue_bytes) > low_water) {
+		pthread_cond_wait(&usage_cond, &usage_lock);
+		/* reset by the waker: other waiters may need it again */
+		atomic_store(&usage_low_water, low_water);
+	}
+	pthread_mutex_unlock(&usage_lock);
+}
+
+/**
+ * @brief Get the sequence number of the next message to enter the queue
+ * @param ring message queue
+ * @return tail sequence number: all earlier messages have been published
+ */
+uint64_t ring_tail(struct msg_ring *ring)
+{
+	return atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/**
+ * @brief Get the sequence number of the oldest message still in the queue
+ * @param ring message queue
+ * @param tail tail sequence number (see `ring_tail()`)
+ * @return oldest sequence number that has not been overwritten
+ */
+uint64_t ring_head(struct msg_ring *ring, uint64_t tail)
+{
+	return (tail > ring->mask) ? tail - ring->mask - 1 : 0;
+}
+
+/**
+ * @brief Wait for a given message to enter the queue
+ * @param ring message queue
+ * @param seq sequence number of the message to wait for
+ * @param lock message queue lock
+ * @param cond message queue condition variable
+ * @param stop flag to stop waiting early (set before broadcasting `cond`, NULL
+ * if none)
+ * @return tail sequence number (greater than `seq` unless stopped early)
+ * @details Only takes the lock (to sleep) if the message has not entered the
+ * queue yet
+ */
+uint64_t wait_for_msgs(struct msg_ring *ring, uint64_t seq,
+		pthread_mutex_t *lock, pthread_cond_t *cond, _Atomic bool *stop)
+{
+	uint64_t tail = ring_tail(ring);
+
+	if (tail > seq) {
+		return tail;
+	}
+
+	pthread_mutex_lock(lock);
+	while ((tail = ring_tail(ring)) <= seq && !(stop && atomic_load(stop))) {
+		pthread_cond_wait(cond, lock);
+	}
+	pthread_mutex_unlock(lock);
+
+	return tail;
+}
+
+/**
+ * @brief Wait for a given message to enter the queue, up to a deadline
+ * @param ring message queue
+ * @param seq sequence number of the message to wait for
+ * @param lock message queue lock
+ * @param cond message queue condition variable (using `CLOCK_MONOTONIC`)
+ * @param deadline time to stop waiting at (NULL: wait indefinitely)
+ * @return tail sequence number (greater than `seq` unless the deadline passed)
+ */
+uint64_t wait_for_msgs_until(struct msg_ring *ring, uint64_t seq,
+		pthread_mutex_t *lock, pthread_cond_t *cond,
+		struct timespec *deadline)
+{
+	uint64_t tail = ring_tail(ring);
+
+	if (tail > seq) {
+		return tail;
+	}
+
+	pthread_mutex_lock(lock);
+	while ((tail = ring_tail(ring)) <= seq) {
+		if (!deadline) {
+			pthread_cond_wait(cond, lock);
+		} else if (pthread_cond_timedwait(cond, lock, deadline) == ETIMEDOUT) {
+			break;
+		}
 	}
+	pthread_mutex_unlock(lock);
 
-	return new_entry;
+	return tail;
 }
 
 /**
- * @brief Determine if a given thread has already sent a given message
- * @param entry message queue entry to check
- * @param thread_index thread index (= bit position) to check message sent status of
- * @details The bit at the position `thread_index` in `entry->sent` represents
- * whether that thread has sent this message
+ * @brief Release references to a given entry
+ * @param entry entry to release
+ * @param count number of references to release
+ * @details The entry and its message data are freed when the last reference is
+ * released
  */
-bool is_sent(struct msg_entry *entry, int thread_index)
+void release_msg(struct msg_entry *entry, int count)
 {
-	bool res;
+	if (count > 0 && atomic_fetch_sub(&entry->refs, count) == count) {
+		free_msg_entry(entry);
+	}
+}
 
-	pthread_rwlock_rdlock(&entry->sent_lock);
-	res = is_set(entry->sent, thread_index);
-	pthread_rwlock_unlock(&entry->sent_lock);
+/**
+ * @brief Take an additional reference to a given entry
+ * @param entry entry to hold
+ * @details The caller must already hold a reference (i.e. have claimed the
+ * message), so the entry cannot have been freed
+ */
+void hold_msg(struct msg_entry *entry)
+{
+	atomic_fetch_add(&entry->refs, 1);
+}
+
+/**
+ * @brief Claim a message for sending by a receiver
+ * @param ring message queue
+ * @param seq sequence number of the message
+ * @return entry to send, NULL if the receiver should skip the message
+ * @details A receiver is due every message that entered the queue while it was
+ * connected, and must visit them in order, trying to claim each exactly once.
+ * On success, the receiver holds a reference to the entry and must call
+ * `release_msg()` once done with it. Expired and overwritten messages cannot be
+ * claimed.
+ */
+struct msg_entry *claim_msg(struct msg_ring *ring, uint64_t seq)
+{
+	struct msg_slot *slot = &ring->slots[seq & ring->mask];
+	uint32_t lap = ring_lap(ring, seq);
+	uint64_t state = atomic_load(&slot->state);
+	struct msg_entry *entry;
+
+	do {
+		state = wait_for_join(ring, slot, state, lap);
+		if ((uint32_t) (state >> 32) != lap || (state & MSG_EXPIRED)
+				|| !(state & MSG_UNCLAIMED_MASK)) {
+			return NULL;
+		}
+		/* the slot cannot be reused before the claim succeeds */
+		entry = atomic_load(&slot->entry);
+	} while (!atomic_compare_exchange_weak(&slot->state, &state, state - 1));
 
-	return res;
+	if (((state - 1) & MSG_UNCLAIMED_MASK) <= ring->retain) {
+		wake_full_waiters(ring);
+	}
+
+	return entry;
 }
 
 /**
- * @brief Set a given bit of the `sent` bitmask to a given value
- * @param entry message queue entry to updat
- * @param thread_index thread index (= bit position) to update
- * @param val value to set the bit to
+ * @brief Get the latency clock tick a claimed message entered the queue at
+ * @param ring message queue
+ * @param seq sequence number of the message (claimed by the caller)
+ * @return tick (0 if not tracked)
+ * @details Read from the message's slot: only meant for statistics, as the
+ * slot may (in theory) have been reused since the claim
  */
-void set_sent(struct msg_entry *entry, int thread_index, bool val)
+uint64_t msg_enqueue_tick(struct msg_ring *ring, uint64_t seq)
 {
-	/* change message status to sent */
-	pthread_rwlock_wrlock(&entry->sent_lock);
-	set_bit(entry->sent, thread_index, val);
-	pthread_rwlock_unlock(&entry->sent_lock);
+	return ring->slots[seq & ring->mask].enqueue_tick;
 }
 
-/* NOTE determine whether a receiver can send a given message i.e. the message
- * was sent after the receiver connected */
 /**
- * @brief Determine whether a receiver can send a given message
- * @param entry message entry to check
- * @param thread_index receiver thread index
- * @param recv_start receiver connection timestamp
- * @details A receiver can send a message iff it was sent after the receiver
- * connected
+ * @brief Get the position of a message in the queue, whether or not it is still
+ * due to any receiver
+ * @param ring message queue
+ * @param seq sequence number of the message (less than the tail)
+ * @param timestamp set to the time the message entered the queue
+ * @param offset set to the total length of the frames that entered the queue
+ * before the message
+ * @return true on success, false if the message has been overwritten
+ * @details Lock-free read of the slot, as a seqlock keyed on its lap
  */
-bool can_forward(struct msg_entry *entry, int thread_index,
-		struct timespec recv_start)
+bool peek_msg(struct msg_ring *ring, uint64_t seq, struct timespec *timestamp,
+		uint64_t *offset)
 {
-	/* timestamp check before sent status because sent could have been freed
-	 * by the cleanup worker if the message is past its TTL */
-	return (compare_times(&recv_start, &entry->timestamp)
-			&& (!is_sent(entry, thread_index)));
+	struct msg_slot *slot = &ring->slots[seq & ring->mask];
+	uint32_t lap = ring_lap(ring, seq);
+	int64_t timestamp_ns;
+
+	if ((uint32_t) (atomic_load(&slot->state) >> 32) != lap) {
+		return false;
+	}
+	timestamp_ns = atomic_load_explicit(&slot->timestamp_ns,
+			memory_order_relaxed);
+	*offset = atomic_load_explicit(&slot->offset, memory_order_relaxed);
+
+	/* check the slot was not reused while reading it */
+	atomic_thread_fence(memory_order_acquire);
+	if ((uint32_t) (atomic_load_explicit(&slot->state,
+					memory_order_relaxed) >> 32) != lap) {
+		return false;
+	}
+
+	ns_to_time(timestamp_ns, timestamp);
+	return true;
+}
+
+/**
+ * @brief Check whether a message is still due to any receiver (or retained)
+ * @param ring message queue
+ * @param seq sequence number of the message
+ * @param deadline set to the time the message expires
+ * @return true if at least one receiver has yet to claim the message (or the
+ * ring retains it), false otherwise (`deadline` is not set)
+ */
+bool msg_pending(struct msg_ring *ring, uint64_t seq, struct timespec *deadline)
+{
+	struct msg_slot *slot = &ring->slots[seq & ring->mask];
+	uint32_t lap = ring_lap(ring, seq);
+	uint64_t state = atomic_load(&slot->state);
+
+	state = wait_for_join(ring, slot, state, lap);
+	if ((uint32_t) (state >> 32) != lap || (state & MSG_EXPIRED)
+			|| !(state & MSG_UNCLAIMED_MASK)) {
+		return false;
+	}
+	ns_to_time(atomic_load_explicit(&slot->deadline_ns, memory_order_relaxed),
+			deadline);
+
+	/* check the slot was not reused while reading the deadline */
+	atomic_thread_fence(memory_order_acquire);
+	return ((uint32_t) (atomic_load_explicit(&slot->state,
+					memory_order_relaxed) >> 32) == lap);
+}
+
+/**
+ * @brief Expire a message: no receiver that has not already claimed it may send
+ * it
+ * @param ring message queue
+ * @param seq sequence number of the message
+ * @return number of receivers that had yet to claim the message
+ * @details Releases the references of those receivers (and the ring's own with
+ * retention), so the entry is freed once any in-progress sends complete
+ */
+int expire_msg(struct msg_ring *ring, uint64_t seq)
+{
+	struct msg_slot *slot = &ring->slots[seq & ring->mask];
+	uint32_t lap = ring_lap(ring, seq);
+	uint64_t state = atomic_load(&slot->state);
+	uint32_t unclaimed;
+	struct msg_entry *entry;
+
+	do {
+		state = wait_for_join(ring, slot, state, lap);
+		if ((uint32_t) (state >> 32) != lap || (state & MSG_EXPIRED)
+				|| !(state & MSG_UNCLAIMED_MASK)) {
+			return 0;
+		}
+		entry = atomic_load(&slot->entry);
+	} while (!atomic_compare_exchange_weak(&slot->state, &state,
+				slot_state(lap, MSG_EXPIRED)));
+
+	wake_full_waiters(ring);
+
+	unclaimed = state & MSG_UNCLAIMED_MASK;
+	release_msg(entry, unclaimed);
+	return (unclaimed > ring->retain) ? unclaimed - ring->retain : 0;
+}
+
+/**
+ * @brief Make retained messages due to a receiver that joined after they
+ * entered the queue
+ * @param ring message queue (with retention)
+ * @param seq sequence number of the first message to replay
+ * @param end_seq sequence number of the first message already due to the
+ * receiver (see `join_receivers()`)
+ * @return number of messages that are now due to the receiver
+ * @details For each message, borrows the ring's reference with a claim, takes
+ * a second one, then returns both to the slot: one for the ring and one for
+ * the receiver, which then claims the message like any other. Messages that
+ * expire or are overwritten in the meantime are released again and skipped.
+ */
+uint64_t join_retained_msgs(struct msg_ring *ring, uint64_t seq,
+		uint64_t end_seq)
+{
+	uint64_t head = ring_head(ring, ring_tail(ring)), num_joined = 0, state;
+	uint32_t lap;
+	struct msg_slot *slot;
+	struct msg_entry *entry;
+
+	/* overwritten messages have already been released */
+	if (seq < head) {
+		seq = head;
+	}
+
+	for (; seq < end_seq; seq++) {
+		if (!(entry = claim_msg(ring, seq))) {
+			continue;
+		}
+		hold_msg(entry);
+
+		slot = &ring->slots[seq & ring->mask];
+		lap = ring_lap(ring, seq);
+		state = atomic_load(&slot->state);
+		do {
+			if ((uint32_t) (state >> 32) != lap || (state & MSG_EXPIRED)) {
+				release_msg(entry, 2);
+				entry = NULL;
+				break;
+			}
+		} while (!atomic_compare_exchange_weak(&slot->state, &state,
+					state + 2));
+
+		if (entry) {
+			num_joined++;
+		}
+	}
+
+	return num_joined;
+}
+
+/**
+ * @brief Find the oldest message in the queue that entered it no earlier than
+ * a given time
+ * @param ring message queue
+ * @param time time to search for
+ * @return sequence number of the message, the tail if every message is older
+ * @details Binary search: messages enter the queue in timestamp order
+ */
+uint64_t find_msg_by_time(struct msg_ring *ring, struct timespec *time)
+{
+	uint64_t tail = ring_tail(ring), seq = ring_head(ring, tail), mid, offset;
+	struct timespec timestamp;
+
+	while (seq < tail) {
+		mid = seq + (tail - seq) / 2;
+		if (!peek_msg(ring, mid, &timestamp, &offset)
+				|| compare_times(&timestamp, time)) {
+			/* overwritten or too old */
+			seq = mid + 1;
+		} else {
+			tail = mid;
+		}
+	}
+
+	return seq;
+}
+
+/**
+ * @brief Drop a receiver's claim to all messages it has not yet visited
+ * @param ring message queue
+ * @param seq sequence number of the first message the receiver has not visited
+ * @param end_seq sequence number of the first message the receiver is no
+ * longer due
+ * @details Used when a receiver disconnects, so messages it will no longer send
+ * can be freed. The receiver must have already left (see `end_seq`) so that no
+ * new messages are due to it.
+ */
+void drop_pending_msgs(struct msg_ring *ring, uint64_t seq, uint64_t end_seq)
+{
+	struct msg_entry *entry;
+	uint64_t head = ring_head(ring, ring_tail(ring));
+
+	/* overwritten messages have already been released */
+	if (seq < head) {
+		seq = head;
+	}
+
+	for (; seq < end_seq; seq++) {
+		if ((entry = claim_msg(ring, seq))) {
+			release_msg(entry, 1);
+		}
+	}
 }
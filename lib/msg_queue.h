@@ -1,36 +1,112 @@
 /**
  * @file msg_queue.h
- * @brief Message queue struct definition and related functions
+ * @brief Message queue structs and related functions
+ * @details The queue is a ring of slots indexed by global sequence number,
+ * written by one producer at a time and read by any number of receivers, each
+ * with its own cursor. Readers never take a lock unless they have caught up and
+ * need to sleep. Once the ring is full, the producer waits for the oldest
+ * message to be sent to every receiver (or expire) unless overwriting is
+ * enabled.
  */
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
-#include <sys/queue.h>
 #include <pthread.h>
 
-#include "bitmask.h"
+#define MSG_EXPIRED (1u << 31)  ///< slot state flag: the message has expired
+#define MSG_UNCLAIMED_MASK (MSG_EXPIRED - 1)  ///< slot state unclaimed count bits
+#define JOIN_SPINS 128  ///< times to spin on a slot being joined before yielding the CPU
 
+/**
+ * @brief Message queue entry
+ * @details Allocated from the pool and aligned to a single cache line. Freed
+ * (along with the message data) when the last reference is released.
+ */
 struct msg_entry {
+	uint64_t seq;  ///< global sequence number (order of entry into the queue)
 	struct timespec timestamp;
+	struct timespec deadline;  ///< time the entry expires (timestamp + TTL)
 	struct ctmp_msg *msg;  ///< CTMP message structure to broadcast
+	int pipe_fd;  ///< pipe holding a copy of the frame for splice fan-out (-1 if none)
 	/**
-	 * @brief bitmask representing which workers have sent this message
-	 * @details 64 bits so max 64 workers at any time
+	 * @brief number of references to the entry
+	 * @details One per receiver that has yet to claim the message plus one
+	 * per send in progress: the entry is freed when this drops to 0
 	 */
-	uint64_t *sent;
-	pthread_rwlock_t sent_lock;  ///< read/write lock for `sent`
-	TAILQ_ENTRY(msg_entry) entries;  ///< prev + next pointers for queue
+	_Atomic int refs;
+	uint64_t parse_tick;  ///< latency clock tick the message was parsed at (0 if not tracked)
+} __attribute__((aligned(64)));
+
+/**
+ * @brief Message queue ring slot
+ * @details Reused every time the ring wraps around. `state` combines the lap
+ * of the ring the slot was last written in (upper 32 bits) with the number of
+ * receivers that have yet to claim its entry and the `MSG_EXPIRED` flag (lower
+ * 32 bits), so a claim on a slot that has since been reused always fails.
+ * The other fields are read without a lock, checking the lap before and after
+ * (a seqlock), so they are atomic.
+ */
+struct msg_slot {
+	_Atomic uint64_t state;
+	struct msg_entry *_Atomic entry;  ///< entry written in the slot's current lap
+	_Atomic int64_t timestamp_ns;  ///< time the entry entered the queue (nanoseconds)
+	_Atomic int64_t deadline_ns;  ///< time the entry expires (nanoseconds)
+	_Atomic uint64_t offset;  ///< total length of the frames that entered the queue before the entry
+	uint64_t enqueue_tick;  ///< latency clock tick the entry entered the queue at (0 if not tracked)
+} __attribute__((aligned(64)));
+
+/**
+ * @brief Message queue
+ */
+struct msg_ring {
+	struct msg_slot *slots;
+	uint64_t mask;  ///< number of slots - 1 (a power of 2)
+	int lap_shift;  ///< log2(number of slots)
+	uint32_t retain;  ///< references the ring holds to each message until it expires (1 with retention, otherwise 0)
+	bool overwrite;  ///< overwrite messages still due to receivers once the ring is full, rather than wait for them?
+	/**
+	 * @brief sequence number of the next message to enter the queue
+	 * @details Messages `[tail - number of slots, tail)` are in the ring
+	 */
+	_Atomic uint64_t tail;
+	_Atomic uint64_t tail_offset;  ///< total length of the frames that have entered the queue
+	_Atomic uint64_t overwritten;  ///< messages overwritten before every receiver claimed them
+	_Atomic uint64_t full;  ///< times a producer waited for the oldest message to be released
+	_Atomic int full_waiters;  ///< producers waiting in `wait_for_free_slots()`
+	pthread_mutex_t full_lock;  ///< protects waits on `full_cond`
+	pthread_cond_t full_cond;  ///< signalled when a message is released while producers wait
 };
-TAILQ_HEAD(msg_queue, msg_entry);
-
-void init_msg_entry(struct msg_entry **entry, struct ctmp_msg *msg,
-		int num_threads);
-void free_msg_data(struct msg_entry **entry, pthread_mutex_t *msg_lock);
-struct msg_entry *get_msg_entry(struct msg_queue *head, pthread_mutex_t *lock,
-		pthread_cond_t *cond, struct msg_entry *current,
-		struct msg_entry *prev, bool to_start);
-
-bool is_sent(struct msg_entry *entry, int thread_index);
-void set_sent(struct msg_entry *entry, int thread_index, bool val);
-bool can_forward(struct msg_entry *entry, int thread_index,
-		struct timespec recv_start);
+
+void init_msg_ring(struct msg_ring *ring, size_t num_slots, bool retain,
+		bool overwrite, uint64_t first_seq);
+void init_msg_entry(struct msg_entry **entry, struct ctmp_msg *msg, int ttl);
+uint64_t wait_for_free_slots(struct msg_ring *ring, int num_entries,
+		pthread_mutex_t *lock);
+void append_msg_entries(struct msg_ring *ring, struct msg_entry **entries,
+		int num_entries, uint32_t num_receivers, uint32_t *num_subscribers,
+		uint64_t tick);
+uint64_t queue_mem_usage(void);
+void wait_for_mem_usage(uint64_t low_water);
+uint64_t ring_tail(struct msg_ring *ring);
+uint64_t ring_head(struct msg_ring *ring, uint64_t tail);
+uint64_t wait_for_msgs(struct msg_ring *ring, uint64_t seq,
+		pthread_mutex_t *lock, pthread_cond_t *cond, _Atomic bool *stop);
+uint64_t wait_for_msgs_until(struct msg_ring *ring, uint64_t seq,
+		pthread_mutex_t *lock, pthread_cond_t *cond,
+		struct timespec *deadline);
+
+void release_msg(struct msg_entry *entry, int count);
+void hold_msg(struct msg_entry *entry);
+
+struct msg_entry *claim_msg(struct msg_ring *ring, uint64_t seq);
+uint64_t msg_enqueue_tick(struct msg_ring *ring, uint64_t seq);
+bool peek_msg(struct msg_ring *ring, uint64_t seq, struct timespec *timestamp,
+		uint64_t *offset);
+bool msg_pending(struct msg_ring *ring, uint64_t seq, struct timespec *deadline);
+int expire_msg(struct msg_ring *ring, uint64_t seq);
+void drop_pending_msgs(struct msg_ring *ring, uint64_t seq, uint64_t end_seq);
+uint64_t join_retained_msgs(struct msg_ring *ring, uint64_t seq,
+		uint64_t end_seq);
+uint64_t find_msg_by_time(struct msg_ring *ring, struct timespec *time);
@@ -0,0 +1,265 @@
+/**
+ * @file pool.c
+ * @brief Size-classed slab allocator for message frames and queue entries
+ * @details Size classes are powers of two and 1.5x powers of two, so at most a
+ * third of an object is wasted. Memory is mapped in chunks of
+ * `POOL_CHUNK_SIZE` bytes (optionally backed by huge pages) which are split into
+ * objects of a single size class. Freed objects are kept for reuse in their
+ * chunk; once every object in a chunk is free, the chunk is unmapped (beyond
+ * `POOL_SPARE_CHUNKS` per size class), so resident memory follows the number
+ * of objects in use rather than its peak.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "affinity.h"
+#include "log.h"
+
+static struct size_class classes[NUM_SIZE_CLASSES];  ///< pool size classes
+static bool use_huge_pages = false;  ///< back chunks with huge pages?
+static int pool_node = -1;  ///< NUMA node to place chunks on (-1 = first touch)
+
+/**
+ * @brief Initialise the pool size classes
+ * @param huge_pages whether to try to back the pool with huge pages
+ * @param node NUMA node to place pool memory on (-1: the node of the thread
+ * that first touches it)
+ */
+void init_pool(bool huge_pages, int node)
+{
+	size_t size = CACHE_LINE_SIZE;
+
+	use_huge_pages = huge_pages;
+	pool_node = node;
+
+	/* 64, 128, 192, 256, 384, 512, 768, ... */
+	for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+		classes[i].size = size;
+		classes[i].partial = NULL;
+		classes[i].empty = NULL;
+		classes[i].num_empty = 0;
+		pthread_mutex_init(&classes[i].lock, NULL);
+
+		if (size < 2 * CACHE_LINE_SIZE || (size & (size - 1)) != 0) {
+			/* power of two next */
+			size = 1UL << (64 - __builtin_clzl(size));
+		} else {
+			size += size / 2;
+		}
+	}
+}
+
+/**
+ * @brief Find the size class for a given object size
+ * @param size object size in bytes
+ * @return size class
+ */
+struct size_class *find_size_class(size_t size)
+{
+	for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+		if (size <= classes[i].size) {
+			return &classes[i];
+		}
+	}
+
+	pr_err("pool: no size class for %zu-byte object\n", size);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Map a new pool chunk
+ * @return start of chunk, aligned to `POOL_CHUNK_SIZE` (exits on failure)
+ * @details Falls back to (transparent huge page-advised) regular pages if huge
+ * pages were requested but none are available. Regular pages are over-mapped
+ * and trimmed to align the chunk. The chunk is placed on the pool's NUMA node
+ * (if set) before it is first touched.
+ */
+void *map_chunk(void)
+{
+	unsigned char *chunk = MAP_FAILED, *start;
+	size_t head;
+
+	if (use_huge_pages) {
+		chunk = mmap(NULL, POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (chunk == MAP_FAILED) {
+			pr_err("pool: no huge pages available, using regular pages\n");
+			use_huge_pages = false;
+		} else if ((uintptr_t) chunk & (POOL_CHUNK_SIZE - 1)) {
+			pr_err("pool: huge pages larger than a chunk, using regular pages\n");
+			munmap(chunk, POOL_CHUNK_SIZE);
+			chunk = MAP_FAILED;
+			use_huge_pages = false;
+		}
+	}
+
+	if (chunk == MAP_FAILED) {
+		start = mmap(NULL, 2 * POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (start == MAP_FAILED) {
+			p_error("mmap", errno);
+			exit(errno);
+		}
+
+		/* unmap either side of the aligned chunk */
+		head = -(uintptr_t) start & (POOL_CHUNK_SIZE - 1);
+		chunk = start + head;
+		if (head > 0) {
+			munmap(start, head);
+		}
+		munmap(chunk + POOL_CHUNK_SIZE, POOL_CHUNK_SIZE - head);
+		madvise(chunk, POOL_CHUNK_SIZE, MADV_HUGEPAGE);
+	}
+	bind_to_node(chunk, POOL_CHUNK_SIZE, pool_node);
+
+	return chunk;
+}
+
+/**
+ * @brief Get the chunk a pool object belongs to
+ * @param obj object allocated from the pool
+ * @return chunk header
+ */
+static inline struct pool_chunk *obj_chunk(void *obj)
+{
+	return (struct pool_chunk *) ((uintptr_t) obj & ~(uintptr_t) (POOL_CHUNK_SIZE - 1));
+}
+
+/**
+ * @brief Add a chunk to the front of a chunk list
+ * @param list chunk list
+ * @param chunk chunk to add
+ */
+static void push_chunk(struct pool_chunk **list, struct pool_chunk *chunk)
+{
+	chunk->prev = NULL;
+	chunk->next = *list;
+	if (*list) {
+		(*list)->prev = chunk;
+	}
+	*list = chunk;
+}
+
+/**
+ * @brief Remove a chunk from a chunk list
+ * @param list chunk list
+ * @param chunk chunk to remove (on `list`)
+ */
+static void unlink_chunk(struct pool_chunk **list, struct pool_chunk *chunk)
+{
+	if (chunk->prev) {
+		chunk->prev->next = chunk->next;
+	} else {
+		*list = chunk->next;
+	}
+	if (chunk->next) {
+		chunk->next->prev = chunk->prev;
+	}
+}
+
+/**
+ * @brief Refill a size class with a new chunk
+ * @param class size class to refill (lock held by caller)
+ * @details Objects start after the chunk header, in the chunk's first cache
+ * line. The new chunk goes on the `partial` list: none of its objects are in
+ * use yet, but one is about to be allocated.
+ */
+void refill_size_class(struct size_class *class)
+{
+	struct pool_chunk *chunk = map_chunk();
+
+	chunk->free_list = NULL;
+	chunk->num_objs = (POOL_CHUNK_SIZE - CACHE_LINE_SIZE) / class->size;
+	chunk->num_free = chunk->num_objs;
+	chunk->num_unused = chunk->num_objs;
+	push_chunk(&class->partial, chunk);
+}
+
+/**
+ * @brief Allocate an object from the pool
+ * @param size object size in bytes (at most `MAX_POOL_OBJ_SIZE`)
+ * @return pointer to object, aligned to `CACHE_LINE_SIZE` (exits on failure)
+ * @details Served from partly used chunks first, so that spare chunks stay
+ * completely free and can be unmapped
+ */
+void *pool_alloc(size_t size)
+{
+	void *obj;
+	struct size_class *class = find_size_class(size);
+	struct pool_chunk *chunk;
+
+	pthread_mutex_lock(&class->lock);
+	if (!class->partial) {
+		if (class->empty) {
+			chunk = class->empty;
+			unlink_chunk(&class->empty, chunk);
+			class->num_empty--;
+			push_chunk(&class->partial, chunk);
+		} else {
+			refill_size_class(class);
+		}
+	}
+	chunk = class->partial;
+
+	if (chunk->free_list) {
+		obj = chunk->free_list;
+		chunk->free_list = *(void **) obj;
+	} else {
+		obj = (unsigned char *) chunk + CACHE_LINE_SIZE
+			+ (chunk->num_objs - chunk->num_unused) * class->size;
+		chunk->num_unused--;
+	}
+	if (--chunk->num_free == 0) {
+		unlink_chunk(&class->partial, chunk);
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	return obj;
+}
+
+/**
+ * @brief Return an object to the pool
+ * @param obj object to free (NULL is ignored)
+ * @param size size the object was allocated with
+ * @details If that leaves its chunk completely free, the chunk is kept as a
+ * spare or, if the size class already has `POOL_SPARE_CHUNKS` of them,
+ * unmapped
+ */
+void pool_free(void *obj, size_t size)
+{
+	struct size_class *class;
+	struct pool_chunk *chunk, *unmap = NULL;
+
+	if (!obj) {
+		return;
+	}
+
+	class = find_size_class(size);
+	chunk = obj_chunk(obj);
+	pthread_mutex_lock(&class->lock);
+	*(void **) obj = chunk->free_list;
+	chunk->free_list = obj;
+
+	if (chunk->num_free++ == 0) {
+		/* was completely used */
+		push_chunk(&class->partial, chunk);
+	}
+	if (chunk->num_free == chunk->num_objs) {
+		unlink_chunk(&class->partial, chunk);
+		if (class->num_empty < POOL_SPARE_CHUNKS) {
+			push_chunk(&class->empty, chunk);
+			class->num_empty++;
+		} else {
+			unmap = chunk;
+		}
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	if (unmap) {
+		munmap(unmap, POOL_CHUNK_SIZE);
+	}
+}
@@ -0,0 +1,52 @@
+/**
+ * @file pool.h
+ * @brief Constants, structs, and functions for the size-classed memory pool
+ * @details Message frames and queue entries are allocated from the pool so that
+ * steady-state ingest does not need to call `malloc()` or `free()`
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define CACHE_LINE_SIZE 64  ///< alignment (and minimum size) of pool objects
+#define POOL_CHUNK_SIZE (2 * 1024 * 1024)  ///< memory mapped per refill (one huge page)
+#define MAX_POOL_OBJ_SIZE (96 * 1024)  ///< largest size class (fits a maximum-length frame)
+#define NUM_SIZE_CLASSES 21  ///< number of size classes from 64 bytes to 96 KiB
+#define POOL_SPARE_CHUNKS 1  ///< completely free chunks each size class keeps mapped rather than unmapping
+
+/**
+ * @brief Pool chunk header
+ * @details Stored in the first cache line of each chunk (chunks are aligned to
+ * `POOL_CHUNK_SIZE`, so an object's chunk is found from its address). Free
+ * objects form a singly linked list (each free object stores a pointer to the
+ * next one in its first bytes); objects that have never been allocated are
+ * handed out in address order, so their pages are only touched once needed.
+ */
+struct pool_chunk {
+	struct pool_chunk *prev;  ///< previous chunk in the size class's list
+	struct pool_chunk *next;  ///< next chunk in the size class's list
+	void *free_list;  ///< first freed object
+	size_t num_free;  ///< number of objects not in use (freed or never allocated)
+	size_t num_unused;  ///< number of objects never allocated (at the end of the chunk)
+	size_t num_objs;  ///< number of objects in the chunk
+};
+
+/**
+ * @brief Pool size class
+ * @details Chunks with some objects in use and some free are kept on the
+ * `partial` list, which allocations are served from first; completely free ones
+ * on the `empty` list, up to `POOL_SPARE_CHUNKS` of them; completely used ones
+ * on neither.
+ */
+struct size_class {
+	size_t size;  ///< object size in bytes (multiple of `CACHE_LINE_SIZE`)
+	struct pool_chunk *partial;  ///< first partly used chunk
+	struct pool_chunk *empty;  ///< first completely free chunk
+	int num_empty;  ///< number of chunks on the `empty` list
+	pthread_mutex_t lock;  ///< lock for the chunk lists and their objects
+};
+
+void init_pool(bool huge_pages, int node);
+void *pool_alloc(size_t size);
+void pool_free(void *obj, size_t size);
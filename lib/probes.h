@@ -0,0 +1,43 @@
+/**
+ * @file probes.h
+ * @brief Static (USDT) tracepoints on the message path
+ * @details Built on `<sys/sdt.h>` (systemtap-sdt-dev) where available: each
+ * probe compiles to a single `nop` and a note in the binary, so perf or
+ * bpftrace can attach to it in production, e.g.
+ *
+ *     bpftrace -e 'usdt:./ws_server:wirestorm:msg_parsed { @len = hist(arg0); }'
+ *
+ * (`msg_parsed` and `msg_queued` fire in `ws_server` itself; `msg_picked` and
+ * `msg_sent` in `ws_server` with worker threads and in `libwirestorm.so` with
+ * egress threads).
+ *
+ * Probes (provider `wirestorm`):
+ *
+ * | probe        | arguments                                  |
+ * |--------------|--------------------------------------------|
+ * | `msg_parsed` | message length, source fd                  |
+ * | `msg_queued` | sequence number, message length            |
+ * | `msg_picked` | sequence number, receiver fd               |
+ * | `msg_sent`   | sequence number, receiver fd               |
+ *
+ * Without `<sys/sdt.h>`, probes compile to nothing.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define PROBE_MSG_PARSED(len, fd) DTRACE_PROBE2(wirestorm, msg_parsed, len, fd)
+#define PROBE_MSG_QUEUED(seq, len) DTRACE_PROBE2(wirestorm, msg_queued, seq, len)
+#define PROBE_MSG_PICKED(seq, fd) DTRACE_PROBE2(wirestorm, msg_picked, seq, fd)
+#define PROBE_MSG_SENT(seq, fd) DTRACE_PROBE2(wirestorm, msg_sent, seq, fd)
+#else
+#define PROBE_MSG_PARSED(len, fd) do { } while (0)
+#define PROBE_MSG_QUEUED(seq, len) do { } while (0)
+#define PROBE_MSG_PICKED(seq, fd) do { } while (0)
+#define PROBE_MSG_SENT(seq, fd) do { } while (0)
+#endif
@@ -0,0 +1,255 @@
+/**
+ * @file replay.c
+ * @brief Definitions of functions for receiver replay
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "msg_queue.h"
+#include "msg_log.h"
+#include "channel.h"
+#include "replay.h"
+#include "timestamp.h"
+#include "ctmp.h"
+#include "log.h"
+
+struct replay_stats replay_stats;  ///< replays served to all receivers
+
+/**
+ * @brief Get the length of the handshake a receiver is sending
+ * @param handshake handshake received so far
+ * @return number of bytes the handshake is known to span so far, -1 if the
+ * receiver is not sending a (valid) handshake
+ * @details The first byte tells replay from subscription handshakes (and
+ * profile selectors) apart, and the second the length of a subscription
+ */
+static int handshake_length(struct receiver_handshake *handshake)
+{
+	if (handshake->len == 0) {
+		return 1;
+	}
+
+	switch (handshake->buf[0]) {
+	case REPLAY_MAGIC:
+		return HANDSHAKE_LENGTH;
+	case PROFILE_MAGIC:
+		return PROFILE_SELECTOR_LENGTH;
+	case SUBSCRIBE_MAGIC:
+		if (handshake->len < SUBSCRIBE_IDS_OFFSET) {
+			return SUBSCRIBE_IDS_OFFSET;
+		} else if (handshake->buf[1] == 0
+				|| handshake->buf[1] > MAX_SUBSCRIPTIONS) {
+			return -1;
+		}
+		return SUBSCRIBE_IDS_OFFSET + 2 * handshake->buf[1];
+	default:
+		return -1;
+	}
+}
+
+/**
+ * @brief Set up a handshake to receive
+ * @param handshake handshake
+ * @param selector_only whether the receiver can only send a profile selector
+ * (no replay or subscription handshake is served)
+ */
+void init_handshake(struct receiver_handshake *handshake, bool selector_only)
+{
+	handshake->len = 0;
+	handshake->complete = false;
+	handshake->profile = -1;
+	handshake->selector_only = selector_only;
+}
+
+/**
+ * @brief Receive as much of a receiver's handshake as is available
+ * @param fd receiver socket file descriptor
+ * @param handshake handshake received so far
+ * @return 1 once the handshake has been received in full, 0 if more is to
+ * come, -1 if the receiver is not sending a handshake, other negative errno on
+ * error (or if the connection has been closed)
+ * @details Never blocks. Never reads past the end of the handshake. A profile
+ * selector is recorded, and the handshake proper is then received in its place
+ * (unless only a selector is expected).
+ */
+int recv_handshake(int fd, struct receiver_handshake *handshake)
+{
+	int len;
+	ssize_t res;
+
+	while ((len = handshake_length(handshake)) > handshake->len) {
+		res = recv(fd, &handshake->buf[handshake->len],
+				len - handshake->len, MSG_DONTWAIT);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+		} else if (res == 0) {
+			return -ECONNRESET;
+		}
+
+		handshake->len += res;
+		if (handshake->buf[0] == PROFILE_MAGIC
+				&& handshake->len == PROFILE_SELECTOR_LENGTH) {
+			handshake->profile = handshake->buf[1];
+			if (!handshake->selector_only) {
+				/* the handshake proper follows */
+				handshake->len = 0;
+			}
+		}
+	}
+
+	if (len < 0) {
+		return -1;
+	}
+
+	handshake->complete = true;
+	return 1;
+}
+
+/**
+ * @brief Wait for a receiver's handshake
+ * @param fd receiver socket file descriptor
+ * @param handshake handshake to receive (empty)
+ * @param timeout_ms how long to wait in milliseconds
+ * @return as `recv_handshake()`, 0 on timeout
+ */
+int wait_for_handshake(int fd, struct receiver_handshake *handshake,
+		int timeout_ms)
+{
+	int res;
+	struct timespec now, deadline;
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN
+	};
+
+	get_clock_time(&deadline);
+	add_time_ms(&deadline, timeout_ms);
+
+	while ((res = recv_handshake(fd, handshake)) == 0) {
+		get_clock_time(&now);
+		if (!compare_times(&now, &deadline)) {
+			break;
+		}
+		timeout_ms = (deadline.tv_sec - now.tv_sec) * 1000
+			+ (deadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+		if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+			p_error("poll", errno);
+			return -errno;
+		}
+	}
+
+	return res;
+}
+
+/**
+ * @brief Find the first message a handshake asks to replay
+ * @param ring message queue
+ * @param log message log (NULL if none)
+ * @param handshake handshake received in full
+ * @param join_seq sequence number of the first message already due to the
+ * receiver
+ * @return sequence number (`join_seq` if the handshake is invalid)
+ * @details O(1) by sequence number or number of messages, O(log n) by time
+ * (searching the log's index rather than the queue if there is a log)
+ */
+static uint64_t find_replay_start(struct msg_ring *ring, struct msg_log *log,
+		struct receiver_handshake *handshake, uint64_t join_seq)
+{
+	uint64_t val;
+	struct timespec since;
+
+	memcpy(&val, &handshake->buf[HANDSHAKE_VALUE_OFFSET], sizeof(val));
+	val = be64toh(val);
+
+	switch (handshake->buf[1]) {
+	case REPLAY_FROM_SEQ:
+		return (val < join_seq) ? val : join_seq;
+	case REPLAY_MSGS_BACK:
+		return (val < join_seq) ? join_seq - val : 0;
+	case REPLAY_MS_BACK:
+		if (log) {
+			/* log records hold wall-clock times */
+			clock_gettime(CLOCK_REALTIME, &since);
+			val = find_log_seq_by_time(log, (int64_t) since.tv_sec
+					* 1000000000 + since.tv_nsec
+					- (int64_t) (val < INT32_MAX ? val : INT32_MAX)
+					* 1000000);
+			return (val < join_seq) ? val : join_seq;
+		}
+		get_clock_time(&since);
+		add_time_ms(&since, -(int) (val < INT32_MAX ? val : INT32_MAX));
+		val = find_msg_by_time(ring, &since);
+		return (val < join_seq) ? val : join_seq;
+	default:
+		pr_err("invalid replay mode (0x%02x)\n", handshake->buf[1]);
+		return join_seq;
+	}
+}
+
+/**
+ * @brief Serve a receiver's replay handshake
+ * @param ring message queue (with retention unless there is a log)
+ * @param log message log (NULL if none)
+ * @param fd receiver socket file descriptor
+ * @param handshake handshake received from the receiver (possibly incomplete,
+ * or not a replay handshake)
+ * @param join_seq sequence number of the first message already due to the
+ * receiver (see `join_receivers()`)
+ * @param log_cursor set to the cursor of the messages to send from the log
+ * before the queue (NULL if none)
+ * @return sequence number of the first message the receiver is to visit in the
+ * queue
+ * @details Makes the messages the receiver asks for due to it and acknowledges
+ * the handshake. Returns `join_seq` straight away if no replay handshake was
+ * received in full. Without a log, messages are replayed from the queue (and
+ * those that have already expired or been overwritten are skipped); with a log,
+ * they are sent from the log up to `join_seq`, and messages deleted from the
+ * log are skipped. Either way, the replay starts from the oldest message still
+ * retained.
+ */
+uint64_t start_replay(struct msg_ring *ring, struct msg_log *log, int fd,
+		struct receiver_handshake *handshake, uint64_t join_seq,
+		struct log_cursor **log_cursor)
+{
+	uint64_t start, head, num_joined, ack_seq;
+	unsigned char ack[HANDSHAKE_LENGTH] = { REPLAY_MAGIC, REPLAY_ACK };
+
+	*log_cursor = NULL;
+	if (!handshake->complete || handshake->buf[0] != REPLAY_MAGIC) {
+		return join_seq;
+	}
+
+	start = find_replay_start(ring, log, handshake, join_seq);
+	if (log) {
+		*log_cursor = open_log_cursor(log, start, join_seq);
+		start = *log_cursor ? (*log_cursor)->seq : join_seq;
+		num_joined = join_seq - start;
+	} else {
+		head = ring_head(ring, ring_tail(ring));
+		if (start < head) {
+			start = head;
+		}
+		num_joined = join_retained_msgs(ring, start, join_seq);
+	}
+
+	/* the socket send buffer is empty: never blocks */
+	ack_seq = htobe64(start);
+	memcpy(&ack[HANDSHAKE_VALUE_OFFSET], &ack_seq, sizeof(ack_seq));
+	if (send_msg(fd, ack, sizeof(ack)) < 0) {
+		pr_err("dst connection %d: error acknowledging replay\n", fd);
+	}
+
+	atomic_fetch_add(&replay_stats.replays, 1);
+	atomic_fetch_add(&replay_stats.replayed_msgs, num_joined);
+	pr_debug("dst connection %d: replaying %lu messages from seq %lu%s\n",
+			fd, num_joined, start, *log_cursor ? " (from log)" : "");
+
+	return log ? join_seq : start;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file replay.h
+ * @brief Constants, structs, and functions for receiver replay
+ * @details With retention, the message queue keeps every message for its TTL,
+ * so a receiver can ask to be sent messages that entered the queue before it
+ * connected: from a given sequence number (to resume after a reconnect), or
+ * from a number of messages or milliseconds back. It does so by sending a
+ * handshake as soon as it connects:
+ *
+ * | byte(s) | handshake                         | acknowledgement         |
+ * |---------|-----------------------------------|-------------------------|
+ * | 0       | `REPLAY_MAGIC`                    | `REPLAY_MAGIC`          |
+ * | 1       | `enum replay_mode`                | `REPLAY_ACK`            |
+ * | 2-7     | padding (0x00)                    | padding (0x00)          |
+ * | 8-15    | sequence number, messages or ms   | first sequence number   |
+ *
+ * Values are unsigned 64-bit network-order integers. The server acknowledges
+ * a handshake with the sequence number of the first message it will send;
+ * messages are then sent in sequence order, so a receiver can keep track of
+ * the sequence number to resume from (unless messages are skipped). Receivers
+ * that send no handshake within `REPLAY_HANDSHAKE_MS` are sent new messages
+ * only, as without retention, and get no acknowledgement.
+ *
+ * Receivers may send a subscription handshake (see `channel.h`) instead, which
+ * is received the same way.
+ *
+ * Either may be preceded by a socket profile selector: `PROFILE_MAGIC` followed
+ * by an `enum socket_profile_id` (see `socket.h`). It is not acknowledged.
+ *
+ * With a message log (see `msg_log.h`), replayed messages are sent from the log
+ * instead, so the window is bounded by the log's retention rather than the TTL
+ * and survives restarts.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define REPLAY_MAGIC 0xcd  ///< replay handshake magic byte
+#define REPLAY_ACK 0x80  ///< replay handshake acknowledgement mode byte
+#define HANDSHAKE_LENGTH 16  ///< replay handshake (and acknowledgement) length
+#define MAX_HANDSHAKE_LENGTH MAX_SUBSCRIBE_LENGTH  ///< longest handshake of any kind
+#define HANDSHAKE_VALUE_OFFSET 8  ///< first byte of the handshake value: 8 bytes long
+#define REPLAY_HANDSHAKE_MS 100  ///< how long to wait for a handshake after a receiver connects
+#define PROFILE_MAGIC 0xcf  ///< socket profile selector magic byte
+#define PROFILE_SELECTOR_LENGTH 2  ///< socket profile selector length
+
+struct msg_ring;
+struct msg_log;
+struct log_cursor;
+
+/**
+ * @brief Where a receiver asks to replay from
+ */
+enum replay_mode {
+	REPLAY_FROM_SEQ = 1,  ///< from a given sequence number
+	REPLAY_MSGS_BACK = 2,  ///< from a number of messages back
+	REPLAY_MS_BACK = 3  ///< from a number of milliseconds back
+};
+
+/**
+ * @brief Handshake (replay or subscription) received (so far) from a receiver
+ */
+struct receiver_handshake {
+	unsigned char buf[MAX_HANDSHAKE_LENGTH];
+	int len;  ///< number of bytes received (not counting the profile selector)
+	bool complete;  ///< received in full?
+	int profile;  ///< socket profile selected by the receiver (-1 if none)
+	bool selector_only;  ///< only expecting a profile selector (complete once received)?
+};
+
+/**
+ * @brief Replays served to all receivers
+ */
+struct replay_stats {
+	_Atomic uint64_t replays;  ///< handshakes served
+	_Atomic uint64_t replayed_msgs;  ///< messages made due to receivers by replays
+};
+
+extern struct replay_stats replay_stats;
+
+void init_handshake(struct receiver_handshake *handshake, bool selector_only);
+int recv_handshake(int fd, struct receiver_handshake *handshake);
+int wait_for_handshake(int fd, struct receiver_handshake *handshake,
+		int timeout_ms);
+uint64_t start_replay(struct msg_ring *ring, struct msg_log *log, int fd,
+		struct receiver_handshake *handshake, uint64_t join_seq,
+		struct log_cursor **log_cursor);
@@ -4,17 +4,45 @@
  * @details Based on https://www.geeksforgeeks.org/c/socket-programming-cc
  */
 
+#define _GNU_SOURCE  /* accept4() */
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <pthread.h>
 
 #include "socket.h"
 #include "log.h"
 
+/**
+ * @brief Socket profiles (indexed by `enum socket_profile_id`)
+ */
+const struct socket_profile socket_profiles[NUM_PROFILES] = {
+	[PROFILE_DEFAULT] = {
+		.name = "default"
+	},
+	[PROFILE_LATENCY] = {
+		.name = "latency",
+		.nodelay = true,
+		.notsent_lowat = LATENCY_NOTSENT_LOWAT
+	},
+	[PROFILE_THROUGHPUT] = {
+		.name = "throughput",
+		.cork = true,
+		.sndbuf = THROUGHPUT_BUF_SIZE,
+		.rcvbuf = THROUGHPUT_BUF_SIZE
+	}
+};
+
 /**
  * @brief Set up socket server address
  * @param port server port
@@ -31,14 +59,109 @@ struct sockaddr_in server_address(int port)
 	return address;
 }
 
+/**
+ * @brief Bound how long a dead peer can go unnoticed on a socket
+ * @param fd socket file descriptor
+ * @return 0 on success, negative errno on error
+ * @details An idle connection is probed with TCP keepalives, and a connection
+ * with data left unacknowledged for `USER_TIMEOUT` milliseconds is dropped, so
+ * a peer that vanishes without closing its connection (crashed host, network
+ * partition) is reported as an error within a bounded time whether or not
+ * anything is being sent to it.
+ */
+int set_liveness_timeouts(int fd)
+{
+	int on = 1, idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL;
+	int count = KEEPALIVE_COUNT;
+	unsigned int user_timeout = USER_TIMEOUT;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0
+			|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle,
+				sizeof(idle)) < 0
+			|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+				sizeof(interval)) < 0
+			|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count,
+				sizeof(count)) < 0
+			|| setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+				&user_timeout, sizeof(user_timeout)) < 0) {
+		p_error("setsockopt", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Look up a socket profile by name
+ * @param name profile name
+ * @return `enum socket_profile_id` value, -1 if the name is not recognised
+ */
+int parse_socket_profile(const char *name)
+{
+	for (int i = 0; i < NUM_PROFILES; i++) {
+		if (strcmp(name, socket_profiles[i].name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Configure a socket according to a profile
+ * @param fd socket file descriptor (listening or connected)
+ * @param profile `enum socket_profile_id` value
+ * @return 0 on success, negative errno on error
+ * @details Every boolean option is set either way, so a connected socket can
+ * switch profiles. Buffer sizes are best set on the listening socket: the
+ * window scale of a connection is fixed by the time it has been accepted.
+ */
+int apply_socket_profile(int fd, int profile)
+{
+	const struct socket_profile *opts = &socket_profiles[profile];
+	int nodelay = opts->nodelay, cork = opts->cork;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+				sizeof(nodelay)) < 0
+			|| setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork,
+				sizeof(cork)) < 0
+			|| setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+				&opts->notsent_lowat,
+				sizeof(opts->notsent_lowat)) < 0
+			|| (opts->sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+					&opts->sndbuf, sizeof(opts->sndbuf)) < 0)
+			|| (opts->rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+					&opts->rcvbuf, sizeof(opts->rcvbuf)) < 0)) {
+		p_error("setsockopt", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Send any partial segment held back on a corked socket
+ * @param fd (corked) socket file descriptor
+ * @details Uncorking pushes out whatever is queued; the socket is corked again
+ * straight away
+ */
+void flush_socket(int fd)
+{
+	int off = 0, on = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
 /**
  * @brief Create socket server listening on a given port
  * @param port TCP port to listen on
  * @param backlog max pending connection queue length for `listen()`
+ * @param profile socket profile of the server (`enum socket_profile_id`)
  * @return pointer to `struct server_socket` (including file descriptor) on
  * success, NULL on error
  */
-struct server_socket *server_create(int port, int backlog)
+struct server_socket *server_create(int port, int backlog, int profile)
 {
 	int opt = 1;
 	struct server_socket *server;
@@ -55,13 +178,21 @@ struct server_socket *server_create(int port, int backlog)
 		goto cleanup;
 	}
 
-	/* set socket options */
-	if (setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
-				&opt, sizeof(opt))) {
+	/* set socket options (each is a separate option, not a flag) */
+	if (setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))
+			|| setsockopt(server->fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+				sizeof(opt))) {
 		p_error("setsockopt", errno);
 		goto cleanup;
 	}
 
+	/* inherited by accepted connections (buffer sizes must be set before
+	 * listen() to take effect on the window scale) */
+	if (set_liveness_timeouts(server->fd) < 0
+			|| apply_socket_profile(server->fd, profile) < 0) {
+		goto cleanup;
+	}
+
 	/* bind to port */
 	server->addr = server_address(port);
 
@@ -86,6 +217,52 @@ cleanup:
 	return NULL;
 }
 
+/**
+ * @brief Create a Unix domain socket server
+ * @param path socket path (replaced if a socket already exists there)
+ * @param backlog max pending connection queue length for `listen()`
+ * @return server socket file descriptor on success, negative errno on error
+ */
+int unix_server_create(const char *path, int backlog)
+{
+	int fd, err;
+	struct stat st;
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX
+	};
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		pr_err("socket path %s too long\n", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		p_error("socket", errno);
+		return -errno;
+	}
+
+	/* remove a socket left behind by a previous run (but nothing else) */
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		p_error("bind", errno);
+		goto cleanup;
+	}
+	if (listen(fd, backlog) < 0) {
+		p_error("listen", errno);
+		goto cleanup;
+	}
+
+	return fd;
+
+cleanup:
+	err = errno;
+	close(fd);
+	return -err;
+}
+
 /**
  * @brief Accept connection to a given socket server
  * @param server_fd server file descriptor
@@ -108,33 +285,89 @@ int server_accept(int server_fd, struct sockaddr_in address)
 }
 
 /**
- * @brief Close socket server and related objects
- * @param server pointer struct containing server file descriptor and address
- * (to be freed)
+ * @brief Accept a connection to a non-blocking socket server
+ * @param server_fd (non-blocking) server file descriptor
+ * @return new non-blocking socket file descriptor on success, negative errno
+ * on error (`-EAGAIN` if there are no pending connections)
  */
-void server_close(struct server_socket *server)
+int server_accept_nonblock(int server_fd)
 {
-	close(server->fd);
-	free(server);
+	int new_socket;
+
+	new_socket = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+	if (new_socket == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			p_error("accept4", errno);
+		}
+		return -errno;
+	}
+
+	return new_socket;
+}
+
+/**
+ * @brief Put a file descriptor into non-blocking mode
+ * @param fd file descriptor to update
+ * @return 0 on success, negative errno on error
+ */
+int set_nonblocking(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		p_error("fcntl", errno);
+		return -errno;
+	}
+
+	return 0;
 }
 
 /**
- * @brief Detect whether a socket connection is alive
+ * @brief Bound how long a blocking send on a socket may wait for buffer space
  * @param fd socket file descriptor
- * @return true if the connection is still alive, false if the client has closed
- * the connection
- * @details Based on http://stefan.buettcher.org/cs/conn_closed.html
+ * @param timeout_ms timeout in milliseconds: a send that cannot transfer any
+ * data for this long fails with `EAGAIN`
+ * @return 0 on success, negative errno on error
+ */
+int set_send_timeout(int fd, int timeout_ms)
+{
+	struct timeval timeout = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_usec = (timeout_ms % 1000) * 1000
+	};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+				sizeof(timeout)) < 0) {
+		p_error("setsockopt", errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Raise the open file limit to its hard limit
+ * @details For configurations that keep a large number of file descriptors
+ * open (frame pipes, event-driven receivers)
  */
-bool is_alive(int fd)
+void raise_fd_limit(void)
 {
-	char test_buffer;
-
-	/*
-	 * MSG_PEEK: return data without removing it from the queue
-	 * MSG_DONTWAIT: enable nonblocking
-	 *
-	 * recv() returns 0 on error
-	 */
-	return (recv(fd, &test_buffer, sizeof(test_buffer),
-				MSG_PEEK | MSG_DONTWAIT) != 0);
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/**
+ * @brief Close socket server and related objects
+ * @param server pointer struct containing server file descriptor and address
+ * (to be freed)
+ */
+void server_close(struct server_socket *server)
+{
+	close(server->fd);
+	free(server);
 }
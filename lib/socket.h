@@ -9,6 +9,38 @@
 #define SRC_PORT 33333  ///< source server port
 #define DST_PORT 44444  ///< destination server port
 
+#define KEEPALIVE_IDLE 10  ///< seconds a connection is idle before the first keepalive probe
+#define KEEPALIVE_INTERVAL 5  ///< seconds between keepalive probes
+#define KEEPALIVE_COUNT 3  ///< unanswered keepalive probes before the connection is dropped
+#define USER_TIMEOUT 30000  ///< milliseconds sent data may remain unacknowledged before the connection is dropped
+
+#define LATENCY_NOTSENT_LOWAT (16 * 1024)  ///< unsent bytes a latency-profile socket queues before reporting itself full
+#define THROUGHPUT_BUF_SIZE (4 * 1024 * 1024)  ///< socket buffer sizes of the throughput profile
+
+/**
+ * @brief Named socket profiles
+ */
+enum socket_profile_id {
+	PROFILE_DEFAULT,  ///< kernel defaults
+	PROFILE_LATENCY,  ///< send every frame straight away, keep little unsent data queued
+	PROFILE_THROUGHPUT,  ///< fill every segment, large buffers
+	NUM_PROFILES
+};
+
+/**
+ * @brief Socket options making up a profile
+ */
+struct socket_profile {
+	const char *name;
+	bool nodelay;  ///< disable Nagle's algorithm (`TCP_NODELAY`)?
+	bool cork;  ///< cork the socket (`TCP_CORK`), flushing it whenever its receiver catches up?
+	int notsent_lowat;  ///< `TCP_NOTSENT_LOWAT` (0 = system default)
+	int sndbuf;  ///< `SO_SNDBUF` (0 = leave as is)
+	int rcvbuf;  ///< `SO_RCVBUF` (0 = leave as is)
+};
+
+extern const struct socket_profile socket_profiles[NUM_PROFILES];
+
 /**
  * @struct server_socket
  * @brief Describes a socket server
@@ -19,7 +51,15 @@ struct server_socket {
 };
 
 struct sockaddr_in server_address(int port);
-struct server_socket *server_create(int port, int backlog);
+struct server_socket *server_create(int port, int backlog, int profile);
+int unix_server_create(const char *path, int backlog);
 int server_accept(int server_fd, struct sockaddr_in address);
+int server_accept_nonblock(int server_fd);
+int set_nonblocking(int fd);
+int set_liveness_timeouts(int fd);
+int set_send_timeout(int fd, int timeout_ms);
+int parse_socket_profile(const char *name);
+int apply_socket_profile(int fd, int profile);
+void flush_socket(int fd);
+void raise_fd_limit(void);
 void server_close(struct server_socket *server);
-bool is_alive(int fd);
@@ -0,0 +1,189 @@
+/**
+ * @file stats.c
+ * @brief Definitions of functions for live statistics
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "stats.h"
+#include "timestamp.h"
+#include "log.h"
+
+struct live_stats live_stats;  ///< live statistics
+
+/**
+ * @brief Set up live statistics
+ * @param num_src_threads number of source threads (each claims its own
+ * counters)
+ */
+void init_live_stats(int num_src_threads)
+{
+	live_stats.ingest = aligned_alloc(sizeof(struct ingest_counters),
+			num_src_threads * sizeof(struct ingest_counters));
+	if (!live_stats.ingest) {
+		p_error("aligned_alloc", errno);
+		exit(errno);
+	}
+	for (int i = 0; i < num_src_threads; i++) {
+		atomic_init(&live_stats.ingest[i].msgs, 0);
+		atomic_init(&live_stats.ingest[i].bytes, 0);
+		atomic_init(&live_stats.ingest[i].bad_magic, 0);
+		atomic_init(&live_stats.ingest[i].bad_checksum, 0);
+		atomic_init(&live_stats.ingest[i].bad_options, 0);
+	}
+	live_stats.num_ingest = num_src_threads;
+	atomic_init(&live_stats.next_ingest, 0);
+	atomic_init(&live_stats.cleanup.expired, 0);
+
+	pthread_mutex_init(&live_stats.lock, NULL);
+	TAILQ_INIT(&live_stats.receivers);
+	get_clock_time(&live_stats.start);
+}
+
+/**
+ * @brief Claim the counters of a new source thread
+ * @return counters, only to be written by the calling thread
+ */
+struct ingest_counters *claim_ingest_counters(void)
+{
+	int index = atomic_fetch_add(&live_stats.next_ingest, 1);
+
+	return &live_stats.ingest[index % live_stats.num_ingest];
+}
+
+/**
+ * @brief List a receiver that has joined
+ * @param fd receiver socket file descriptor
+ * @param cursor sequence number of the first message the receiver is to visit
+ * @return receiver's counters, only to be written by the thread serving it
+ */
+struct receiver_stats *add_receiver_stats(int fd, uint64_t cursor)
+{
+	struct receiver_stats *stats;
+
+	stats = aligned_alloc(sizeof(struct receiver_stats),
+			sizeof(struct receiver_stats));
+	if (!stats) {
+		p_error("aligned_alloc", errno);
+		exit(errno);
+	}
+	atomic_init(&stats->msgs, 0);
+	atomic_init(&stats->bytes, 0);
+	atomic_init(&stats->cursor, cursor);
+	stats->fd = fd;
+
+	pthread_mutex_lock(&live_stats.lock);
+	TAILQ_INSERT_TAIL(&live_stats.receivers, stats, entries);
+	pthread_mutex_unlock(&live_stats.lock);
+
+	return stats;
+}
+
+/**
+ * @brief Remove a receiver that has disconnected
+ * @param stats receiver's counters (freed)
+ */
+void remove_receiver_stats(struct receiver_stats *stats)
+{
+	pthread_mutex_lock(&live_stats.lock);
+	TAILQ_REMOVE(&live_stats.receivers, stats, entries);
+	pthread_mutex_unlock(&live_stats.lock);
+
+	free(stats);
+}
+
+/**
+ * @brief Add up the counters of every source thread
+ * @param total set to the totals
+ */
+void sum_ingest_counters(struct ingest_counters *total)
+{
+	uint64_t msgs = 0, bytes = 0, bad_magic = 0, bad_checksum = 0;
+	uint64_t bad_options = 0;
+	struct ingest_counters *counters;
+
+	for (int i = 0; i < live_stats.num_ingest; i++) {
+		counters = &live_stats.ingest[i];
+		msgs += atomic_load_explicit(&counters->msgs,
+				memory_order_relaxed);
+		bytes += atomic_load_explicit(&counters->bytes,
+				memory_order_relaxed);
+		bad_magic += atomic_load_explicit(&counters->bad_magic,
+				memory_order_relaxed);
+		bad_checksum += atomic_load_explicit(&counters->bad_checksum,
+				memory_order_relaxed);
+		bad_options += atomic_load_explicit(&counters->bad_options,
+				memory_order_relaxed);
+	}
+
+	atomic_init(&total->msgs, msgs);
+	atomic_init(&total->bytes, bytes);
+	atomic_init(&total->bad_magic, bad_magic);
+	atomic_init(&total->bad_checksum, bad_checksum);
+	atomic_init(&total->bad_options, bad_options);
+}
+
+/**
+ * @brief Work out how far a receiver lags behind
+ * @param stats receiver's counters
+ * @param tail tail sequence number of the queue
+ * @return number of messages that have entered the queue since the next one the
+ * receiver is to visit, whether or not they are due to it
+ */
+static uint64_t receiver_lag(struct receiver_stats *stats, uint64_t tail)
+{
+	uint64_t cursor = atomic_load_explicit(&stats->cursor,
+			memory_order_relaxed);
+
+	return (cursor < tail) ? tail - cursor : 0;
+}
+
+/**
+ * @brief Find the largest lag of any connected receiver
+ * @param tail tail sequence number of the queue
+ * @return number of messages (0 if there are no receivers)
+ */
+uint64_t max_receiver_lag(uint64_t tail)
+{
+	uint64_t lag, max_lag = 0;
+	struct receiver_stats *stats;
+
+	pthread_mutex_lock(&live_stats.lock);
+	TAILQ_FOREACH(stats, &live_stats.receivers, entries) {
+		lag = receiver_lag(stats, tail);
+		if (lag > max_lag) {
+			max_lag = lag;
+		}
+	}
+	pthread_mutex_unlock(&live_stats.lock);
+
+	return max_lag;
+}
+
+/**
+ * @brief Write the counters of every connected receiver as a JSON array
+ * @param out stream to write to
+ * @param tail tail sequence number of the queue (to work out each receiver's
+ * lag)
+ */
+void write_receiver_stats(FILE *out, uint64_t tail)
+{
+	bool first = true;
+	struct receiver_stats *stats;
+
+	fprintf(out, "[");
+	pthread_mutex_lock(&live_stats.lock);
+	TAILQ_FOREACH(stats, &live_stats.receivers, entries) {
+		fprintf(out, "%s\n    {\"fd\": %d, \"msgs\": %lu, \"bytes\": %lu, \"lag\": %lu}",
+				first ? "" : ",", stats->fd,
+				atomic_load_explicit(&stats->msgs,
+					memory_order_relaxed),
+				atomic_load_explicit(&stats->bytes,
+					memory_order_relaxed),
+				receiver_lag(stats, tail));
+		first = false;
+	}
+	pthread_mutex_unlock(&live_stats.lock);
+	fprintf(out, "%s]", first ? "" : "\n  ");
+}
@@ -0,0 +1,88 @@
+/**
+ * @file stats.h
+ * @brief Constants, structs, and functions for live statistics
+ * @details Counters are kept per source thread and per receiver connection,
+ * each set on its own cache line and only ever written by the thread that owns
+ * it, so counting is a plain load and store: no lock, no atomic
+ * read-modify-write and no cache line shared with another writer. Counters are
+ * only added up when someone asks for a snapshot on the stats socket, so a
+ * snapshot may be slightly behind the threads it reads from.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#define STATS_BACKLOG 8  ///< backlog of the stats socket
+#define STATS_SEND_TIMEOUT_MS 1000  ///< how long a snapshot may wait for a slow reader
+
+/**
+ * @brief Counters of a source thread
+ */
+struct ingest_counters {
+	_Atomic uint64_t msgs;  ///< valid messages received
+	_Atomic uint64_t bytes;  ///< frame bytes of valid messages (headers included)
+	_Atomic uint64_t bad_magic;  ///< headers dropped for a bad magic byte
+	_Atomic uint64_t bad_checksum;  ///< messages dropped for a bad checksum
+	_Atomic uint64_t bad_options;  ///< frames dropped for invalid options
+} __attribute__((aligned(64)));
+
+/**
+ * @brief Counters of a receiver connection
+ * @details Written by the thread serving the receiver. Listed from the moment
+ * the receiver joins until it disconnects.
+ */
+struct receiver_stats {
+	_Atomic uint64_t msgs;  ///< messages sent in full from the queue
+	_Atomic uint64_t bytes;  ///< frame bytes sent in full from the queue
+	_Atomic uint64_t cursor;  ///< sequence number of the next message to visit
+	int fd;  ///< receiver socket file descriptor
+	TAILQ_ENTRY(receiver_stats) entries;  ///< prev + next pointers for receiver list
+} __attribute__((aligned(64)));
+TAILQ_HEAD(receiver_stats_list, receiver_stats);
+
+/**
+ * @brief Counters of the cleanup thread
+ */
+struct cleanup_counters {
+	_Atomic uint64_t expired;  ///< messages expired for at least one receiver
+} __attribute__((aligned(64)));
+
+/**
+ * @brief Live statistics
+ */
+struct live_stats {
+	struct ingest_counters *ingest;  ///< one per source thread
+	int num_ingest;  ///< number of source threads
+	_Atomic int next_ingest;  ///< index of the next source thread counters to claim
+	struct cleanup_counters cleanup;
+	pthread_mutex_t lock;  ///< protects `receivers` (taken when receivers join or leave, never while sending)
+	struct receiver_stats_list receivers;  ///< connected receivers
+	struct timespec start;  ///< time the statistics were set up
+};
+
+extern struct live_stats live_stats;
+
+/**
+ * @brief Add to a counter
+ * @param counter counter (only ever written by the calling thread)
+ * @param n amount to add
+ */
+static inline void add_count(_Atomic uint64_t *counter, uint64_t n)
+{
+	atomic_store_explicit(counter,
+			atomic_load_explicit(counter, memory_order_relaxed) + n,
+			memory_order_relaxed);
+}
+
+void init_live_stats(int num_src_threads);
+struct ingest_counters *claim_ingest_counters(void);
+struct receiver_stats *add_receiver_stats(int fd, uint64_t cursor);
+void remove_receiver_stats(struct receiver_stats *stats);
+void sum_ingest_counters(struct ingest_counters *total);
+uint64_t max_receiver_lag(uint64_t tail);
+void write_receiver_stats(FILE *out, uint64_t tail);
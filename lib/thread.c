@@ -9,7 +9,6 @@
 #include <assert.h>
 
 #include "thread.h"
-#include "timestamp.h"
 #include "log.h"
 
 /**
@@ -17,7 +16,7 @@
  * @param list pointer to worker thread list struct
  * @param num_workers number of workers to set up
  * @details Allocate memory for `workers`, then initialise the state values
- * (global and per-worker) and timestamps
+ * (global and per-worker)
  */
 void init_workers(struct worker_list *list, int num_workers)
 {
@@ -30,16 +29,25 @@ void init_workers(struct worker_list *list, int num_workers)
 	}
 
 	/* initialise status mask: 0 = idle, 1 = busy */
-	list->threads_status.data = 0;
-	pthread_mutex_init(&list->threads_status.lock, NULL);
+	atomic_init(&list->threads_status.data, 0);
+
+	/* initialise pending client queue */
+	list->pending.head = 0;
+	list->pending.len = 0;
+	pthread_mutex_init(&list->pending.lock, NULL);
 
 	/* initialise thread states */
 	for (int i = 0; i < list->num_workers; i++) {
 		/* each worker thread is aware of their thread index */
 		list->workers[i].args.thread_index = i;
-
-		/* timestamp so that older messages are not sent */
-		get_clock_time(&(list->workers)[i].args.timestamp);
+		list->workers[i].args.pipe[0] = -1;
+		list->workers[i].args.pipe[1] = -1;
+		list->workers[i].args.ring = NULL;
+		list->workers[i].args.zc = NULL;
+
+		list->workers[i].args.start_seq = 0;
+		list->workers[i].args.conn_id = 0;
+		atomic_init(&list->workers[i].args.hung_up, false);
 		list->workers[i].status = THREAD_AVAILABLE;
 		list->workers[i].args.self_status = &(list->workers[i]).status;
 		list->workers[i].args.threads_status = &list->threads_status;
@@ -47,29 +55,71 @@ void init_workers(struct worker_list *list, int num_workers)
 }
 
 /**
- * @brief Find an idle thread
+ * @brief Find an idle thread and mark it busy
  * @param list pointer to worker thread list struct
  * @details A "idle" thread is either "available" (space exists but not yet
- * created) or "ready" (thread created and waiting).
- * @return Thread index of idle worker thread on success, -1 on error
+ * created) or "ready" (thread created and waiting). Lock-free.
+ * @return Thread index of the claimed worker thread on success, -1 if all
+ * threads are busy
  */
-int find_idle_thread(struct worker_list *list)
+int claim_idle_thread(struct worker_list *list)
 {
-	bool is_idle;
-
-	/* iterate through bits in the status bitmask */
-	for (int i = 0; i < list->num_workers; i++) {
-		pthread_mutex_lock(&list->threads_status.lock);
-		is_idle = !(is_set(&list->threads_status.data, i));
-		pthread_mutex_unlock(&list->threads_status.lock);
+	return claim_first_clear(&list->threads_status.data, list->num_workers);
+}
 
-		if (is_idle) {
-			return i;
+/**
+ * @brief Queue a client until a thread becomes idle
+ * @param list pointer to worker thread list struct
+ * @param client_fd client file descriptor
+ * @return index of a thread that went idle in the meantime (claimed: assign it
+ * the client instead of queueing it), -1 if the client was queued, `-ENOSPC`
+ * if the queue is full
+ */
+int queue_client(struct worker_list *list, int client_fd)
+{
+	int thread_index;
+	struct pending_clients *pending = &list->pending;
+
+	pthread_mutex_lock(&pending->lock);
+	thread_index = claim_idle_thread(list);
+	if (thread_index < 0) {
+		if (pending->len == MAX_PENDING_CLIENTS) {
+			thread_index = -ENOSPC;
+		} else {
+			pending->fds[(pending->head + pending->len++)
+				% MAX_PENDING_CLIENTS] = client_fd;
 		}
 	}
+	pthread_mutex_unlock(&pending->lock);
 
-	/* all threads are busy */
-	return -1;
+	return thread_index;
+}
+
+/**
+ * @brief Take the next queued client, or mark a thread idle if there is none
+ * @param list pointer to worker thread list struct
+ * @param thread_index index of the thread that has finished with its client
+ * @return file descriptor of the oldest queued client (the thread stays busy),
+ * -1 if none is queued (the thread is now idle)
+ * @details The thread's own status must already be "ready", so that it can be
+ * woken up as soon as it is marked idle
+ */
+int next_pending_client(struct worker_list *list, int thread_index)
+{
+	int client_fd = -1;
+	struct pending_clients *pending = &list->pending;
+
+	pthread_mutex_lock(&pending->lock);
+	if (pending->len > 0) {
+		client_fd = pending->fds[pending->head];
+		pending->head = (pending->head + 1) % MAX_PENDING_CLIENTS;
+		pending->len--;
+	} else {
+		clear_bit_atomic(&list->threads_status.data, thread_index);
+	}
+	pthread_mutex_unlock(&pending->lock);
+
+	return client_fd;
 }
 
 /**
@@ -77,11 +127,12 @@ int find_idle_thread(struct worker_list *list)
  * @param list pointer to worker thread list struct
  * @param thread_index index of thread to use
  * @param client_fd client file descriptor to use
- * @param client_ts client timestamp to use
- * @details A worker thread is ready to be created after this function completes
+ * @param start_seq sequence number of the first message due to the client
+ * @details The thread must have been claimed with `claim_idle_thread()`. A
+ * worker thread is ready to be created after this function completes.
  */
 void init_thread_info(struct worker_list *list, int thread_index,
-		int client_fd, struct timespec client_ts)
+		int client_fd, uint64_t start_seq)
 {
 	struct worker *thread;
 	thread = &(list->workers[thread_index]);
@@ -89,16 +140,7 @@ void init_thread_info(struct worker_list *list, int thread_index,
 	/* initialise thread arguments */
 	pthread_mutex_init(&thread->args.lock, NULL);
 	pthread_cond_init(&thread->args.cond, NULL);
-	thread->args.client_fd = client_fd;
-
-	// thread->status = THREAD_BUSY;
-	*(thread->args.self_status) = THREAD_BUSY;
-
-	pthread_mutex_lock(&list->threads_status.lock);
-	set_bit(&list->threads_status.data, thread_index, true);
-	pthread_mutex_unlock(&list->threads_status.lock);
-
-	thread->args.timestamp = client_ts;
+	set_thread_client(&thread->args, client_fd, start_seq);
 }
 
 /**
@@ -106,12 +148,13 @@ void init_thread_info(struct worker_list *list, int thread_index,
  * @param list pointer to worker thread list struct
  * @param thread_index index of thread to update
  * @param client_fd new client file descriptor to set
- * @param client_ts new client timestamp to set
- * @details Update thread arguments and status then `pthread_cond_signal()` to
- * alert the corresponding thread of its new work
+ * @param start_seq sequence number of the first message due to the new client
+ * @details The thread must have been claimed with `claim_idle_thread()`.
+ * Update thread arguments and status then `pthread_cond_signal()` to alert the
+ * corresponding thread of its new work
  */
 void wake_up_thread(struct worker_list *list, int thread_index,
-		int client_fd, struct timespec client_ts)
+		int client_fd, uint64_t start_seq)
 {
 	struct worker *thread;
 
@@ -121,21 +164,28 @@ void wake_up_thread(struct worker_list *list, int thread_index,
 
 	/* thread already exists: update status and arguments */
 	pthread_mutex_lock(&thread->args.lock);
-
-	/* set new client file descriptor */
-	thread->args.client_fd = client_fd;
-
-	/* update status fields (per-thread and global) */
-	thread->status = THREAD_BUSY;
-	thread->args.self_status = &thread->status;
-	pthread_mutex_lock(&list->threads_status.lock);
-	set_bit(&list->threads_status.data, thread_index, true);
-	pthread_mutex_unlock(&list->threads_status.lock);
-
-	/* update timestamp */
-	thread->args.timestamp = client_ts;
+	set_thread_client(&thread->args, client_fd, start_seq);
 
 	/* signal to thread that there's new work */
 	pthread_cond_signal(&thread->args.cond);
 	pthread_mutex_unlock(&thread->args.lock);
 }
+
+/**
+ * @brief Set a worker thread's new client and mark the thread busy
+ * @param args worker thread arguments
+ * @param client_fd new client file descriptor
+ * @param start_seq sequence number of the first message due to the client
+ * @details Called with the thread's lock held once the thread is running. Also
+ * called by the thread itself when it takes a queued client.
+ */
+void set_thread_client(struct worker_args *args, int client_fd,
+		uint64_t start_seq)
+{
+	args->client_fd = client_fd;
+	args->conn_id++;
+	atomic_store(&args->hung_up, false);
+	args->start_seq = start_seq;
+
+	*(args->self_status) = THREAD_BUSY;
+}
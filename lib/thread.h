@@ -5,19 +5,39 @@
  */
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <time.h>
 
 #include "bitmask.h"
 
+struct uring;
+struct zc_socket;
+struct subscription;
+struct receiver_stats;
+
 #define THREAD_AVAILABLE 0  ///< Thread has not yet been created
 #define THREAD_BUSY 1 ///< Thread is working
 #define THREAD_READY 2 ///< Thread has been created and is not working
 
+#define MAX_PENDING_CLIENTS 1024  ///< maximum number of clients waiting for a thread
+
 /**
  * @brief Bitmask for storing status of all worker threads
+ * @details Lock-free: idle threads are claimed with an atomic find-first-set
  */
 struct status_mask {
-	uint64_t data;
+	_Atomic uint64_t data;
+};
+
+/**
+ * @brief Bounded FIFO queue of clients accepted while every thread was busy
+ * @details `lock` also serialises queueing a client against a thread going
+ * idle, so a client is never left queued while a thread is idle
+ */
+struct pending_clients {
+	int fds[MAX_PENDING_CLIENTS];  ///< client file descriptors (circular buffer)
+	int head;  ///< index of the oldest client
+	int len;  ///< number of clients queued
 	pthread_mutex_t lock;
 };
 
@@ -27,9 +47,17 @@ struct status_mask {
  * `self_status` has three possible values (available, busy, and ready)
  */
 struct worker_args {
-	int client_fd;  ///< file descriptor to send messages to
+	int client_fd;  ///< file descriptor to send messages to (-1 once closed; read by other threads under `lock`)
 	int thread_index;  ///< thread's own index
-	struct timespec timestamp;  ///< time the client was accepted
+	uint64_t start_seq;  ///< sequence number of the first message due to the client
+	uint32_t conn_id;  ///< number of clients assigned to the thread so far (identifies the current one)
+	_Atomic bool hung_up;  ///< set when the client disconnects (see `run_liveness_monitor()`)
+	int pipe[2];  ///< pipe for splice fan-out (-1 if not in use)
+	struct uring *ring;  ///< io_uring for batched sends (NULL if not in use)
+	struct zc_socket *zc;  ///< zero-copy send state of the client (NULL if not in use)
+	struct subscription *sub;  ///< channels the client is subscribed to
+	bool corked;  ///< client socket corked by its profile: flushed whenever the client catches up
+	struct receiver_stats *stats;  ///< counters of the current client
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
 	int *self_status;  ///< own thread status (pointer to `worker` status)
@@ -44,14 +72,19 @@ struct worker {
 
 struct worker_list {
 	struct status_mask threads_status;
+	struct pending_clients pending;
 	int num_workers;
 	struct worker *workers;
 };
 
 void init_workers(struct worker_list *list, int num_workers);
-int find_idle_thread(struct worker_list *workers);
+int claim_idle_thread(struct worker_list *list);
+int queue_client(struct worker_list *list, int client_fd);
+int next_pending_client(struct worker_list *list, int thread_index);
 
 void init_thread_info(struct worker_list *list, int thread_index,
-		int client_fd, struct timespec client_ts);
+		int client_fd, uint64_t start_seq);
 void wake_up_thread(struct worker_list *list, int thread_index,
-		int client_fd, struct timespec client_ts);
+		int client_fd, uint64_t start_seq);
+void set_thread_client(struct worker_args *args, int client_fd,
+		uint64_t start_seq);
@@ -31,3 +31,42 @@ bool compare_times(struct timespec *lhs, struct timespec *rhs)
 		return (lhs->tv_sec < rhs->tv_sec);
 	}
 }
+
+/**
+ * @brief Add a number of milliseconds to a `struct timespec` timestamp
+ * @param timestamp timestamp to update
+ * @param ms number of milliseconds to add (may be negative)
+ */
+void add_time_ms(struct timespec *timestamp, int ms)
+{
+	timestamp->tv_sec += ms / 1000;
+	timestamp->tv_nsec += (long) (ms % 1000) * 1000000;
+	if (timestamp->tv_nsec >= 1000000000) {
+		timestamp->tv_sec++;
+		timestamp->tv_nsec -= 1000000000;
+	} else if (timestamp->tv_nsec < 0) {
+		timestamp->tv_sec--;
+		timestamp->tv_nsec += 1000000000;
+	}
+}
+
+/**
+ * @brief Convert a `struct timespec` timestamp to nanoseconds
+ * @param timestamp timestamp to convert
+ * @return number of nanoseconds
+ */
+int64_t time_to_ns(struct timespec *timestamp)
+{
+	return (int64_t) timestamp->tv_sec * 1000000000 + timestamp->tv_nsec;
+}
+
+/**
+ * @brief Convert nanoseconds to a `struct timespec` timestamp
+ * @param ns number of nanoseconds (not negative)
+ * @param timestamp timestamp to set
+ */
+void ns_to_time(int64_t ns, struct timespec *timestamp)
+{
+	timestamp->tv_sec = ns / 1000000000;
+	timestamp->tv_nsec = ns % 1000000000;
+}
@@ -4,7 +4,11 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 void get_clock_time(struct timespec *timestamp);
 bool compare_times(struct timespec *lhs, struct timespec *rhs);
+void add_time_ms(struct timespec *timestamp, int ms);
+int64_t time_to_ns(struct timespec *timestamp);
+void ns_to_time(int64_t ns, struct timespec *timestamp);
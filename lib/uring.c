@@ -0,0 +1,464 @@
+/**
+ * @file uring.c
+ * @brief Definitions of io_uring backend functions
+ * @details Ring setup and memory ordering follow `io_uring(7)`: the kernel
+ * updates the SQ head and CQ tail, we update the SQ tail and CQ head, each with
+ * release/acquire semantics.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "log.h"
+
+/**
+ * @brief Address of a given offset into a ring mapping
+ */
+#define RING_PTR(base, off) ((void *) ((unsigned char *) (base) + (off)))
+
+/**
+ * @brief Set up an io_uring instance
+ * @param ring ring to set up
+ * @param entries number of submission queue entries
+ * @return true on success, false if io_uring is unavailable
+ */
+bool uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		p_error("io_uring_setup", errno);
+		return false;
+	}
+
+	/* map submission and completion queue rings */
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED
+			|| ring->sqes == MAP_FAILED) {
+		p_error("mmap", errno);
+		if (ring->sq_ptr != MAP_FAILED) {
+			munmap(ring->sq_ptr, ring->sq_size);
+		}
+		if (ring->cq_ptr != MAP_FAILED) {
+			munmap(ring->cq_ptr, ring->cq_size);
+		}
+		if (ring->sqes != MAP_FAILED) {
+			munmap(ring->sqes, ring->sqes_size);
+		}
+		close(ring->fd);
+		return false;
+	}
+
+	ring->sq_head = RING_PTR(ring->sq_ptr, params.sq_off.head);
+	ring->sq_tail = RING_PTR(ring->sq_ptr, params.sq_off.tail);
+	ring->sq_mask = RING_PTR(ring->sq_ptr, params.sq_off.ring_mask);
+	ring->sq_array = RING_PTR(ring->sq_ptr, params.sq_off.array);
+	ring->sqe_tail = ring->sqe_head = *ring->sq_tail;
+
+	ring->cq_head = RING_PTR(ring->cq_ptr, params.cq_off.head);
+	ring->cq_tail = RING_PTR(ring->cq_ptr, params.cq_off.tail);
+	ring->cq_mask = RING_PTR(ring->cq_ptr, params.cq_off.ring_mask);
+	ring->cqes = RING_PTR(ring->cq_ptr, params.cq_off.cqes);
+
+	return true;
+}
+
+/**
+ * @brief Tear down an io_uring instance
+ * @param ring ring to tear down
+ */
+void uring_exit(struct uring *ring)
+{
+	if (ring->buf_ring) {
+		munmap(ring->buf_ring, URING_NUM_BUFS * sizeof(struct io_uring_buf));
+		free(ring->bufs);
+	}
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+/**
+ * @brief Register a ring of provided receive buffers
+ * @param ring ring to register buffers with (buffer group `URING_BGID`)
+ * @return true on success, false on failure (nothing is left allocated)
+ * @details Multishot receives pick a buffer from the ring for every
+ * completion; the buffer ID is returned in the CQE flags
+ */
+bool uring_setup_bufs(struct uring *ring)
+{
+	struct io_uring_buf_reg reg;
+	size_t ring_size = URING_NUM_BUFS * sizeof(struct io_uring_buf);
+
+	ring->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		p_error("mmap", errno);
+		ring->buf_ring = NULL;
+		return false;
+	}
+
+	ring->bufs = malloc((size_t) URING_NUM_BUFS * URING_BUF_SIZE);
+	if (!ring->bufs) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) ring->buf_ring;
+	reg.ring_entries = URING_NUM_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1) < 0) {
+		p_error("io_uring_register", errno);
+		munmap(ring->buf_ring, ring_size);
+		free(ring->bufs);
+		ring->buf_ring = NULL;
+		ring->bufs = NULL;
+		return false;
+	}
+
+	ring->buf_ring->tail = 0;
+	for (unsigned bid = 0; bid < URING_NUM_BUFS; bid++) {
+		uring_recycle_buf(ring, bid);
+	}
+
+	return true;
+}
+
+/**
+ * @brief Get a provided receive buffer
+ * @param ring ring the buffer belongs to
+ * @param bid buffer ID (from the CQE flags)
+ * @return start of buffer
+ */
+unsigned char *uring_buf(struct uring *ring, unsigned bid)
+{
+	return &ring->bufs[(size_t) bid * URING_BUF_SIZE];
+}
+
+/**
+ * @brief Give a provided receive buffer back to the kernel
+ * @param ring ring the buffer belongs to
+ * @param bid buffer ID
+ */
+void uring_recycle_buf(struct uring *ring, unsigned bid)
+{
+	struct io_uring_buf *buf;
+	unsigned short tail = ring->buf_ring->tail;
+
+	buf = &ring->buf_ring->bufs[tail & (URING_NUM_BUFS - 1)];
+	buf->addr = (unsigned long) uring_buf(ring, bid);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+
+	/* publish the buffer */
+	__atomic_store_n(&ring->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get a free submission queue entry
+ * @param ring ring to get an SQE from
+ * @return zeroed SQE, NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sqe_tail - head > *ring->sq_mask) {
+		return NULL;
+	}
+
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sq_array[ring->sqe_tail & *ring->sq_mask] =
+		ring->sqe_tail & *ring->sq_mask;
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+/**
+ * @brief Get a free submission queue entry, making room if the queue is full
+ * @param ring ring to get an SQE from
+ * @return zeroed SQE, NULL if the queue is still full
+ * @details A full queue is submitted first: without `IORING_SETUP_SQPOLL`, the
+ * kernel consumes the SQEs it is given before `io_uring_enter()` returns. Not
+ * for the middle of a linked chain, which would be split.
+ */
+struct io_uring_sqe *uring_get_free_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (!sqe && uring_submit(ring, 0) >= 0) {
+		sqe = uring_get_sqe(ring);
+	}
+
+	return sqe;
+}
+
+/**
+ * @brief Submit pending SQEs and optionally wait for completions
+ * @param ring ring to submit to
+ * @param wait_nr number of completions to wait for (0 = don't wait)
+ * @return number of SQEs submitted, negative errno on failure
+ */
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+	int res;
+	unsigned to_submit = ring->sqe_tail - ring->sqe_head;
+
+	/* make new SQEs visible to the kernel */
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	ring->sqe_head = ring->sqe_tail;
+
+	do {
+		res = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+				wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (res < 0 && errno == EINTR);
+
+	if (res < 0) {
+		p_error("io_uring_enter", errno);
+		return -errno;
+	}
+
+	return res;
+}
+
+/**
+ * @brief Get the next completion queue entry without waiting
+ * @param ring ring to get a CQE from
+ * @return next CQE, NULL if there are none (call `uring_cqe_seen()` once done
+ * with it)
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * @brief Mark the CQE returned by `uring_peek_cqe()` as consumed
+ * @param ring ring the CQE belongs to
+ */
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Prepare a multishot accept
+ * @details Posts a CQE (with `IORING_CQE_F_MORE` set while still armed) for
+ * every accepted connection
+ * @param sqe SQE to prepare
+ * @param fd server file descriptor
+ * @param user_data value returned in each CQE
+ */
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+		unsigned long long user_data)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = user_data;
+}
+
+/**
+ * @brief Prepare a multishot receive into provided buffers
+ * @details Posts a CQE for every chunk received, with the chosen buffer ID in
+ * the upper bits of the CQE flags
+ * @param sqe SQE to prepare
+ * @param fd socket file descriptor
+ * @param user_data value returned in each CQE
+ */
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+		unsigned long long user_data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = user_data;
+}
+
+/**
+ * @brief Prepare the cancellation of every request in flight
+ * @details Each cancelled request completes with `-ECANCELED`; the
+ * cancellation itself completes with the number of requests cancelled
+ * @param sqe SQE to prepare
+ * @param user_data value returned in the CQE
+ */
+void uring_prep_cancel_all(struct io_uring_sqe *sqe,
+		unsigned long long user_data)
+{
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+	sqe->user_data = user_data;
+}
+
+/**
+ * @brief Prepare a send of a whole buffer
+ * @details `MSG_WAITALL` makes the kernel retry short sends, so a linked chain
+ * of sends is never left with a partially sent frame followed by the next one
+ * @param sqe SQE to prepare
+ * @param fd socket file descriptor
+ * @param buf data to send
+ * @param len length of data
+ * @param user_data value returned in the CQE
+ */
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, void *buf,
+		size_t len, unsigned long long user_data)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = user_data;
+}
+
+/**
+ * @brief Wait for the next connection from a multishot accept
+ * @param ring ring with a multishot accept armed for `server_fd`
+ * (re-armed here if the kernel terminated it)
+ * @param server_fd server file descriptor
+ * @return new socket file descriptor on success, negative errno on error
+ * (`-EBUSY` if the accept could not be re-armed: the completion is kept for
+ * the next call)
+ */
+int uring_accept(struct uring *ring, int server_fd)
+{
+	int res;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	while (!(cqe = uring_peek_cqe(ring))) {
+		res = uring_submit(ring, 1);
+		if (res < 0) {
+			return res;
+		}
+	}
+
+	res = cqe->res;
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		/* multishot accept terminated: re-arm */
+		if (!(sqe = uring_get_free_sqe(ring))) {
+			return -EBUSY;
+		}
+		uring_prep_accept_multishot(sqe, server_fd, 0);
+	}
+	uring_cqe_seen(ring);
+
+	return res;
+}
+
+/**
+ * @brief Send a batch of frames in order with a single submission
+ * @param ring ring to submit to (with no other requests in flight)
+ * @param fd socket file descriptor
+ * @param frames frames to send (at most `URING_SEND_BATCH`)
+ * @param num_frames number of frames
+ * @return 0 on success, negative errno on failure
+ * @details Sends are linked (`IOSQE_IO_LINK`) so they complete in order. If a
+ * send fails, the rest of the chain is cancelled; any partially sent frame is
+ * finished and the cancelled frames are sent with `send()` unless the
+ * connection itself failed. Frames that do not fit in the submission queue are
+ * sent the same way.
+ */
+int uring_send_linked(struct uring *ring, int fd, struct iovec *frames,
+		int num_frames)
+{
+	int res = 0, num_queued = 0, num_done = 0, results[URING_SEND_BATCH];
+	struct io_uring_sqe *sqe, *last = NULL;
+	struct io_uring_cqe *cqe;
+	ssize_t sent;
+
+	/* the chain must go in a single submission */
+	if (ring->sqe_tail != ring->sqe_head) {
+		uring_submit(ring, 0);
+	}
+
+	for (; num_queued < num_frames; num_queued++) {
+		if (!(sqe = uring_get_sqe(ring))) {
+			break;
+		}
+		uring_prep_send(sqe, fd, frames[num_queued].iov_base,
+				frames[num_queued].iov_len, num_queued);
+		sqe->flags |= IOSQE_IO_LINK;
+		last = sqe;
+	}
+	for (int i = num_queued; i < num_frames; i++) {
+		results[i] = -ECANCELED;
+	}
+
+	if (last) {
+		/* last SQE ends the chain */
+		last->flags &= ~IOSQE_IO_LINK;
+
+		res = uring_submit(ring, num_queued);
+		if (res < 0) {
+			return res;
+		}
+	}
+
+	/* collect results in frame order */
+	while (num_done < num_queued) {
+		while (!(cqe = uring_peek_cqe(ring))) {
+			uring_submit(ring, 1);
+		}
+		results[cqe->user_data] = cqe->res;
+		uring_cqe_seen(ring);
+		num_done++;
+	}
+
+	for (int i = 0; i < num_frames; i++) {
+		if (results[i] == (int) frames[i].iov_len) {
+			continue;
+		} else if (results[i] == -ECANCELED || results[i] >= 0) {
+			/* chain broken before this frame was (fully) sent */
+			sent = (results[i] > 0) ? results[i] : 0;
+			do {
+				res = send(fd, (unsigned char *) frames[i].iov_base + sent,
+						frames[i].iov_len - sent, MSG_NOSIGNAL);
+				sent += (res > 0) ? res : 0;
+			} while ((res > 0 || (res < 0 && errno == EINTR))
+					&& (size_t) sent < frames[i].iov_len);
+			if (res <= 0) {
+				return (res < 0) ? -errno : -1;
+			}
+		} else {
+			return results[i];
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file uring.h
+ * @brief Constants, structs, and functions for the io_uring I/O backend
+ * @details A minimal io_uring interface built directly on the
+ * `io_uring_setup(2)`/`io_uring_enter(2)`/`io_uring_register(2)` system calls
+ * (no liburing dependency)
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256  ///< submission queue size
+#define URING_NUM_BUFS 64  ///< number of provided receive buffers per ring
+#define URING_BUF_SIZE (64 * 1024)  ///< size of each provided receive buffer
+#define URING_BGID 0  ///< provided buffer group ID (one group per ring)
+#define URING_SEND_BATCH 32  ///< maximum number of linked sends per submission
+
+/**
+ * @brief io_uring instance (submission and completion queue rings)
+ */
+struct uring {
+	int fd;  ///< io_uring file descriptor
+
+	unsigned *sq_head;  ///< submission queue head (updated by the kernel)
+	unsigned *sq_tail;  ///< submission queue tail
+	unsigned *sq_mask;  ///< submission queue index mask
+	unsigned *sq_array;  ///< submission queue index array
+	struct io_uring_sqe *sqes;  ///< submission queue entries
+	unsigned sqe_tail;  ///< tail including SQEs not yet made visible
+	unsigned sqe_head;  ///< tail as last made visible to the kernel
+
+	unsigned *cq_head;  ///< completion queue head
+	unsigned *cq_tail;  ///< completion queue tail (updated by the kernel)
+	unsigned *cq_mask;  ///< completion queue index mask
+	struct io_uring_cqe *cqes;  ///< completion queue entries
+
+	void *sq_ptr;  ///< submission queue ring mapping
+	size_t sq_size;  ///< size of `sq_ptr` mapping
+	void *cq_ptr;  ///< completion queue ring mapping
+	size_t cq_size;  ///< size of `cq_ptr` mapping
+	size_t sqes_size;  ///< size of `sqes` mapping
+
+	struct io_uring_buf_ring *buf_ring;  ///< provided receive buffer ring (NULL if none)
+	unsigned char *bufs;  ///< provided receive buffers (`URING_NUM_BUFS` x `URING_BUF_SIZE`)
+};
+
+bool uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+bool uring_setup_bufs(struct uring *ring);
+unsigned char *uring_buf(struct uring *ring, unsigned bid);
+void uring_recycle_buf(struct uring *ring, unsigned bid);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+struct io_uring_sqe *uring_get_free_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd,
+		unsigned long long user_data);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd,
+		unsigned long long user_data);
+void uring_prep_cancel_all(struct io_uring_sqe *sqe,
+		unsigned long long user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, void *buf,
+		size_t len, unsigned long long user_data);
+
+int uring_accept(struct uring *ring, int server_fd);
+int uring_send_linked(struct uring *ring, int fd, struct iovec *frames,
+		int num_frames);
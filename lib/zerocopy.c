@@ -0,0 +1,246 @@
+/**
+ * @file zerocopy.c
+ * @brief Definitions of functions for `MSG_ZEROCOPY` sends
+ */
+
+#define _GNU_SOURCE  /* MSG_ZEROCOPY */
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "ctmp.h"
+#include "msg_queue.h"
+#include "zerocopy.h"
+#include "log.h"
+
+struct zc_totals zc_totals;  ///< totals for all freed sockets
+static int reaper_fd = -1;  ///< epoll instance watching retired sockets for completions
+
+/**
+ * @brief Enable zero-copy sends on a socket
+ * @param fd socket file descriptor
+ * @return zero-copy state for the socket, NULL if the socket does not support
+ * `SO_ZEROCOPY` (use regular sends)
+ */
+struct zc_socket *init_zc_socket(int fd)
+{
+	int one = 1;
+	struct zc_socket *zc;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+		p_error("setsockopt", errno);
+		return NULL;
+	}
+
+	zc = calloc(1, sizeof(struct zc_socket));
+	if (!zc) {
+		p_error("calloc", errno);
+		exit(errno);
+	}
+	zc->fd = fd;
+
+	return zc;
+}
+
+/**
+ * @brief Send (the rest of) a frame with a single zero-copy send
+ * @param zc zero-copy state of the socket
+ * @param fd socket file descriptor
+ * @param entry claimed entry holding the frame
+ * @param offset number of bytes of the frame already sent
+ * @param flags additional `send()` flags
+ * @return number of bytes sent, negative errno on error
+ * @details A successful zero-copy send takes its own reference to the message,
+ * released when its completion is reaped. Falls back to a regular send if the
+ * socket already has `ZC_MAX_INFLIGHT` sends awaiting completion, or if the
+ * kernel cannot track any more (`ENOBUFS`: see `optmem_max`).
+ */
+ssize_t send_zc_msg(struct zc_socket *zc, int fd, struct msg_entry *entry,
+		size_t offset, int flags)
+{
+	ssize_t res;
+	unsigned char *frame = entry->msg->header + offset;
+	size_t len = HEADER_LENGTH + entry->msg->len - offset;
+
+	if (zc->next_id - zc->done_id == ZC_MAX_INFLIGHT
+			&& (reap_zc_completions(zc, fd) < 0
+				|| zc->next_id - zc->done_id == ZC_MAX_INFLIGHT)) {
+		goto copy;
+	}
+
+	res = send(fd, frame, len, flags | MSG_NOSIGNAL | MSG_ZEROCOPY);
+	if (res >= 0) {
+		hold_msg(entry);
+		zc->inflight[zc->next_id++ % ZC_MAX_INFLIGHT] = entry;
+		return res;
+	} else if (errno != ENOBUFS) {
+		return -errno;
+	}
+
+copy:
+	zc->copied++;
+	res = send(fd, frame, len, flags | MSG_NOSIGNAL);
+	return (res < 0) ? -errno : res;
+}
+
+/**
+ * @brief Reap the zero-copy completions queued on a socket
+ * @param zc zero-copy state of the socket
+ * @param fd socket file descriptor
+ * @return number of sends completed, negative errno if the error queue held a
+ * socket error rather than a completion
+ * @details Releases the reference each completed send held to its message
+ */
+int reap_zc_completions(struct zc_socket *zc, int fd)
+{
+	int num_completed = 0;
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err) + 64)];
+	struct msghdr hdr;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *err;
+
+	while (1) {
+		hdr = (struct msghdr) {
+			.msg_control = control,
+			.msg_controllen = sizeof(control)
+		};
+		if (recvmsg(fd, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+					&& !(cmsg->cmsg_level == SOL_IPV6
+						&& cmsg->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+			err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno) {
+				return -(err->ee_errno ? err->ee_errno : EIO);
+			}
+
+			/* completions are reported in order as a range of IDs
+			 * [ee_info, ee_data] */
+			while (zc->done_id != err->ee_data + 1
+					&& zc->done_id != zc->next_id) {
+				release_msg(zc->inflight[zc->done_id++ % ZC_MAX_INFLIGHT], 1);
+				num_completed++;
+				if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+					zc->deferred_copy++;
+				} else {
+					zc->zerocopy++;
+				}
+			}
+		}
+	}
+
+	return num_completed;
+}
+
+/**
+ * @brief Free a socket's zero-copy state and close the socket
+ * @param zc zero-copy state with no sends in flight (freed)
+ * @details The socket's counts are added to `zc_totals`
+ */
+static void free_zc_socket(struct zc_socket *zc)
+{
+	atomic_fetch_add(&zc_totals.zerocopy, zc->zerocopy);
+	atomic_fetch_add(&zc_totals.deferred_copy, zc->deferred_copy);
+	atomic_fetch_add(&zc_totals.copied, zc->copied);
+	pr_debug("dst connection %d: %lu zero-copy, %lu kernel-copied, %lu copied sends\n",
+			zc->fd, zc->zerocopy, zc->deferred_copy, zc->copied);
+
+	close(zc->fd);
+	free(zc);
+}
+
+/**
+ * @brief Release a socket's zero-copy state and close the socket
+ * @param zc zero-copy state (freed)
+ * @param fd socket file descriptor (closed: callers must not close it)
+ * @details Reaps any completions already queued. Frames of sends still in
+ * flight may still be read by the kernel (data already queued is transmitted
+ * after the connection is closed), so if there are any, the socket is kept
+ * open and handed to the reaper, which releases their references as their
+ * completions arrive and only then closes it.
+ */
+void release_zc_socket(struct zc_socket *zc, int fd)
+{
+	struct epoll_event event;
+
+	reap_zc_completions(zc, fd);
+	if (zc->done_id == zc->next_id) {
+		free_zc_socket(zc);
+		return;
+	}
+
+	pr_debug("dst connection %d: waiting for %u zero-copy completions\n",
+			fd, zc->next_id - zc->done_id);
+	/* the receiver is gone as far as it is concerned */
+	shutdown(fd, SHUT_RDWR);
+
+	/* edge-triggered: EPOLLERR fires when completions are queued (an
+	 * already queued one fires straight away) */
+	event.events = EPOLLERR | EPOLLET;
+	event.data.ptr = zc;
+	if (epoll_ctl(reaper_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		p_error("epoll_ctl", errno);
+	}
+}
+
+/**
+ * @brief Set up the reaper of retired zero-copy sockets
+ * @details Must be called before any socket is released
+ */
+void init_zc_reaper(void)
+{
+	reaper_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reaper_fd < 0) {
+		p_error("epoll_create1", errno);
+		exit(errno);
+	}
+}
+
+/**
+ * @brief Run reaper of retired zero-copy sockets
+ * @details Reap the completions of every socket released with sends still in
+ * flight as they arrive, and close each socket once the last one has (or once
+ * its connection has failed for good, when the kernel has dropped every frame
+ * it held).
+ */
+void *run_zc_reaper(void *data)
+{
+	int num_events;
+	struct zc_socket *zc;
+	struct epoll_event events[ZC_MAX_RETIRED_EVENTS];
+
+	while (1) {
+		num_events = epoll_wait(reaper_fd, events, ZC_MAX_RETIRED_EVENTS, -1);
+		if (num_events < 0) {
+			if (errno != EINTR) {
+				p_error("epoll_wait", errno);
+			}
+			continue;
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			zc = events[i].data.ptr;
+			/* a socket error (rather than a completion) is followed
+			 * by the completions of the frames the kernel dropped */
+			while (reap_zc_completions(zc, zc->fd) < 0);
+			if (zc->done_id == zc->next_id) {
+				epoll_ctl(reaper_fd, EPOLL_CTL_DEL, zc->fd, NULL);
+				free_zc_socket(zc);
+			}
+		}
+	}
+
+	return NULL;
+}
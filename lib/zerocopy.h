@@ -0,0 +1,54 @@
+/**
+ * @file zerocopy.h
+ * @brief Constants, structs, and functions for `MSG_ZEROCOPY` sends
+ * @details With `MSG_ZEROCOPY`, the kernel transmits directly from the pages of
+ * the frame instead of copying it into socket buffers. The frame must not be
+ * freed until the kernel reports (on the socket error queue) that it is done
+ * with those pages, so every zero-copy send holds a reference to its message
+ * until its completion arrives.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define ZC_MAX_INFLIGHT 256  ///< maximum number of zero-copy sends awaiting completion per socket
+#define ZC_MAX_RETIRED_EVENTS 64  ///< maximum number of events per `epoll_wait()` call of the reaper
+
+struct msg_entry;
+
+/**
+ * @brief Zero-copy send state of a socket
+ * @details The kernel numbers successful `MSG_ZEROCOPY` sends on each socket
+ * consecutively from 0, and reports completions as ranges of those IDs
+ */
+struct zc_socket {
+	int fd;  ///< socket file descriptor (kept open while retired)
+	uint32_t next_id;  ///< ID of the next zero-copy send
+	uint32_t done_id;  ///< ID of the oldest zero-copy send awaiting completion
+	struct msg_entry *inflight[ZC_MAX_INFLIGHT];  ///< entry referenced by each send in flight (by ID)
+	uint64_t zerocopy;  ///< completed sends that avoided a copy
+	uint64_t deferred_copy;  ///< completed sends the kernel copied anyway
+	uint64_t copied;  ///< sends that fell back to a copy (too many in flight)
+};
+
+/**
+ * @brief Zero-copy send totals for all sockets
+ * @details Updated when a socket is freed
+ */
+struct zc_totals {
+	_Atomic uint64_t zerocopy;
+	_Atomic uint64_t deferred_copy;
+	_Atomic uint64_t copied;
+};
+
+extern struct zc_totals zc_totals;
+
+struct zc_socket *init_zc_socket(int fd);
+ssize_t send_zc_msg(struct zc_socket *zc, int fd, struct msg_entry *entry,
+		size_t offset, int flags);
+int reap_zc_completions(struct zc_socket *zc, int fd);
+void release_zc_socket(struct zc_socket *zc, int fd);
+void init_zc_reaper(void);
+void *run_zc_reaper(void *data);
@@ -5,22 +5,46 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
 
 #include <errno.h>
+#include <endian.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
+#include "lag.h"
+#include "budget.h"
+#include "affinity.h"
 #include "args.h"
 #include "log.h"
 #include "socket.h"
 #include "ctmp.h"
 #include "msg_queue.h"
+#include "msg_log.h"
+#include "expiry.h"
+#include "pool.h"
+#include "checksum.h"
+#include "fanout.h"
+#include "uring.h"
+#include "channel.h"
+#include "replay.h"
+#include "egress.h"
+#include "zerocopy.h"
 #include "thread.h"
+#include "stats.h"
 #include "timestamp.h"
+#include "latency.h"
+#include "probes.h"
 
-#define INITIAL_DELAY 1  ///< starting delay (seconds) when waiting for idle workers
+#define MAX_SRC_EVENTS 64  ///< maximum number of events per source worker `epoll_wait()`
+#define MAX_EGRESS_EVENTS 256  ///< maximum number of events per egress worker `epoll_wait()`
+#define MAX_LIVENESS_EVENTS 64  ///< maximum number of events per liveness monitor `epoll_wait()`
+#define ENQUEUE_BATCH 64  ///< maximum number of entries added to the message queue at once
+#define SRC_CANCEL_DATA 1UL  ///< CQE user data of source worker cancellations (never a stream address)
 
 /**
  * @brief Array of client worker thread structures
@@ -30,141 +54,1208 @@
  */
 struct worker_list dst;
 
+/**
+ * @brief Message queue lock
+ * @details Serialises producers and receivers joining/leaving. Receivers only
+ * take it to sleep when they have caught up.
+ */
 pthread_mutex_t msg_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t msg_cond = PTHREAD_COND_INITIALIZER;
-struct msg_queue msg_queue_head;
+pthread_cond_t msg_cond;  ///< signalled for new messages (`CLOCK_MONOTONIC` timed waits)
+struct msg_ring msg_ring;
+uint32_t num_receivers = 0;  ///< number of connected receivers (protected by `msg_lock`)
+struct msg_log *msg_log = NULL;  ///< on-disk message log (NULL if disabled)
+
+/**
+ * @brief Array of egress worker structures
+ * @details Only allocated if receivers are served by event-driven egress
+ * threads rather than one worker thread each
+ */
+struct egress_worker *egress = NULL;
+
+/**
+ * @brief epoll instance watching worker threads' clients for disconnects
+ * @details Only used if receivers are served by one worker thread each
+ */
+int liveness_fd = -1;
 
 struct args init_args;
 
 /**
- * @brief Run source server
- * @details Accept a single client connection and parse messages from it,
- * broadcasting to receivers when valid
+ * @brief Register a newly connected receiver
+ * @return sequence number of the first message due to the receiver
+ * @details Every message that enters the queue from now on is due to the
+ * receiver until it leaves
  */
-void run_src_server(void *data)
+uint64_t join_receivers(void)
 {
-	int src_socket;
-	struct server_socket *src_server = NULL;
+	uint64_t start_seq;
+
+	pthread_mutex_lock(&msg_lock);
+	start_seq = ring_tail(&msg_ring);
+	num_receivers++;
+	pthread_mutex_unlock(&msg_lock);
+
+	return start_seq;
+}
+
+/**
+ * @brief Subscribe a new receiver to the channels listed in its handshake
+ * @param fd receiver socket file descriptor
+ * @param handshake subscription handshake received in full
+ * @param start_seq sequence number of the first message due to the receiver
+ * (see `join_receivers()`)
+ * @param sub receiver's subscription to fill in
+ * @return sequence number of the first message the receiver is to visit
+ * @details From then on, the receiver is only due the messages on its channels.
+ * Messages that entered the queue before the subscription are dropped.
+ */
+uint64_t subscribe_receiver(int fd, struct receiver_handshake *handshake,
+		uint64_t start_seq, struct subscription *sub)
+{
+	uint64_t sub_seq, ack_seq;
+	unsigned char ack[HANDSHAKE_LENGTH] = { SUBSCRIBE_MAGIC, SUBSCRIBE_ACK };
+
+	pthread_mutex_lock(&msg_lock);
+	sub_seq = ring_tail(&msg_ring);
+	num_receivers--;
+	subscribe(sub, handshake->buf);
+	pthread_mutex_unlock(&msg_lock);
+
+	drop_pending_msgs(&msg_ring, start_seq, sub_seq);
+
+	/* the socket send buffer is empty: never blocks */
+	ack_seq = htobe64(sub_seq);
+	memcpy(&ack[HANDSHAKE_VALUE_OFFSET], &ack_seq, sizeof(ack_seq));
+	if (send_msg(fd, ack, sizeof(ack)) < 0) {
+		pr_err("dst connection %d: error acknowledging subscription\n", fd);
+	}
+	pr_debug("dst connection %d: subscribed to %d channels from seq %lu\n",
+			fd, sub->num_channels, sub_seq);
+
+	return sub_seq;
+}
+
+/**
+ * @brief Serve a new receiver's handshake
+ * @param fd receiver socket file descriptor
+ * @param handshake handshake received from the receiver (possibly incomplete)
+ * @param start_seq sequence number of the first message due to the receiver
+ * (see `join_receivers()`)
+ * @param sub receiver's subscription (filled in if it subscribes)
+ * @param log_cursor set to the cursor of the messages to replay from the
+ * message log (NULL if none)
+ * @return sequence number of the first message the receiver is to visit
+ * @details Subscription handshakes are only served with channels enabled, and
+ * replay handshakes with replay enabled
+ */
+uint64_t serve_handshake(int fd, struct receiver_handshake *handshake,
+		uint64_t start_seq, struct subscription *sub,
+		struct log_cursor **log_cursor)
+{
+	*log_cursor = NULL;
+	if (init_args.channels && handshake->complete
+			&& handshake->buf[0] == SUBSCRIBE_MAGIC) {
+		return subscribe_receiver(fd, handshake, start_seq, sub);
+	} else if (init_args.replay) {
+		return start_replay(&msg_ring, msg_log, fd, handshake,
+				start_seq, log_cursor);
+	}
+
+	return start_seq;
+}
+
+/**
+ * @brief Check whether new receivers may send a handshake
+ * @return true if replay, channels or receiver profiles are enabled
+ */
+bool handshakes_enabled(void)
+{
+	return init_args.replay || init_args.channels
+		|| init_args.receiver_profiles;
+}
+
+/**
+ * @brief Set up the handshake of a new receiver
+ * @param handshake handshake to receive
+ */
+void init_receiver_handshake(struct receiver_handshake *handshake)
+{
+	/* only a profile selector is served without replay or channels */
+	init_handshake(handshake, !init_args.replay && !init_args.channels);
+}
+
+/**
+ * @brief Apply the socket profile a new receiver selected (if allowed)
+ * @param fd receiver socket file descriptor
+ * @param handshake handshake received from the receiver
+ * @return whether the receiver's socket is corked (and must be flushed whenever
+ * the receiver catches up)
+ * @details Receivers that select no profile (or an unknown one) keep the
+ * destination server's
+ */
+bool select_receiver_profile(int fd, struct receiver_handshake *handshake)
+{
+	int profile = init_args.dst_profile;
+
+	if (init_args.receiver_profiles && handshake->profile >= 0) {
+		if (handshake->profile < NUM_PROFILES) {
+			profile = handshake->profile;
+			apply_socket_profile(fd, profile);
+			pr_debug("dst connection %d: %s socket profile\n", fd,
+					socket_profiles[profile].name);
+		} else {
+			pr_err("dst connection %d: unknown socket profile %d\n",
+					fd, handshake->profile);
+		}
+	}
+
+	return socket_profiles[profile].cork;
+}
+
+/**
+ * @brief Serve a new receiver's handshake (if replay, channels or receiver
+ * profiles are enabled)
+ * @param fd receiver socket file descriptor
+ * @param start_seq sequence number of the first message due to the receiver
+ * (see `join_receivers()`)
+ * @param sub receiver's subscription (reset, then filled in if it subscribes)
+ * @param corked set to whether the receiver's socket is corked
+ * @return sequence number of the first message the receiver is to visit
+ * @details Waits up to `REPLAY_HANDSHAKE_MS` for the handshake. Messages
+ * replayed from the message log are sent straight away.
+ */
+uint64_t greet_receiver(int fd, uint64_t start_seq, struct subscription *sub,
+		bool *corked)
+{
+	int res;
+	uint64_t cursor;
+	struct receiver_handshake handshake;
+	struct log_cursor *log_cursor;
+
+	sub->num_channels = 0;
+	*corked = socket_profiles[init_args.dst_profile].cork;
+	if (!handshakes_enabled()) {
+		return start_seq;
+	}
+
+	init_receiver_handshake(&handshake);
+	wait_for_handshake(fd, &handshake, REPLAY_HANDSHAKE_MS);
+	*corked = select_receiver_profile(fd, &handshake);
+	cursor = serve_handshake(fd, &handshake, start_seq, sub, &log_cursor);
+	if (log_cursor) {
+		if ((res = send_log_frames(log_cursor, fd, 0)) < 0) {
+			/* the next send reports the error */
+			pr_err("dst connection %d: error replaying from log: %s\n",
+					fd, strerror(-res));
+		}
+		close_log_cursor(log_cursor);
+	}
+	if (*corked) {
+		/* push the acknowledgement out */
+		flush_socket(fd);
+	}
+
+	return cursor;
+}
+
+/**
+ * @brief Unregister a disconnected receiver
+ * @param sub receiver's subscription
+ * @return sequence number of the first message no longer due to the receiver
+ * @details The receiver must then drop the messages it was due but has not
+ * visited with `drop_due_msgs()`
+ */
+uint64_t leave_receivers(struct subscription *sub)
+{
+	uint64_t end_seq;
+
+	pthread_mutex_lock(&msg_lock);
+	end_seq = ring_tail(&msg_ring);
+	if (sub->num_channels > 0) {
+		unsubscribe(sub);
+	} else {
+		num_receivers--;
+	}
+	pthread_mutex_unlock(&msg_lock);
+
+	return end_seq;
+}
+
+/**
+ * @brief Add newly parsed entries to the message queue
+ * @param new_entries entries to add
+ * @param num_entries number of entries
+ * @details Entries are given their global sequence numbers as they enter the
+ * queue and become due to every connected receiver (every unsubscribed
+ * receiver and the subscribers of their channel), then all waiting threads
+ * are woken up. If the queue is full, waits for the oldest messages to be
+ * released first (unless overwriting is enabled). If queued messages are over
+ * the memory budget, the oldest are evicted first. With a message log, entries are logged before they become
+ * visible to receivers. With latency tracking, the time each entry spent
+ * between being parsed and entering the queue is recorded.
+ */
+void enqueue_msg_entries(struct msg_entry **new_entries, int num_entries)
+{
+	uint64_t seq, tick;
+	uint64_t parse_ticks[ENQUEUE_BATCH];
+	uint32_t num_subscribers[ENQUEUE_BATCH];
+
+	if (num_entries == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&msg_lock);
+	wait_for_free_slots(&msg_ring, num_entries, &msg_lock);
+	enforce_queue_budget(&msg_ring);
+	seq = ring_tail(&msg_ring);
+
+	/* log messages before entries with no receivers are freed */
+	if (msg_log) {
+		append_msg_log(msg_log, new_entries, num_entries, seq);
+	}
+
+	/* index messages by channel before subscribers can see them */
+	if (init_args.channels) {
+		for (int i = 0; i < num_entries; i++) {
+			num_subscribers[i] = index_msg(get_msg_channel(
+						new_entries[i]->msg->header), seq + i,
+					HEADER_LENGTH + new_entries[i]->msg->len);
+		}
+	}
+
+	/* entries with no receivers are freed as they are added */
+	tick = latency_tick();
+	for (int i = 0; i < num_entries; i++) {
+		parse_ticks[i] = new_entries[i]->parse_tick;
+		PROBE_MSG_QUEUED(seq + i, new_entries[i]->msg->len);
+	}
+
+	/* add messages to queue */
+	append_msg_entries(&msg_ring, new_entries, num_entries, num_receivers,
+			init_args.channels ? num_subscribers : NULL, tick);
+
+	/* signal that the message queue is non-empty
+	 * (broadcast signal to all waiting threads) */
+	pthread_cond_broadcast(&msg_cond);
+	pthread_mutex_unlock(&msg_lock);
+
+	/* wake up idle egress workers */
+	for (int i = 0; i < init_args.egress_threads; i++) {
+		wake_egress_worker(&egress[i]);
+	}
+
+	if (latency_enabled()) {
+		for (int i = 0; i < num_entries; i++) {
+			record_latency(STAGE_ENQUEUE, parse_ticks[i], tick);
+		}
+	}
+}
+
+/**
+ * @brief Parse messages received on a source connection
+ * @param stream ingest stream of the connection
+ * @details Parse every complete message received, adding them to the message
+ * queue in batches of up to `ENQUEUE_BATCH`
+ */
+void enqueue_stream_msgs(struct ctmp_stream *stream)
+{
+	int num_entries = 0;
 	struct ctmp_msg *current_msg = NULL;
 	struct msg_entry *new_msg_entry = NULL;
+	struct msg_entry *new_entries[ENQUEUE_BATCH];
+	int ttl;
+	uint64_t num_msgs = 0, num_bytes = 0;
+
+	/* parse every complete message received so far */
+	while ((current_msg = next_ctmp_msg(stream))) {
+		PROBE_MSG_PARSED(current_msg->len, stream->fd);
+		num_msgs++;
+		num_bytes += HEADER_LENGTH + current_msg->len;
+		ttl = init_args.ttl;
+		if ((stream->options & OPT_TTL) && get_msg_ttl(current_msg->header) > 0) {
+			ttl = get_msg_ttl(current_msg->header);
+			if (ttl > MAX_TTL) {
+				ttl = MAX_TTL;
+			}
+		}
+		init_msg_entry(&new_msg_entry, current_msg, ttl);
+		new_msg_entry->parse_tick = latency_tick();
+
+		/* write the frame into a pipe once for splice fan-out */
+		if (init_args.splice_len > 0
+				&& HEADER_LENGTH + current_msg->len >= init_args.splice_len) {
+			new_msg_entry->pipe_fd = create_frame_pipe(current_msg);
+		}
+		new_entries[num_entries++] = new_msg_entry;
+		if (num_entries == ENQUEUE_BATCH) {
+			enqueue_msg_entries(new_entries, num_entries);
+			num_entries = 0;
+		}
+	}
+	enqueue_msg_entries(new_entries, num_entries);
+
+	add_count(&stream->counters->msgs, num_msgs);
+	add_count(&stream->counters->bytes, num_bytes);
+}
+
+/**
+ * @brief Get the optional extended CTMP options source connections may use
+ * @return `OPT_TTL` with per-message TTLs, `OPT_CHAN` with channels
+ */
+unsigned char stream_options(void)
+{
+	return (init_args.msg_ttl ? OPT_TTL : 0) | (init_args.channels ? OPT_CHAN : 0);
+}
+
+/**
+ * @brief Receive and parse messages from a source connection
+ * @param stream ingest stream of the connection
+ * @return true if the connection is still open, false if it has been closed
+ * (or has failed)
+ */
+bool handle_src_conn(struct ctmp_stream *stream)
+{
+	ssize_t res;
+
+	res = fill_ctmp_stream(stream);
+	if (res == -EAGAIN || res == -EWOULDBLOCK) {
+		return true;
+	} else if (res <= 0) {
+		return false;
+	}
+
+	enqueue_stream_msgs(stream);
+	return true;
+}
+
+/**
+ * @brief Arm a multishot receive for a source connection
+ * @param ring source worker ring
+ * @param stream ingest stream of the connection (CQE user data)
+ * @return true on success, false if there is no room in the submission queue
+ */
+bool arm_src_recv(struct uring *ring, struct ctmp_stream *stream)
+{
+	struct io_uring_sqe *sqe = uring_get_free_sqe(ring);
+
+	if (!sqe) {
+		return false;
+	}
+	uring_prep_recv_multishot(sqe, stream->fd, (unsigned long) stream);
+	return true;
+}
+
+/**
+ * @brief Run io_uring source worker
+ * @param data source server (`struct server_socket`)
+ * @details io_uring equivalent of `run_src_worker()`: a multishot accept on the
+ * (shared) source server socket, and a multishot receive into provided buffers
+ * for each accepted connection. Every completion carries a chunk of data which
+ * is fed to the connection's ingest stream. While queued messages are over
+ * budget, every request is cancelled (so the kernel stops filling provided
+ * buffers) and re-armed once the worker resumes.
+ */
+void *run_src_uring_worker(void *data)
+{
+	int res, src_socket;
+	unsigned flags, bid;
+	bool accept_armed = false;
+	struct server_socket *src_server = (struct server_socket *) data;
+	struct uring ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct ctmp_stream *stream = NULL;
+	struct ingest_counters *counters = claim_ingest_counters();
+
+	if (!uring_init(&ring, URING_ENTRIES) || !uring_setup_bufs(&ring)) {
+		pr_err("error setting up io_uring for source worker\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		/* stop receiving while queued messages are over budget */
+		if (ingest_throttled()) {
+			if ((sqe = uring_get_free_sqe(&ring))) {
+				uring_prep_cancel_all(sqe, SRC_CANCEL_DATA);
+				uring_submit(&ring, 0);
+			}
+			throttle_ingest();
+		}
+
+		/* (re-)arm the multishot accept: server socket user data = NULL */
+		if (!accept_armed && (sqe = uring_get_free_sqe(&ring))) {
+			uring_prep_accept_multishot(sqe, src_server->fd, 0);
+			accept_armed = true;
+		}
+		uring_submit(&ring, 1);
+
+		while ((cqe = uring_peek_cqe(&ring))) {
+			stream = (struct ctmp_stream *) (unsigned long) cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+			uring_cqe_seen(&ring);
+
+			if ((unsigned long) stream == SRC_CANCEL_DATA) {
+				continue;
+			}
+
+			if (!stream) {
+				src_socket = res;
+				if (src_socket >= 0) {
+					pr_debug("new src connection %d\n", src_socket);
+					apply_socket_profile(src_socket,
+							init_args.src_profile);
+					stream = malloc(sizeof(struct ctmp_stream));
+					if (!stream) {
+						p_error("malloc", errno);
+						exit(errno);
+					}
+					init_ctmp_stream(stream, src_socket,
+							init_args.extended,
+							stream_options(), counters);
+					if (!arm_src_recv(&ring, stream)) {
+						pr_err("src connection %d: unable to arm receive\n",
+								src_socket);
+						close(src_socket);
+						free_ctmp_stream(stream);
+						free(stream);
+					}
+				}
+
+				/* multishot accept terminated: re-armed before the
+				 * next submission */
+				if (!(flags & IORING_CQE_F_MORE)) {
+					accept_armed = false;
+				}
+				continue;
+			}
+
+			if (res > 0) {
+				bid = flags >> IORING_CQE_BUFFER_SHIFT;
+				feed_ctmp_stream(stream, uring_buf(&ring, bid), res);
+				uring_recycle_buf(&ring, bid);
+				enqueue_stream_msgs(stream);
+			}
+
+			if (!(flags & IORING_CQE_F_MORE)) {
+				/* re-arm if still open (or cancelled while throttled) */
+				if ((res <= 0 && res != -ENOBUFS && res != -ECANCELED)
+						|| !arm_src_recv(&ring, stream)) {
+					/* close old src connection */
+					pr_debug("closing src connection %d...\n", stream->fd);
+					close(stream->fd);
+					free_ctmp_stream(stream);
+					free(stream);
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Run source worker
+ * @param data source server (`struct server_socket`)
+ * @details Wait for events on the (shared) source server socket and on the
+ * source connections this worker has accepted. Any worker can accept a new
+ * connection, which it then serves until it is closed.
+ */
+void *run_src_worker(void *data)
+{
+	int epoll_fd, num_events, src_socket;
+	struct server_socket *src_server = (struct server_socket *) data;
+	struct epoll_event event, events[MAX_SRC_EVENTS];
+	struct ctmp_stream *stream = NULL;
+	struct ingest_counters *counters = claim_ingest_counters();
+
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0) {
+		p_error("epoll_create1", errno);
+		exit(errno);
+	}
+
+	/* server socket: data.ptr = NULL
+	 * EPOLLEXCLUSIVE: only wake up one worker per new connection */
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	event.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src_server->fd, &event) < 0) {
+		p_error("epoll_ctl", errno);
+		exit(errno);
+	}
+
+	while (1) {
+		/* stop reading while queued messages are over budget */
+		throttle_ingest();
+		num_events = epoll_wait(epoll_fd, events, MAX_SRC_EVENTS, -1);
+		if (num_events < 0) {
+			if (errno != EINTR) {
+				p_error("epoll_wait", errno);
+			}
+			continue;
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			stream = events[i].data.ptr;
 
-	/* CTMP message parsing function */
-	struct ctmp_msg *(*ctmp_parse_func)(int) = NULL;
+			if (!stream) {
+				/* accept all pending connections */
+				while ((src_socket = server_accept_nonblock(src_server->fd)) >= 0) {
+					pr_debug("new src connection %d\n", src_socket);
+					apply_socket_profile(src_socket,
+							init_args.src_profile);
+					stream = malloc(sizeof(struct ctmp_stream));
+					if (!stream) {
+						p_error("malloc", errno);
+						exit(errno);
+					}
+					init_ctmp_stream(stream, src_socket,
+							init_args.extended,
+							stream_options(), counters);
+
+					event.events = EPOLLIN;
+					event.data.ptr = stream;
+					if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD,
+								src_socket, &event) < 0) {
+						p_error("epoll_ctl", errno);
+						exit(errno);
+					}
+				}
+				continue;
+			}
+
+			if (!handle_src_conn(stream)) {
+				/* close old src connection (also removes it from
+				 * the epoll interest list) */
+				pr_debug("closing src connection %d...\n", stream->fd);
+				close(stream->fd);
+				free_ctmp_stream(stream);
+				free(stream);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Run source server
+ * @details Accept any number of client connections and parse messages from
+ * them, broadcasting to receivers when valid. Connections are served by
+ * `src_threads` event-driven source workers (including the calling thread).
+ */
+void run_src_server(void *data)
+{
+	int res;
+	pthread_t src_thread;
+	struct server_socket *src_server = NULL;
+	void *(*src_worker_func)(void *) = NULL;
 
-	src_server = server_create(SRC_PORT, init_args.backlog);
+	src_server = server_create(SRC_PORT, init_args.backlog,
+			init_args.src_profile);
 	if (!src_server) {
 		pr_err("error setting up server on port %d\n", SRC_PORT);
 		exit(EXIT_FAILURE);
 	}
 
-	/* check which protocol version to use */
-	if (init_args.extended) {
-		ctmp_parse_func = &parse_ctmp_msg_extended;
+	/* check which I/O backend to use */
+	if (init_args.io_uring) {
+		src_worker_func = &run_src_uring_worker;
 	} else {
-		ctmp_parse_func = &parse_ctmp_msg;
+		src_worker_func = &run_src_worker;
+		if (set_nonblocking(src_server->fd) < 0) {
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	while (1) {
-		src_socket = server_accept(src_server->fd, src_server->addr);
-		if (src_socket < 0) {
-			pr_err("error accepting connection to port %d\n", SRC_PORT);
-			exit(-src_socket);
+	/* create additional source workers */
+	for (int i = 1; i < init_args.src_threads; i++) {
+		res = pthread_create(&src_thread, NULL, src_worker_func, src_server);
+		if (res != 0) {
+			p_error("pthread_create", res);
+			exit(res);
+		}
+		pin_thread(src_thread, init_args.ingest_cpus, i, "source");
+	}
+
+	/* pinned last: threads inherit the affinity of the thread creating them */
+	pin_thread(pthread_self(), init_args.ingest_cpus, 0, "source");
+	src_worker_func(src_server);
+}
+
+/**
+ * @brief Send a single claimed message to a worker's client through its frame
+ * pipe or with zero-copy sends
+ * @param args worker arguments
+ * @param entry claimed entry to send
+ * @return non-negative on success, negative on error (client connection closed)
+ */
+ssize_t send_single_entry(struct worker_args *args, struct msg_entry *entry)
+{
+	ssize_t res;
+	size_t offset = 0, len = HEADER_LENGTH + entry->msg->len;
+
+	if (entry->pipe_fd >= 0 && args->pipe[0] >= 0) {
+		pr_debug("thread %d: splicing a %d-byte message (seq %lu)\n",
+				args->thread_index, entry->msg->len, entry->seq);
+		return splice_ctmp_msg(args->client_fd, entry->pipe_fd,
+				args->pipe, entry->msg);
+	}
+
+	pr_debug("thread %d: sending a %d-byte message with MSG_ZEROCOPY (seq %lu)\n",
+			args->thread_index, entry->msg->len, entry->seq);
+	while (offset < len) {
+		res = send_zc_msg(args->zc, args->client_fd, entry, offset, 0);
+		if (res == -EINTR) {
+			continue;
+		} else if (res < 0) {
+			return res;
+		}
+		offset += res;
+	}
+
+	/* release the messages of any sends that have completed */
+	return reap_zc_completions(args->zc, args->client_fd);
+}
+
+/**
+ * @brief Send a batch of messages to a worker's client
+ * @param args worker arguments
+ * @param cursor sequence number of the first message to consider, updated to
+ * the next message to consider
+ * @param tail tail sequence number of the queue
+ * @return 0 on success, negative on error (client connection closed)
+ * @details Walk forward from `cursor` claiming the messages the worker can
+ * forward (only those on its channels if the client is subscribed), up to `SEND_BATCH_FRAMES` frames (`URING_SEND_BATCH` with io_uring)
+ * or `SEND_BATCH_BYTES` bytes, then send them with a single vectored send (or
+ * linked sends in a single submission). A claimed message with a frame pipe or
+ * long enough for a zero-copy send ends the batch, and is sent on its own after
+ * the rest. With latency tracking, the time each message waited in the queue
+ * and took to send is recorded.
+ */
+ssize_t send_entry_batch(struct worker_args *args, uint64_t *cursor,
+		uint64_t tail)
+{
+	int num_frames = 0;
+	int max_frames = args->ring ? URING_SEND_BATCH : SEND_BATCH_FRAMES;
+	size_t num_bytes = 0;
+	ssize_t res = 0;
+	uint64_t seq, done_tick;
+	uint64_t pickup_tick = latency_tick();
+	struct iovec frames[SEND_BATCH_FRAMES];
+	struct msg_entry *batch[SEND_BATCH_FRAMES], *entry;
+	struct msg_entry *single = NULL;
+
+	while ((seq = next_due_seq(args->sub, cursor, tail)) < tail) {
+		if ((entry = claim_msg(&msg_ring, seq))) {
+			PROBE_MSG_PICKED(seq, args->client_fd);
+			if (latency_enabled()) {
+				record_latency(STAGE_QUEUE,
+						msg_enqueue_tick(&msg_ring, seq),
+						pickup_tick);
+			}
+			if ((entry->pipe_fd >= 0 && args->pipe[0] >= 0) || (args->zc
+						&& HEADER_LENGTH + entry->msg->len
+						>= init_args.zerocopy_len)) {
+				single = entry;
+				break;
+			}
+
+			frames[num_frames].iov_base = entry->msg->header;
+			frames[num_frames].iov_len = HEADER_LENGTH + entry->msg->len;
+			num_bytes += frames[num_frames].iov_len;
+			batch[num_frames++] = entry;
+			if (num_frames == max_frames || num_bytes >= SEND_BATCH_BYTES) {
+				break;
+			}
+		}
+	}
+
+	if (num_frames > 0) {
+		pr_debug("thread %d: sending %d messages (seq %lu-%lu)\n",
+				args->thread_index, num_frames, batch[0]->seq,
+				batch[num_frames-1]->seq);
+		if (args->ring) {
+			res = uring_send_linked(args->ring, args->client_fd,
+					frames, num_frames);
+		} else {
+			res = send_msgs(args->client_fd, frames, num_frames);
+		}
+		done_tick = latency_tick();
+		for (int i = 0; i < num_frames; i++) {
+			if (res >= 0) {
+				PROBE_MSG_SENT(batch[i]->seq, args->client_fd);
+				record_send_latency(batch[i]->parse_tick,
+						pickup_tick, done_tick);
+			}
+			release_msg(batch[i], 1);
+		}
+		if (res >= 0) {
+			add_count(&args->stats->msgs, num_frames);
+			add_count(&args->stats->bytes, num_bytes);
+		}
+	}
+
+	if (single) {
+		if (res >= 0) {
+			res = send_single_entry(args, single);
+		}
+		if (res >= 0) {
+			PROBE_MSG_SENT(single->seq, args->client_fd);
+			record_send_latency(single->parse_tick, pickup_tick,
+					latency_tick());
+			add_count(&args->stats->msgs, 1);
+			add_count(&args->stats->bytes,
+					HEADER_LENGTH + single->msg->len);
 		}
+		release_msg(single, 1);
+	}
 
-		/* keep parsing messages while the connection is open */
-		while (is_alive(src_socket)) {
-			current_msg = ctmp_parse_func(src_socket);
-			if (current_msg) {
-				init_msg_entry(&new_msg_entry, current_msg,
-						init_args.num_workers);
+	return res;
+}
 
-				pthread_mutex_lock(&msg_lock);
-				/* add message to queue */
-				TAILQ_INSERT_TAIL(&msg_queue_head, new_msg_entry, entries);
+/**
+ * @brief Watch a worker thread's client connection for disconnects
+ * @param args worker arguments (including the client file descriptor)
+ * @details The connection is identified by the worker's thread index and
+ * connection ID, so events still pending for a previous client are ignored
+ */
+void watch_client(struct worker_args *args)
+{
+	struct epoll_event event;
+
+	/* edge-triggered: EPOLLRDHUP fires once when the client disconnects
+	 * (EPOLLHUP and EPOLLERR are always reported) */
+	event.events = EPOLLRDHUP | EPOLLET;
+	event.data.u64 = ((uint64_t) args->conn_id << 32) | args->thread_index;
+	if (epoll_ctl(liveness_fd, EPOLL_CTL_ADD, args->client_fd, &event) < 0) {
+		p_error("epoll_ctl", errno);
+	}
+}
+
+/**
+ * @brief Run liveness monitor
+ * @details Instead of probing every client before each send, wait for
+ * disconnect notifications on all of them at once. When a worker thread's
+ * client disconnects, flag it and wake the worker up if it is waiting for
+ * messages. Peers that vanish without closing their connection are caught by
+ * the keepalive and user timeouts of the connection (see
+ * `set_liveness_timeouts()`).
+ */
+void *run_liveness_monitor(void *data)
+{
+	int num_events, err;
+	socklen_t err_len;
+	uint32_t conn_id;
+	bool hung_up;
+	struct epoll_event events[MAX_LIVENESS_EVENTS];
+	struct worker_args *args;
 
-				/* signal that the message queue is non-empty
-				 * (broadcast signal to all waiting threads) */
-				pthread_cond_broadcast(&msg_cond);
-				pthread_mutex_unlock(&msg_lock);
+	while (1) {
+		num_events = epoll_wait(liveness_fd, events, MAX_LIVENESS_EVENTS, -1);
+		if (num_events < 0) {
+			if (errno != EINTR) {
+				p_error("epoll_wait", errno);
 			}
+			continue;
 		}
 
-		/* close old src connection */
-		pr_debug("closing src connection...\n");
-		close(src_socket);
+		for (int i = 0; i < num_events; i++) {
+			args = &dst.workers[events[i].data.u64 & UINT32_MAX].args;
+			conn_id = events[i].data.u64 >> 32;
+			hung_up = false;
+
+			/* the fd is only closed (and reused) once it has been
+			 * cleared under the lock: skip stale events unprobed */
+			pthread_mutex_lock(&args->lock);
+			if (args->conn_id == conn_id && args->client_fd >= 0) {
+				/* zero-copy completions are reported as socket
+				 * errors: only a pending socket error counts */
+				err_len = sizeof(err);
+				hung_up = (events[i].events != EPOLLERR
+						|| getsockopt(args->client_fd,
+							SOL_SOCKET, SO_ERROR,
+							&err, &err_len) < 0
+						|| err != 0);
+				if (hung_up) {
+					atomic_store(&args->hung_up, true);
+				}
+			}
+			pthread_mutex_unlock(&args->lock);
+			if (!hung_up) {
+				continue;
+			}
+
+			/* wake the worker up if it is waiting for messages */
+			pthread_mutex_lock(&msg_lock);
+			pthread_cond_broadcast(&msg_cond);
+			pthread_mutex_unlock(&msg_lock);
+		}
 	}
+
+	return NULL;
 }
 
 /**
  * @brief Run destination worker
  * @param data `struct worker_args` object (includes the client file descriptor
- * to send messages to and its timestamp)
- * @details Send CTMP messages to a given client (using timestamps to ensure that
- * it only sends messages it is entitled to send)
+ * to send messages to and the first message due to it)
+ * @details Send CTMP messages to a given client (only those that entered the
+ * queue while it was connected)
  */
 void *run_dst_worker(void *data)
 {
-	struct msg_entry *current = NULL, *prev = NULL, *next = NULL;
+	int client_fd;
 	ssize_t bytes_sent = 0;
+	uint64_t cursor, tail, head, end_seq;
 	struct worker_args *args = (struct worker_args *) data;
 
+	args->sub = malloc(sizeof(struct subscription));
+	if (!args->sub) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	cursor = greet_receiver(args->client_fd, args->start_seq, args->sub,
+			&args->corked);
+	args->stats = add_receiver_stats(args->client_fd, cursor);
+	if (init_args.io_uring) {
+		args->ring = malloc(sizeof(struct uring));
+		if (!args->ring) {
+			p_error("malloc", errno);
+			exit(errno);
+		}
+		if (!uring_init(args->ring, URING_ENTRIES)) {
+			pr_err("thread %d: error setting up io_uring\n",
+					args->thread_index);
+			exit(EXIT_FAILURE);
+		}
+	} else if (init_args.splice_len > 0) {
+		init_worker_pipe(args->pipe);
+	}
+	if (init_args.zerocopy_len > 0 && !args->ring) {
+		args->zc = init_zc_socket(args->client_fd);
+	}
+	watch_client(args);
+
 	while (1) {
-		current = get_msg_entry(&msg_queue_head, &msg_lock, &msg_cond,
-				current, prev, false);
+		tail = wait_for_msgs(&msg_ring, cursor, &msg_lock, &msg_cond,
+				&args->hung_up);
+		bytes_sent = 0;
 
-		/* check the connection is open before attempting to send */
-		if (!is_alive(args->client_fd)) {
+		if (atomic_load(&args->hung_up)) {
 			pr_debug("thread %d: client connection closed\n",
 					args->thread_index);
 			goto conn_closed;
 		}
 
-		if (can_forward(current, args->thread_index, args->timestamp)) {
-			/* send message to the assigned file descriptor */
-			pr_debug("thread %d: sending a %d-byte message\n",
-					args->thread_index, current->msg->len);
-			bytes_sent = send_ctmp_msg(args->client_fd, current->msg);
-			set_sent(current, args->thread_index, true);
+		head = ring_head(&msg_ring, tail);
+		if (cursor < head) {
+			pr_debug("thread %d: skipping %lu overwritten messages\n",
+					args->thread_index, head - cursor);
+			cursor = head;
 		}
 
-		pthread_mutex_lock(&msg_lock);
-		/* get next message */
-		next = TAILQ_NEXT(current, entries);
-		pthread_mutex_unlock(&msg_lock);
+		if (enforce_lag_limits(&msg_ring, args->sub, &cursor,
+					args->client_fd) < 0) {
+			goto conn_closed;
+		}
+
+		/* send the next messages in one batch */
+		bytes_sent = send_entry_batch(args, &cursor, tail);
+		atomic_store_explicit(&args->stats->cursor, cursor,
+				memory_order_relaxed);
+		if (bytes_sent == -EAGAIN || bytes_sent == -EWOULDBLOCK) {
+			/* send timed out (see run_dst_server()) */
+			report_stalled_receiver(args->client_fd);
+		} else if (bytes_sent >= 0 && args->corked && cursor == tail) {
+			/* caught up: send the last partial segment */
+			flush_socket(args->client_fd);
+		}
 
 		if (bytes_sent < 0) {
 conn_closed:
-			/* close old client fd */
-			close(args->client_fd);
+			/* close old client fd (first stop stale liveness
+			 * events probing it, as it may be reused) */
+			pthread_mutex_lock(&args->lock);
+			client_fd = args->client_fd;
+			args->client_fd = -1;
+			pthread_mutex_unlock(&args->lock);
+			remove_receiver_stats(args->stats);
+			epoll_ctl(liveness_fd, EPOLL_CTL_DEL, client_fd, NULL);
+			if (args->zc) {
+				/* closed once its zero-copy sends complete */
+				release_zc_socket(args->zc, client_fd);
+				args->zc = NULL;
+			} else {
+				close(client_fd);
+			}
+
+			/* release messages that will no longer be sent */
+			end_seq = leave_receivers(args->sub);
+			drop_due_msgs(&msg_ring, args->sub, cursor, end_seq);
 
-			pr_debug("thread %d: waiting for new fd...\n",
-					args->thread_index);
-			/* send failed, wait for new fd */
 			pthread_mutex_lock(&args->lock);
 
 			/* update status */
 			*(args->self_status) = THREAD_READY;
-			pthread_mutex_lock(&args->threads_status->lock);
-			set_bit(&args->threads_status->data,
-					args->thread_index, false);
-			pthread_mutex_unlock(&args->threads_status->lock);
 
+			/* serve the oldest queued client straight away, or go
+			 * idle and wait for a new fd */
+			client_fd = next_pending_client(&dst, args->thread_index);
+			if (client_fd >= 0) {
+				set_thread_client(args, client_fd, join_receivers());
+			} else {
+				pr_debug("thread %d: waiting for new fd...\n",
+						args->thread_index);
+			}
 			while (*(args->self_status) != THREAD_BUSY) {
 				pthread_cond_wait(&args->cond, &args->lock);
 			}
 
-			if (current->sent) {
-				/* reset sent status for new connection */
-				set_sent(current, args->thread_index, false);
-			}
-
 			pthread_mutex_unlock(&args->lock);
 			pr_debug("thread %d: got new fd %d\n",
 					args->thread_index, args->client_fd);
+			if (init_args.zerocopy_len > 0 && !args->ring) {
+				args->zc = init_zc_socket(args->client_fd);
+			}
+			watch_client(args);
+			cursor = greet_receiver(args->client_fd, args->start_seq,
+					args->sub, &args->corked);
+			args->stats = add_receiver_stats(args->client_fd, cursor);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Close an egress worker's receiver connection
+ * @param worker egress worker serving the receiver
+ * @param receiver receiver to close (freed)
+ */
+void close_receiver(struct egress_worker *worker, struct receiver *receiver)
+{
+	uint64_t end_seq;
+
+	pr_debug("closing dst connection %d...\n", receiver->fd);
+	if (receiver->awaiting_handshake) {
+		worker->num_handshakes--;
+	}
+
+	/* release messages that will no longer be sent */
+	end_seq = leave_receivers(&receiver->sub);
+	remove_receiver_stats(receiver->stats);
+	release_receiver_batch(receiver);
+	drop_due_msgs(&msg_ring, &receiver->sub, receiver->cursor, end_seq);
+
+	if (receiver->zc) {
+		/* closed once its zero-copy sends complete */
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, receiver->fd, NULL);
+		release_zc_socket(receiver->zc, receiver->fd);
+	} else {
+		/* also removes it from the epoll interest list */
+		close(receiver->fd);
+	}
+	TAILQ_REMOVE(&worker->receivers, receiver, entries);
+	atomic_fetch_sub(&worker->num_receivers, 1);
+	free(receiver);
+}
+
+/**
+ * @brief Send a receiver the messages it is due
+ * @param worker egress worker serving the receiver
+ * @param receiver receiver to send to
+ * @details Closes the receiver on error
+ */
+void handle_receiver(struct egress_worker *worker, struct receiver *receiver)
+{
+	int res;
+
+	if (receiver->awaiting_handshake) {
+		/* nothing to send until the handshake is served */
+		return;
+	}
+
+	res = pump_receiver(receiver, &msg_ring);
+	if (res == 0 && receiver->corked) {
+		/* caught up: send the last partial segment */
+		flush_socket(receiver->fd);
+	} else if (res == -EAGAIN || res == -EWOULDBLOCK) {
+		/* wait for EPOLLOUT */
+		receiver->blocked = true;
+	} else if (res < 0) {
+		close_receiver(worker, receiver);
+	}
+}
+
+/**
+ * @brief Serve a receiver's handshake (or give up waiting for it)
+ * @param worker egress worker serving the receiver
+ * @param receiver receiver awaiting its handshake
+ */
+void finish_handshake(struct egress_worker *worker, struct receiver *receiver)
+{
+	receiver->corked = select_receiver_profile(receiver->fd,
+			&receiver->handshake);
+	receiver->cursor = serve_handshake(receiver->fd, &receiver->handshake,
+			receiver->cursor, &receiver->sub, &receiver->log_cursor);
+	receiver->awaiting_handshake = false;
+	worker->num_handshakes--;
+}
+
+/**
+ * @brief Adopt the receivers assigned to an egress worker
+ * @param worker egress worker
+ * @details Registers each receiver (from now on it is due every new message)
+ * and adds it to the worker's epoll interest list
+ */
+void adopt_receivers(struct egress_worker *worker)
+{
+	struct receiver_list incoming;
+	struct receiver *receiver;
+	struct epoll_event event;
+
+	TAILQ_INIT(&incoming);
+	pthread_mutex_lock(&worker->lock);
+	TAILQ_CONCAT(&incoming, &worker->incoming, entries);
+	pthread_mutex_unlock(&worker->lock);
+
+	while ((receiver = TAILQ_FIRST(&incoming))) {
+		TAILQ_REMOVE(&incoming, receiver, entries);
+		receiver->cursor = join_receivers();
+		receiver->stats = add_receiver_stats(receiver->fd,
+				receiver->cursor);
+		receiver->corked = socket_profiles[init_args.dst_profile].cork;
+		if (handshakes_enabled()) {
+			init_receiver_handshake(&receiver->handshake);
+			receiver->awaiting_handshake = true;
+			get_clock_time(&receiver->handshake_deadline);
+			add_time_ms(&receiver->handshake_deadline,
+					REPLAY_HANDSHAKE_MS);
+			worker->num_handshakes++;
+		}
+		if (init_args.zerocopy_len > 0) {
+			receiver->zc = init_zc_socket(receiver->fd);
+			receiver->zc_len = init_args.zerocopy_len;
+		}
+		TAILQ_INSERT_TAIL(&worker->receivers, receiver, entries);
+
+		/* edge-triggered: EPOLLOUT fires when a full send buffer
+		 * drains, EPOLLRDHUP when the receiver disconnects */
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = receiver;
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, receiver->fd,
+					&event) < 0) {
+			p_error("epoll_ctl", errno);
+			close_receiver(worker, receiver);
+		}
+	}
+}
+
+/**
+ * @brief Run egress worker
+ * @param data egress worker (`struct egress_worker`)
+ * @details Serve any number of non-blocking receivers. Whenever new messages
+ * are enqueued (or receivers assigned), every receiver that is not blocked
+ * is sent the messages it is due until it catches up or its send buffer fills
+ * up. Blocked receivers are resumed when `EPOLLOUT` reports space in their
+ * send buffer; in the meantime, the lag policy is applied to them whenever the
+ * others catch up (and at least every `max_age` milliseconds with an age limit).
+ * With replay, channels or receiver profiles, new receivers are not sent
+ * anything until their handshake has been received or `REPLAY_HANDSHAKE_MS` has
+ * passed.
+ */
+void *run_egress_worker(void *data)
+{
+	int num_events, timeout;
+	uint32_t revents;
+	bool catch_up;
+	struct timespec now = { 0 };
+	struct egress_worker *worker = (struct egress_worker *) data;
+	struct epoll_event events[MAX_EGRESS_EVENTS];
+	struct receiver *receiver, *next;
+
+	while (1) {
+		timeout = lag_limits.max_age ? lag_limits.max_age : -1;
+		if (worker->num_handshakes > 0
+				&& (timeout < 0 || timeout > REPLAY_HANDSHAKE_MS)) {
+			timeout = REPLAY_HANDSHAKE_MS;
+		}
+
+		num_events = epoll_wait(worker->epoll_fd, events,
+				MAX_EGRESS_EVENTS, timeout);
+		if (num_events < 0) {
+			if (errno != EINTR) {
+				p_error("epoll_wait", errno);
+			}
+			continue;
+		}
+
+		/* check blocked receivers' lag on timeout */
+		catch_up = (num_events == 0);
+		for (int i = 0; i < num_events; i++) {
+			receiver = events[i].data.ptr;
+
+			if (!receiver) {
+				/* new receivers or new messages */
+				clear_egress_event(worker);
+				adopt_receivers(worker);
+				catch_up = true;
+				continue;
+			}
+
+			revents = events[i].events;
+			/* zero-copy completions are reported as socket errors */
+			if ((revents & EPOLLERR) && receiver->zc
+					&& reap_zc_completions(receiver->zc,
+						receiver->fd) >= 0) {
+				revents &= ~EPOLLERR;
+			}
+
+			if ((revents & EPOLLIN) && receiver->awaiting_handshake
+					&& recv_handshake(receiver->fd,
+						&receiver->handshake) != 0) {
+				/* sent by the catch-up pass */
+				finish_handshake(worker, receiver);
+				catch_up = true;
+			}
+
+			if ((revents & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+					|| ((revents & EPOLLIN)
+						&& !receiver->awaiting_handshake
+						&& !drain_receiver(receiver))) {
+				close_receiver(worker, receiver);
+			} else if ((revents & EPOLLOUT) && receiver->blocked) {
+				receiver->blocked = false;
+				handle_receiver(worker, receiver);
+			}
 		}
 
-		prev = current;
-		current = next;
+		if (catch_up) {
+			/* messages enqueued from now on signal the worker */
+			atomic_store(&worker->waiting, true);
+			if (worker->num_handshakes > 0) {
+				get_clock_time(&now);
+			}
+
+			for (receiver = TAILQ_FIRST(&worker->receivers); receiver;
+					receiver = next) {
+				next = TAILQ_NEXT(receiver, entries);
+				if (receiver->awaiting_handshake
+						&& !compare_times(&now,
+							&receiver->handshake_deadline)) {
+					finish_handshake(worker, receiver);
+				}
+				if (!receiver->blocked) {
+					handle_receiver(worker, receiver);
+				} else if (enforce_lag_limits(&msg_ring,
+							&receiver->sub,
+							&receiver->cursor,
+							receiver->fd) < 0) {
+					close_receiver(worker, receiver);
+				}
+			}
+		}
 	}
 
 	return NULL;
@@ -172,57 +1263,100 @@ conn_closed:
 
 /**
  * @brief Run destination server
- * @details Accept client connections and assign them to worker threads
+ * @details Accept client connections and assign them to idle worker threads
+ * (or to the least loaded egress worker). Never waits for a worker: while every
+ * thread is busy, clients are queued and taken by the next thread to finish
+ * with its client.
  */
 void *run_dst_server(void *data)
 {
-	int res, new_fd, thread_index, delay = INITIAL_DELAY;
-	struct timespec client_ts;
+	int res, new_fd, thread_index;
+	uint64_t start_seq;
 	struct server_socket *dst_server = NULL;
+	struct uring ring;
 
-	dst_server = server_create(DST_PORT, init_args.backlog);
+	dst_server = server_create(DST_PORT, init_args.backlog,
+			init_args.dst_profile);
 	if (!dst_server) {
 		pr_err("error setting up server on port %d\n", DST_PORT);
 		exit(EXIT_FAILURE);
 	}
 
+	if (init_args.io_uring) {
+		if (!uring_init(&ring, URING_ENTRIES)) {
+			pr_err("error setting up io_uring for port %d\n", DST_PORT);
+			exit(EXIT_FAILURE);
+		}
+		uring_prep_accept_multishot(uring_get_sqe(&ring), dst_server->fd, 0);
+	}
+
 	while (1) {
-		new_fd = server_accept(dst_server->fd, dst_server->addr);
+		if (init_args.io_uring) {
+			new_fd = uring_accept(&ring, dst_server->fd);
+		} else {
+			new_fd = server_accept(dst_server->fd, dst_server->addr);
+		}
 		if (new_fd < 0) {
 			pr_err("error accepting connection to port %d\n", DST_PORT);
 			/* retry */
 			continue;
 		}
+		apply_socket_profile(new_fd, init_args.dst_profile);
+
+		if (egress) {
+			if (set_nonblocking(new_fd) < 0) {
+				close(new_fd);
+				continue;
+			}
+			assign_receiver(least_loaded_egress_worker(egress,
+						init_args.egress_threads), new_fd);
+			continue;
+		}
 
-		/* set timestamp to be time of accepting the connection */
-		get_clock_time(&client_ts);
+		/* a worker blocked sending to a stalled receiver cannot check its
+		 * lag: bound how long it waits */
+		if (lag_limits.max_age && lag_limits.policy == LAG_DISCONNECT) {
+			set_send_timeout(new_fd, lag_limits.max_age);
+		}
 
-		thread_index = find_idle_thread(&dst);
-		while (thread_index < 0) {
-			pr_err("no thread available, retrying...\n");
-			/* exponential backoff */
-			sleep(delay);
-			delay *= 2;
-			thread_index = find_idle_thread(&dst);
+		thread_index = claim_idle_thread(&dst);
+		if (thread_index < 0) {
+			/* all threads busy: the next thread to finish with its
+			 * client takes this one */
+			thread_index = queue_client(&dst, new_fd);
+			if (thread_index == -ENOSPC) {
+				pr_err("too many pending dst connections: closing %d\n",
+						new_fd);
+				close(new_fd);
+				continue;
+			} else if (thread_index < 0) {
+				pr_debug("no thread available: dst connection %d queued\n",
+						new_fd);
+				continue;
+			}
 		}
-		/* reset delay after worker thread found */
-		delay = INITIAL_DELAY;
+
+		/* messages are due from the time the worker is assigned */
+		start_seq = join_receivers();
 
 		/* check thread state */
 		switch (dst.workers[thread_index].status) {
 		case THREAD_AVAILABLE:
-			init_thread_info(&dst, thread_index, new_fd, client_ts);
+			init_thread_info(&dst, thread_index, new_fd, start_seq);
 
 			res = pthread_create(&dst.workers[thread_index].thread,
 					NULL, run_dst_worker, &dst.workers[thread_index].args);
 			if (res != 0) {
-				p_error("pthread_create", errno);
-				exit(errno);
+				p_error("pthread_create", res);
+				exit(res);
 			}
+			pin_thread(dst.workers[thread_index].thread,
+					init_args.worker_cpus, thread_index,
+					"destination worker");
 			break;
 		case THREAD_READY:
 			/* reassign file descriptor and signal */
-			wake_up_thread(&dst, thread_index, new_fd, client_ts);
+			wake_up_thread(&dst, thread_index, new_fd, start_seq);
 			break;
 		default:
 			break;
@@ -234,41 +1368,216 @@ void *run_dst_server(void *data)
 
 /**
  * @brief Run cleanup worker
- * @details Walk the message queue, deleting message data for entries past their
- * TTL
+ * @details Schedule every new message still pending on a timer wheel and expire
+ * it for the receivers that have yet to claim it once its TTL is up. Message
+ * data is usually freed as soon as every receiver it was due to has sent it;
+ * expiry bounds how long a slow or stalled receiver can hold on to it. The
+ * worker sleeps until the next timer is due or (with per-message TTLs, where a
+ * new message may expire before every scheduled one) a new message arrives.
+ * Closed message log segments are written back to disk, and those past their
+ * retention limits deleted, as it goes.
  */
 void *run_cleanup_worker(void *data)
 {
-	struct msg_entry *current = NULL, *prev = NULL, *next = NULL;
-	struct timespec now, msg_plus_ttl;
+	uint64_t scanned = 0, tail;
+	struct timespec now, deadline, next;
+	struct timer_wheel *wheel;
 
-	/* clean up messages in the queue that are past their TTL */
-	while (true) {
-		current = get_msg_entry(&msg_queue_head, &msg_lock, &msg_cond,
-				current, prev, true);
+	wheel = malloc(sizeof(struct timer_wheel));
+	if (!wheel) {
+		p_error("malloc", errno);
+		exit(errno);
+	}
+	init_timer_wheel(wheel);
 
-		if (current->msg) {
-			get_clock_time(&now);
-			msg_plus_ttl = current->timestamp;
-			msg_plus_ttl.tv_sec += init_args.ttl;
+	while (true) {
+		if (!next_expiry(wheel, &next)) {
+			tail = wait_for_msgs(&msg_ring, scanned, &msg_lock,
+					&msg_cond, NULL);
+		} else if (init_args.msg_ttl) {
+			tail = wait_for_msgs_until(&msg_ring, scanned, &msg_lock,
+					&msg_cond, &next);
+		} else {
+			/* new messages expire after every scheduled one */
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&next, NULL) == EINTR);
+			tail = ring_tail(&msg_ring);
+		}
 
-			/* remove and free the entry if its TTL has passed */
-			if (compare_times(&msg_plus_ttl, &now)) {
-				pr_debug("cleanup: freeing %d-byte message\n",
-						current->msg->len);
-				free_msg_data(&current, &msg_lock);
+		/* schedule new messages */
+		if (scanned < ring_head(&msg_ring, tail)) {
+			/* overwritten messages have already been released */
+			scanned = ring_head(&msg_ring, tail);
+		}
+		for (; scanned < tail; scanned++) {
+			if (msg_pending(&msg_ring, scanned, &deadline)) {
+				schedule_expiry(wheel, scanned, &deadline);
 			}
 		}
 
-		pthread_mutex_lock(&msg_lock);
-		/* get next message */
-		next = TAILQ_NEXT(current, entries);
-		pthread_mutex_unlock(&msg_lock);
+		get_clock_time(&now);
+		add_count(&live_stats.cleanup.expired,
+				expire_due_msgs(wheel, &msg_ring, &now));
+
+		if (msg_log) {
+			sync_msg_log(msg_log);
+			trim_msg_log(msg_log);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Get the number of nanoseconds between two times
+ * @param start earlier time
+ * @param end later time
+ * @return `end - start` in nanoseconds
+ */
+int64_t elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000LL
+		+ (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * @brief Write how busy the destination workers are as a JSON object
+ * @param out stream to write to
+ * @details Busy and total worker threads (and clients waiting for one), or the
+ * number of receivers each egress worker serves
+ */
+void write_worker_stats(FILE *out)
+{
+	int pending;
+
+	if (egress) {
+		fprintf(out, "{\"egress_receivers\": [");
+		for (int i = 0; i < init_args.egress_threads; i++) {
+			fprintf(out, "%s%d", i ? ", " : "",
+					atomic_load(&egress[i].num_receivers));
+		}
+		fprintf(out, "]}");
+		return;
+	}
+
+	pthread_mutex_lock(&dst.pending.lock);
+	pending = dst.pending.len;
+	pthread_mutex_unlock(&dst.pending.lock);
+	fprintf(out, "{\"busy\": %d, \"total\": %d, \"pending\": %d}",
+			__builtin_popcountll(atomic_load(&dst.threads_status.data)),
+			dst.num_workers, pending);
+}
+
+/**
+ * @brief Write a snapshot of the live statistics as a JSON object
+ * @param out stream to write to
+ * @param last ingest totals of the previous snapshot (updated)
+ * @param last_time time of the previous snapshot (updated)
+ * @details Ingest rates are averaged since the previous snapshot. The queue
+ * depth is the number of messages the slowest receiver has yet to visit (at
+ * most the number of slots). Latency percentiles are only included with
+ * latency tracking.
+ */
+void write_stats(FILE *out, struct ingest_counters *last,
+		struct timespec *last_time)
+{
+	double secs;
+	uint64_t tail, depth;
+	struct ingest_counters ingest;
+	struct timespec now;
+
+	get_clock_time(&now);
+	sum_ingest_counters(&ingest);
+	secs = elapsed_ns(last_time, &now) / 1e9;
+	tail = ring_tail(&msg_ring);
+	depth = max_receiver_lag(tail);
+	if (depth > msg_ring.mask + 1) {
+		depth = msg_ring.mask + 1;
+	}
+
+	fprintf(out, "{\n  \"uptime_ms\": %ld,\n",
+			elapsed_ns(&live_stats.start, &now) / 1000000);
+	fprintf(out, "  \"ingest\": {\"msgs\": %lu, \"bytes\": %lu, \"msgs_per_sec\": %.1f, \"bytes_per_sec\": %.1f, \"bad_magic\": %lu, \"bad_checksum\": %lu, \"bad_options\": %lu},\n",
+			ingest.msgs, ingest.bytes,
+			(ingest.msgs - last->msgs) / secs,
+			(ingest.bytes - last->bytes) / secs,
+			ingest.bad_magic, ingest.bad_checksum, ingest.bad_options);
+	fprintf(out, "  \"queue\": {\"depth\": %lu, \"bytes\": %lu, \"tail\": %lu, \"expired\": %lu, \"overwritten\": %lu, \"full\": %lu, \"evicted\": %lu, \"throttled\": %lu},\n",
+			depth, queue_mem_usage(), tail,
+			atomic_load(&live_stats.cleanup.expired),
+			atomic_load(&msg_ring.overwritten),
+			atomic_load(&msg_ring.full),
+			atomic_load(&queue_budget.evicted),
+			atomic_load(&queue_budget.throttled));
+	fprintf(out, "  \"lag\": {\"disconnected\": %lu, \"stalled\": %lu, \"skipped\": %lu, \"skipped_msgs\": %lu, \"expired\": %lu, \"expired_msgs\": %lu},\n",
+			atomic_load(&lag_stats.disconnected),
+			atomic_load(&lag_stats.stalled),
+			atomic_load(&lag_stats.skipped),
+			atomic_load(&lag_stats.skipped_msgs),
+			atomic_load(&lag_stats.expired),
+			atomic_load(&lag_stats.expired_msgs));
+	fprintf(out, "  \"replay\": {\"replays\": %lu, \"replayed_msgs\": %lu},\n",
+			atomic_load(&replay_stats.replays),
+			atomic_load(&replay_stats.replayed_msgs));
+	fprintf(out, "  \"zerocopy\": {\"zerocopy\": %lu, \"deferred_copy\": %lu, \"copied\": %lu},\n",
+			atomic_load(&zc_totals.zerocopy),
+			atomic_load(&zc_totals.deferred_copy),
+			atomic_load(&zc_totals.copied));
+	fprintf(out, "  \"latency\": ");
+	write_latency_stats(out);
+	fprintf(out, ",\n  \"workers\": ");
+	write_worker_stats(out);
+	fprintf(out, ",\n  \"receivers\": ");
+	write_receiver_stats(out, tail);
+	fprintf(out, "\n}\n");
+
+	*last = ingest;
+	*last_time = now;
+}
 
-		prev = current;
-		current = next;
+/**
+ * @brief Run stats server
+ * @param data unused
+ * @details Every connection to the stats socket is sent a snapshot of the live
+ * statistics, then closed. The snapshot is put together in memory first, so
+ * a slow reader never holds up receivers joining or leaving.
+ */
+void *run_stats_server(void *data)
+{
+	int server_fd, fd;
+	char *buf;
+	size_t len;
+	FILE *out;
+	struct ingest_counters last = { 0 };
+	struct timespec last_time = live_stats.start;
+
+	server_fd = unix_server_create(init_args.stats_socket, STATS_BACKLOG);
+	if (server_fd < 0) {
+		pr_err("error setting up stats socket %s\n", init_args.stats_socket);
+		exit(EXIT_FAILURE);
 	}
 
+	while (1) {
+		fd = accept(server_fd, NULL, NULL);
+		if (fd < 0) {
+			p_error("accept", errno);
+			continue;
+		}
+
+		out = open_memstream(&buf, &len);
+		if (!out) {
+			p_error("open_memstream", errno);
+			close(fd);
+			continue;
+		}
+		write_stats(out, &last, &last_time);
+		fclose(out);
+
+		set_send_timeout(fd, STATS_SEND_TIMEOUT_MS);
+		send_msg(fd, (unsigned char *) buf, len);
+		free(buf);
+		close(fd);
+	}
 
 	return NULL;
 }
@@ -280,34 +1589,139 @@ void *run_cleanup_worker(void *data)
 int main(int argc, char *argv[])
 {
 	int res;
-	pthread_t dst_server_thread, cleanup_thread;
+	pthread_t dst_server_thread, cleanup_thread, liveness_thread, stats_thread;
+	pthread_t zc_reaper_thread;
+	pthread_condattr_t cond_attr;
+
+	/* save the CPUs unpinned threads run on */
+	init_affinity();
 
 	/* parse command-line arguments */
 	set_default_args(&init_args);
 	parse_args(argc, argv, &init_args);
-	pr_debug("extended = %d, num_workers = %d, backlog = %d, ttl = %d\n",
+	pr_debug("extended = %d, num_workers = %d, src_threads = %d, backlog = %d, ttl = %dms\n",
 			init_args.extended, init_args.num_workers,
-			init_args.backlog, init_args.ttl);
+			init_args.src_threads, init_args.backlog, init_args.ttl);
 
-	/* initialise client and message queues */
-	TAILQ_INIT(&msg_queue_head);
+	/* select checksum implementation */
+	init_checksum();
+	pr_debug("checksum implementation: %s\n", csum_impl_name());
+
+	/* set up splice fan-out */
+	if (init_args.splice_len > 0) {
+		init_fanout();
+	}
+
+	/* initialise message memory pool */
+	if (init_args.mem_node < 0 && init_args.worker_cpus) {
+		/* place messages on the node of the workers that send them */
+		init_args.mem_node = cpu_groups_node(init_args.worker_cpus);
+	}
+	init_pool(init_args.huge_pages, init_args.mem_node);
+
+	/* initialise message queue */
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&msg_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	if (init_args.log_dir) {
+		msg_log = open_msg_log(init_args.log_dir,
+				init_args.log_segment_size, init_args.log_max_age,
+				init_args.log_max_bytes);
+	}
+	/* replay from the log rather than retained messages if there is one */
+	init_msg_ring(&msg_ring, init_args.queue_len,
+			init_args.replay && !msg_log, init_args.overwrite,
+			msg_log ? log_next_seq(msg_log) : 0);
+	if (init_args.channels) {
+		init_channel_index(msg_ring.mask + 1);
+	}
+	init_queue_budget(init_args.max_queue_bytes, init_args.budget_policy);
+	init_live_stats(init_args.src_threads);
+	init_latency(init_args.latency_clock);
+	init_lag_limits(init_args.max_lag, init_args.max_lag_bytes,
+			init_args.max_lag_age, init_args.lag_policy);
 
 	/* allocate thread array */
 	init_workers(&dst, init_args.num_workers);
 
+	/* create reaper of closed zero-copy connections */
+	if (init_args.zerocopy_len > 0) {
+		init_zc_reaper();
+		res = pthread_create(&zc_reaper_thread, NULL, &run_zc_reaper,
+				NULL);
+		if (res != 0) {
+			p_error("pthread_create", res);
+			exit(res);
+		}
+		pin_thread(zc_reaper_thread, init_args.cleanup_cpus, 0,
+				"zero-copy reaper");
+	}
+
+	/* start egress workers */
+	if (init_args.egress_threads > 0) {
+		raise_fd_limit();
+		egress = malloc(init_args.egress_threads * sizeof(struct egress_worker));
+		if (!egress) {
+			p_error("malloc", errno);
+			exit(errno);
+		}
+
+		for (int i = 0; i < init_args.egress_threads; i++) {
+			init_egress_worker(&egress[i]);
+			res = pthread_create(&egress[i].thread, NULL,
+					&run_egress_worker, &egress[i]);
+			if (res != 0) {
+				p_error("pthread_create", res);
+				exit(res);
+			}
+			pin_thread(egress[i].thread, init_args.worker_cpus, i,
+					"egress");
+		}
+	} else {
+		/* start liveness monitor for worker threads' clients */
+		liveness_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (liveness_fd < 0) {
+			p_error("epoll_create1", errno);
+			exit(errno);
+		}
+
+		res = pthread_create(&liveness_thread, NULL,
+				&run_liveness_monitor, NULL);
+		if (res != 0) {
+			p_error("pthread_create", res);
+			exit(res);
+		}
+		pin_thread(liveness_thread, init_args.cleanup_cpus, 0, "liveness");
+	}
+
 	/* create destination server thread */
 	res = pthread_create(&dst_server_thread, NULL, &run_dst_server, NULL);
 	if (res != 0) {
-		p_error("pthread_create", errno);
+		p_error("pthread_create", res);
 		exit(res);
 	}
+	pin_thread(dst_server_thread, init_args.cleanup_cpus, 0,
+			"destination server");
 
 	/* create message cleanup thread */
 	res = pthread_create(&cleanup_thread, NULL, &run_cleanup_worker, NULL);
 	if (res != 0) {
-		p_error("pthread_create", errno);
+		p_error("pthread_create", res);
 		exit(res);
 	}
+	pin_thread(cleanup_thread, init_args.cleanup_cpus, 0, "cleanup");
+
+	/* create stats server thread */
+	if (init_args.stats_socket) {
+		res = pthread_create(&stats_thread, NULL, &run_stats_server,
+				NULL);
+		if (res != 0) {
+			p_error("pthread_create", res);
+			exit(res);
+		}
+		pin_thread(stats_thread, init_args.cleanup_cpus, 0, "stats");
+	}
 
 	/* run source server */
 	run_src_server(NULL);